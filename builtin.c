@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/utsname.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "builtin.h"
+#include "caps.h"
+#include "stanza.h"
+
+#define DISCO_INFO	"http://jabber.org/protocol/disco#info"
+#define DISCO_ITEMS	"http://jabber.org/protocol/disco#items"
+
+struct builtin {
+	const char *ns;
+	int (*payload)(const char *ns, const char *node, char *buf,
+	    size_t size);
+};
+
+static time_t started;
+static char *disco;	/* identity and features for disco#info */
+
+/* XEP-0199: the empty result is the answer */
+static int
+ping(const char *ns, const char *node, char *buf, size_t size)
+{
+	(void)ns;
+	(void)node;
+	if (size > 0)
+		buf[0] = '\0';
+	return 0;
+}
+
+/* XEP-0202 */
+static int
+send_time(const char *ns, const char *node, char *buf, size_t size)
+{
+	char tzo[BUFSIZ];
+	char utc[BUFSIZ];
+	time_t t = time(NULL);
+
+	(void)node;
+
+	/* +HHMM  */
+	strftime(tzo, sizeof tzo, "%z", localtime(&t));
+
+	/* convert "+HHMM" to "+HH:MM" */
+	tzo[6] = tzo[5];
+	tzo[5] = tzo[4];
+	tzo[4] = tzo[3];
+	tzo[3] = ':';
+
+	/* 2006-12-19T17:58:35Z */
+	strftime(utc, sizeof utc, "%FT%TZ", gmtime(&t));
+
+	return snprintf(buf, size,
+	  "<time xmlns='%s'>"
+	    "<tzo>%s</tzo>"
+	    "<utc>%s</utc>"
+	  "</time>", ns, tzo, utc);
+}
+
+/* XEP-0092 */
+static int
+version(const char *ns, const char *node, char *buf, size_t size)
+{
+	struct utsname u;
+
+	(void)node;
+	if (uname(&u) == -1)
+		return snprintf(buf, size,
+		  "<query xmlns='%s'>"
+		    "<name>" BUILTIN_NAME "</name>"
+		    "<version>" BUILTIN_VERSION "</version>"
+		  "</query>", ns);
+
+	return snprintf(buf, size,
+	  "<query xmlns='%s'>"
+	    "<name>" BUILTIN_NAME "</name>"
+	    "<version>" BUILTIN_VERSION "</version>"
+	    "<os>%s</os>"
+	  "</query>", ns, u.sysname);
+}
+
+/* XEP-0012: there is no idle detection, so answer the session time */
+static int
+last(const char *ns, const char *node, char *buf, size_t size)
+{
+	(void)node;
+	return snprintf(buf, size, "<query xmlns='%s' seconds='%lld'/>", ns,
+	    (long long)(time(NULL) - started));
+}
+
+/* XEP-0030: the node of entity capabilities is answered as well */
+static int
+disco_info(const char *ns, const char *node, char *buf, size_t size)
+{
+	return snprintf(buf, size, "<query xmlns='%s'%s%s%s>%s</query>", ns,
+	    node != NULL ? " node='" : "", node != NULL ? node : "",
+	    node != NULL ? "'" : "", disco != NULL ? disco : "");
+}
+
+static int
+disco_items(const char *ns, const char *node, char *buf, size_t size)
+{
+	(void)node;
+	return snprintf(buf, size, "<query xmlns='%s'/>", ns);
+}
+
+static const struct builtin builtins[] = {
+	{"urn:xmpp:ping",	ping},
+	{"urn:xmpp:time",	send_time},
+	{"jabber:iq:version",	version},
+	{"jabber:iq:last",	last},
+	{DISCO_INFO,		disco_info},
+	{DISCO_ITEMS,		disco_items},
+	{NULL, NULL}
+};
+
+static const struct builtin *
+lookup(const char *ns)
+{
+	const struct builtin *b;
+
+	for (b = builtins; b->ns != NULL; b++)
+		if (strcmp(b->ns, ns) == 0)
+			return b;
+
+	return NULL;
+}
+
+/* remembers the start of the session for the last activity */
+void
+builtin_init(void)
+{
+	started = time(NULL);
+}
+
+bool
+builtin_has(const char *ns)
+{
+	return lookup(ns) != NULL;
+}
+
+/*
+ * Writes the result of the get request in the namespace ns into buf.
+ * The node of the request is copied into disco#info results.
+ * Returns the length like snprintf(3) or -1 for unknown namespaces.
+ */
+int
+builtin_answer(const char *ns, const char *to, const char *id,
+    const char *node, char *buf, size_t size)
+{
+	const struct builtin *b;
+	int head, body, tail;
+
+	if ((b = lookup(ns)) == NULL)
+		return -1;
+
+	if (to != NULL)
+		head = snprintf(buf, size, "<iq type='result' to='%s' id='%s'>",
+		    to, id);
+	else
+		head = snprintf(buf, size, "<iq type='result' id='%s'>", id);
+	if (head < 0 || (size_t)head >= size)
+		return head;
+
+	body = b->payload(ns, node, buf + head, size - head);
+	if (body < 0 || (size_t)(head + body) >= size)
+		return body < 0 ? body : head + body;
+
+	tail = snprintf(buf + head + body, size - head - body, "</iq>");
+	if (tail < 0)
+		return tail;
+
+	return head + body + tail;
+}
+
+static int
+feature_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/*
+ * Builds the disco#info answer from the builtins and the namespaces of
+ * the extension programs and computes its ver of entity capabilities.
+ */
+bool
+builtin_disco(const char **names, size_t n, char *ver)
+{
+	const char **features;
+	const struct builtin *b;
+	size_t nfeatures = 0;
+	size_t len = 0;
+	char *str, *p;
+	bool ret = false;
+
+	if ((features = calloc(n + sizeof builtins / sizeof *builtins + 1,
+	    sizeof *features)) == NULL)
+		return false;
+	for (b = builtins; b->ns != NULL; b++)
+		features[nfeatures++] = b->ns;
+	features[nfeatures++] = CAPS_NS;
+	for (size_t i = 0; i < n; i++)
+		features[nfeatures++] = names[i];
+	qsort(features, nfeatures, sizeof *features, feature_cmp);
+
+	for (size_t i = 0; i < nfeatures; i++)
+		len += STANZA_ESCAPE_SIZE(strlen(features[i])) + 32;
+	len += 128;
+	if ((p = str = malloc(len)) == NULL)
+		goto out;
+
+	p += sprintf(p, "<query xmlns='" DISCO_INFO "'>"
+	    "<identity category='client' type='pc' name='" BUILTIN_NAME "'/>");
+	for (size_t i = 0; i < nfeatures; i++) {
+		if (i > 0 && strcmp(features[i], features[i - 1]) == 0)
+			continue;
+		p += sprintf(p, "<feature var='");
+		p += stanza_escape(features[i], strlen(features[i]), p,
+		    str + len - p);
+		p += sprintf(p, "'/>");
+	}
+	sprintf(p, "</query>");
+
+	if (caps_ver(str, ver) == false) {
+		free(str);
+		goto out;
+	}
+
+	/* keep just the content of the query */
+	p = strchr(str, '>') + 1;
+	memmove(str, p, strlen(p) + 1);
+	str[strlen(str) - strlen("</query>")] = '\0';
+	free(disco);
+	disco = str;
+	ret = true;
+ out:
+	free(features);
+	return ret;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BUILTIN_H
+#define BUILTIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BUILTIN_NAME	"sj"
+#define BUILTIN_VERSION	"0.1"
+
+/*
+ * Answers for cheap standard iq requests without an extension program.
+ * The attributes to, id and node have to be escaped already, to and node
+ * may be NULL.
+ */
+void builtin_init(void);
+bool builtin_has(const char *ns);
+int builtin_answer(const char *ns, const char *to, const char *id,
+    const char *node, char *buf, size_t size);
+bool builtin_disco(const char **names, size_t n, char *ver);
+
+#endif
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "caps.h"
+#include "stanza.h"
+
+struct sha1 {
+	uint32_t h[5];
+	uint64_t len;
+	unsigned char buf[64];
+	size_t n;
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1_block(struct sha1 *s, const unsigned char *p)
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+		    (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	for (; i < 80; i++)
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3]; e = s->h[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = ROL(b, 30); b = a; a = t;
+	}
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d; s->h[4] += e;
+}
+
+static void
+sha1_init(struct sha1 *s)
+{
+	static const uint32_t h[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+
+	memcpy(s->h, h, sizeof h);
+	s->len = 0;
+	s->n = 0;
+}
+
+static void
+sha1_update(struct sha1 *s, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	s->len += len;
+	while (len > 0) {
+		size_t n = sizeof s->buf - s->n;
+
+		if (n > len)
+			n = len;
+		memcpy(s->buf + s->n, p, n);
+		s->n += n;
+		p += n;
+		len -= n;
+		if (s->n == sizeof s->buf) {
+			sha1_block(s, s->buf);
+			s->n = 0;
+		}
+	}
+}
+
+static void
+sha1_final(struct sha1 *s, unsigned char digest[20])
+{
+	uint64_t bits = s->len * 8;
+	unsigned char pad[8];
+	int i;
+
+	sha1_update(s, "\x80", 1);
+	while (s->n != 56)
+		sha1_update(s, "", 1);
+	for (i = 0; i < 8; i++)
+		pad[i] = bits >> (56 - i * 8);
+	sha1_update(s, pad, sizeof pad);
+
+	for (i = 0; i < 20; i++)
+		digest[i] = s->h[i / 4] >> (24 - i % 4 * 8);
+}
+
+static void
+base64(const unsigned char *src, size_t len, char *dst)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	for (; len >= 3; src += 3, len -= 3) {
+		*dst++ = b64[src[0] >> 2];
+		*dst++ = b64[(src[0] & 0x03) << 4 | src[1] >> 4];
+		*dst++ = b64[(src[1] & 0x0f) << 2 | src[2] >> 6];
+		*dst++ = b64[src[2] & 0x3f];
+	}
+	if (len > 0) {
+		*dst++ = b64[src[0] >> 2];
+		if (len == 1) {
+			*dst++ = b64[(src[0] & 0x03) << 4];
+			*dst++ = '=';
+		} else {
+			*dst++ = b64[(src[0] & 0x03) << 4 | src[1] >> 4];
+			*dst++ = b64[(src[1] & 0x0f) << 2];
+		}
+		*dst++ = '=';
+	}
+	*dst = '\0';
+}
+
+/* growing list of strings */
+struct strs {
+	char **v;
+	size_t n;
+	size_t size;
+};
+
+static bool
+strs_add(struct strs *s, char *str)
+{
+	if (str == NULL)
+		return false;
+	if (s->n == s->size) {
+		size_t size = s->size == 0 ? 16 : s->size * 2;
+		char **v;
+
+		if ((v = realloc(s->v, size * sizeof *v)) == NULL) {
+			free(str);
+			return false;
+		}
+		s->v = v;
+		s->size = size;
+	}
+	s->v[s->n++] = str;
+
+	return true;
+}
+
+static void
+strs_free(struct strs *s)
+{
+	for (size_t i = 0; i < s->n; i++)
+		free(s->v[i]);
+	free(s->v);
+	memset(s, 0, sizeof *s);
+}
+
+static int
+strs_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* sorts the list and joins it with '<' after each string */
+static char *
+strs_join(struct strs *s, const char *head)
+{
+	size_t len = head == NULL ? 0 : strlen(head) + 1;
+	char *str, *p;
+
+	if (s->n > 0)
+		qsort(s->v, s->n, sizeof *s->v, strs_cmp);
+	for (size_t i = 0; i < s->n; i++)
+		len += strlen(s->v[i]) + 1;
+
+	if ((p = str = malloc(len + 1)) == NULL)
+		return NULL;
+	if (head != NULL)
+		p += sprintf(p, "%s<", head);
+	for (size_t i = 0; i < s->n; i++)
+		p += sprintf(p, "%s<", s->v[i]);
+	*p = '\0';
+
+	return str;
+}
+
+static char *
+attr(const char *elem, const char *name)
+{
+	char buf[BUFSIZ];
+
+	if (stanza_attr_copy(elem, name, buf, sizeof buf) == false)
+		buf[0] = '\0';
+
+	return strdup(buf);
+}
+
+static char *
+identity(const char *elem)
+{
+	char *category = attr(elem, "category");
+	char *type = attr(elem, "type");
+	char *lang = attr(elem, "xml:lang");
+	char *name = attr(elem, "name");
+	char *str = NULL;
+
+	if (category != NULL && type != NULL && lang != NULL && name != NULL &&
+	    asprintf(&str, "%s/%s/%s/%s", category, type, lang, name) == -1)
+		str = NULL;
+	free(category);
+	free(type);
+	free(lang);
+	free(name);
+
+	return str;
+}
+
+/*
+ * Computes the verification string of XEP-0115 section 5.4 from the
+ * identities, features and extended forms of the disco#info query.
+ */
+bool
+caps_ver(const char *query, char *ver)
+{
+	struct stanza_reader r;
+	struct stanza_token t;
+	struct strs ids = {0}, features = {0}, forms = {0};
+	struct strs fields = {0}, values = {0};
+	char *form_type = NULL;
+	char *var = NULL;
+	char *str = NULL;
+	bool in_value = false;
+	bool ret = false;
+	struct sha1 s;
+	unsigned char digest[20];
+
+	stanza_reader_init(&r, query);
+	while (stanza_next(&r, &t) != STANZA_EOF) {
+		switch (t.type) {
+		case STANZA_START:
+			if (slice_eq(&t.name, "identity")) {
+				if (strs_add(&ids, identity(t.elem)) == false)
+					goto out;
+			} else if (slice_eq(&t.name, "feature")) {
+				if (strs_add(&features, attr(t.elem, "var"))
+				    == false)
+					goto out;
+			} else if (slice_eq(&t.name, "field")) {
+				free(var);
+				if ((var = attr(t.elem, "var")) == NULL)
+					goto out;
+			} else if (slice_eq(&t.name, "value")) {
+				in_value = t.empty == false;
+				if (t.empty && var != NULL &&
+				    strs_add(&values, strdup("")) == false)
+					goto out;
+			}
+			break;
+		case STANZA_TEXT:
+			if (in_value) {
+				if ((str = malloc(t.text.len + 1)) == NULL)
+					goto out;
+				if (t.cdata) {
+					memcpy(str, t.text.ptr, t.text.len);
+					str[t.text.len] = '\0';
+				} else
+					str[stanza_unescape(t.text.ptr,
+					    t.text.len, str)] = '\0';
+				if (strs_add(&values, str) == false)
+					goto out;
+				in_value = false;
+			}
+			break;
+		case STANZA_END:
+			if (slice_eq(&t.name, "value") && in_value) {
+				/* empty value */
+				if (strs_add(&values, strdup("")) == false)
+					goto out;
+				in_value = false;
+			} else if (slice_eq(&t.name, "field") && var != NULL) {
+				if (strcmp(var, "FORM_TYPE") == 0) {
+					free(form_type);
+					form_type = strdup(values.n > 0 ?
+					    values.v[0] : "");
+					if (form_type == NULL)
+						goto out;
+				} else {
+					if ((str = strs_join(&values, var))
+					    == NULL)
+						goto out;
+					/* the form adds the last '<' */
+					str[strlen(str) - 1] = '\0';
+					if (strs_add(&fields, str) == false)
+						goto out;
+				}
+				strs_free(&values);
+				free(var);
+				var = NULL;
+			} else if (slice_eq(&t.name, "x")) {
+				if (form_type != NULL && strs_add(&forms,
+				    strs_join(&fields, form_type)) == false)
+					goto out;
+				strs_free(&fields);
+				free(form_type);
+				form_type = NULL;
+			}
+			break;
+		default:
+			goto out;
+		}
+	}
+
+	sha1_init(&s);
+	if ((str = strs_join(&ids, NULL)) == NULL) goto out;
+	sha1_update(&s, str, strlen(str));
+	free(str);
+	if ((str = strs_join(&features, NULL)) == NULL) goto out;
+	sha1_update(&s, str, strlen(str));
+	free(str);
+	if (forms.n > 0)
+		qsort(forms.v, forms.n, sizeof *forms.v, strs_cmp);
+	for (size_t i = 0; i < forms.n; i++)
+		sha1_update(&s, forms.v[i], strlen(forms.v[i]));
+	sha1_final(&s, digest);
+	base64(digest, sizeof digest, ver);
+	ret = true;
+ out:
+	strs_free(&ids);
+	strs_free(&features);
+	strs_free(&forms);
+	strs_free(&fields);
+	strs_free(&values);
+	free(form_type);
+	free(var);
+
+	return ret;
+}
+
+static bool
+is_base64(int c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+	    (c >= '0' && c <= '9') || c == '+' || c == '/' || c == '=';
+}
+
+/* encodes the ver for file names, it may contain a '/' */
+bool
+caps_name(const char *ver, char *name, size_t size)
+{
+	size_t i;
+
+	for (i = 0; ver[i] != '\0'; i++) {
+		if (i + 1 >= size || is_base64(ver[i]) == false)
+			return false;
+		name[i] = ver[i] == '/' ? '_' : ver[i];
+	}
+	name[i] = '\0';
+
+	return i > 0;
+}
+
+bool
+caps_unname(const char *name, char *ver, size_t size)
+{
+	size_t i;
+
+	for (i = 0; name[i] != '\0'; i++) {
+		if (i + 1 >= size || name[i] == '/')
+			return false;
+		ver[i] = name[i] == '_' ? '/' : name[i];
+		if (is_base64(ver[i]) == false)
+			return false;
+	}
+	ver[i] = '\0';
+
+	return i > 0;
+}
+
+/* reads our own ver, which iqd writes into the base directory */
+bool
+caps_read(const char *dir, char *ver)
+{
+	char path[PATH_MAX];
+	FILE *fh;
+	bool ret;
+
+	if (snprintf(path, sizeof path, "%s/" CAPS_FILE, dir) >=
+	    (int)sizeof path)
+		return false;
+	if ((fh = fopen(path, "r")) == NULL)
+		return false;
+	ret = fgets(ver, CAPS_VER_SIZE, fh) != NULL;
+	fclose(fh);
+	if (ret)
+		ver[strcspn(ver, "\n")] = '\0';
+
+	return ret && ver[0] != '\0';
+}
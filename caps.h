@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CAPS_H
+#define CAPS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CAPS_NS		"http://jabber.org/protocol/caps"
+#define CAPS_NODE	"https://klemkow.net/sj.html"
+#define CAPS_FILE	"caps"	/* our own ver in the base directory */
+#define CAPS_CACHE	".caps"	/* disco#info of others by their ver */
+#define CAPS_ID		"caps_"	/* prefix of our disco#info queries */
+
+/* base64 of a SHA-1 hash */
+#define CAPS_VER_SIZE	29
+
+/*
+ * Entity capabilities of XEP-0115.  caps_ver() computes the ver of a
+ * disco#info query element.  In file names and ids the '/' of a ver is
+ * written as '_', see caps_name().
+ */
+bool caps_ver(const char *query, char *ver);
+bool caps_name(const char *ver, char *name, size_t size);
+bool caps_unname(const char *name, char *ver, size_t size);
+bool caps_read(const char *dir, char *ver);
+
+#endif
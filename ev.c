@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Small event loop.  On Linux it uses epoll(7) with edge triggered events
+ * and a timerfd(2) for the timers.  Other systems get a poll(2) backend.
+ * Timers are kept in a list sorted by their deadline, which is cheap for
+ * the handful of timers the daemons need.
+ */
+
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#	include <sys/epoll.h>
+#	include <sys/timerfd.h>
+#else
+#	include <poll.h>
+#endif
+
+#include "ev.h"
+
+#define EV_BATCH 64
+
+struct ev_loop {
+	TAILQ_HEAD(, ev_timer) timers;
+
+	/* events of the current dispatch round */
+	struct ev_io **pending;
+	int *revents;
+	size_t npending;
+#ifdef __linux__
+	int epfd;
+	struct ev_io timer_io;
+	struct epoll_event events[EV_BATCH];
+
+	/* regular files, epoll(7) refuses them but they are always ready */
+	struct ev_io **files;
+	size_t nfiles;
+#else
+	struct ev_io **ios;
+	struct pollfd *pfds;
+	size_t nios;
+	size_t size;
+#endif
+};
+
+static void
+now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static bool
+before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec == b->tv_sec)
+		return a->tv_nsec < b->tv_nsec;
+	return a->tv_sec < b->tv_sec;
+}
+
+static void
+run_timers(struct ev_loop *loop)
+{
+	struct ev_timer *t;
+	struct timespec ts;
+
+	now(&ts);
+	while ((t = TAILQ_FIRST(&loop->timers)) != NULL &&
+	    !before(&ts, &t->when)) {
+		TAILQ_REMOVE(&loop->timers, t, next);
+		t->active = false;
+		t->cb(t);
+	}
+}
+
+#ifdef __linux__
+static bool
+arm_timer(struct ev_loop *loop)
+{
+	struct itimerspec its;
+	struct ev_timer *t = TAILQ_FIRST(&loop->timers);
+
+	memset(&its, 0, sizeof its);
+	if (t != NULL) {
+		its.it_value = t->when;
+		/* zero would disarm the timer */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	return timerfd_settime(loop->timer_io.fd, TFD_TIMER_ABSTIME, &its,
+	    NULL) == 0;
+}
+
+static void
+timer_cb(struct ev_io *io, int revents)
+{
+	struct ev_loop *loop = io->data;
+	uint64_t cnt;
+
+	(void)revents;
+	while (read(io->fd, &cnt, sizeof cnt) > 0)
+		;
+	run_timers(loop);
+	arm_timer(loop);
+}
+
+static uint32_t
+epoll_events(int events)
+{
+	uint32_t ev = EPOLLET;
+
+	if (events & EV_READ) ev |= EPOLLIN;
+	if (events & EV_WRITE) ev |= EPOLLOUT;
+
+	return ev;
+}
+
+struct ev_loop *
+ev_init(void)
+{
+	struct ev_loop *loop;
+
+	if ((loop = calloc(1, sizeof *loop)) == NULL)
+		return NULL;
+	TAILQ_INIT(&loop->timers);
+
+	loop->pending = calloc(EV_BATCH, sizeof *loop->pending);
+	loop->revents = calloc(EV_BATCH, sizeof *loop->revents);
+	if (loop->pending == NULL || loop->revents == NULL)
+		goto err;
+
+	if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		goto err;
+
+	loop->timer_io.fd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_NONBLOCK|TFD_CLOEXEC);
+	if (loop->timer_io.fd == -1)
+		goto err;
+	loop->timer_io.events = EV_READ;
+	loop->timer_io.cb = timer_cb;
+	loop->timer_io.data = loop;
+	if (ev_io_add(loop, &loop->timer_io) == false)
+		goto err;
+
+	return loop;
+ err:
+	free(loop->pending);
+	free(loop->revents);
+	free(loop);
+	return NULL;
+}
+
+static bool
+add_file(struct ev_loop *loop, struct ev_io *io)
+{
+	size_t n = loop->nfiles + 1;
+	void *p;
+
+	if ((p = realloc(loop->files, n * sizeof *loop->files)) == NULL)
+		return false;
+	loop->files = p;
+	p = realloc(loop->pending, (EV_BATCH + n) * sizeof *loop->pending);
+	if (p == NULL)
+		return false;
+	loop->pending = p;
+	p = realloc(loop->revents, (EV_BATCH + n) * sizeof *loop->revents);
+	if (p == NULL)
+		return false;
+	loop->revents = p;
+
+	io->slot = loop->nfiles++;
+	loop->files[io->slot] = io;
+
+	return true;
+}
+
+bool
+ev_io_add(struct ev_loop *loop, struct ev_io *io)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = epoll_events(io->events);
+	ev.data.ptr = io;
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, io->fd, &ev) == 0)
+		return true;
+	if (errno == EPERM)
+		return add_file(loop, io);
+
+	return false;
+}
+
+bool
+ev_io_mod(struct ev_loop *loop, struct ev_io *io, int events)
+{
+	struct epoll_event ev;
+
+	if (io->events == events)
+		return true;
+
+	io->events = events;
+	if (io->slot < loop->nfiles && loop->files[io->slot] == io)
+		return true;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = epoll_events(io->events);
+	ev.data.ptr = io;
+
+	return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, io->fd, &ev) == 0;
+}
+
+static bool
+backend_del(struct ev_loop *loop, struct ev_io *io)
+{
+	/* the kernel wants a non-NULL event pointer before 2.6.9 */
+	struct epoll_event ev;
+
+	if (io->slot < loop->nfiles && loop->files[io->slot] == io) {
+		loop->files[io->slot] = loop->files[--loop->nfiles];
+		loop->files[io->slot]->slot = io->slot;
+		return true;
+	}
+
+	return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, io->fd, &ev) == 0;
+}
+
+/* true if a regular file waits for events, it is ready right away */
+static bool
+files_ready(struct ev_loop *loop)
+{
+	for (size_t i = 0; i < loop->nfiles; i++)
+		if (loop->files[i]->events & (EV_READ|EV_WRITE))
+			return true;
+
+	return false;
+}
+
+static int
+backend_wait(struct ev_loop *loop)
+{
+	int timeout = files_ready(loop) ? 0 : -1;
+	int n;
+
+	n = epoll_wait(loop->epfd, loop->events, EV_BATCH, timeout);
+	if (n == -1)
+		return -1;
+
+	for (int i = 0; i < n; i++) {
+		uint32_t ev = loop->events[i].events;
+		int revents = 0;
+
+		if (ev & EPOLLIN) revents |= EV_READ;
+		if (ev & EPOLLOUT) revents |= EV_WRITE;
+		if (ev & (EPOLLERR|EPOLLHUP)) revents |= EV_ERROR;
+
+		loop->pending[i] = loop->events[i].data.ptr;
+		loop->revents[i] = revents;
+	}
+	loop->npending = n;
+
+	for (size_t i = 0; i < loop->nfiles; i++) {
+		struct ev_io *io = loop->files[i];
+		int revents = io->events & (EV_READ|EV_WRITE);
+
+		if (revents == 0)
+			continue;
+		loop->pending[loop->npending] = io;
+		loop->revents[loop->npending] = revents;
+		loop->npending++;
+	}
+
+	return loop->npending;
+}
+#else /* poll(2) backend */
+static bool
+arm_timer(struct ev_loop *loop)
+{
+	/* backend_wait() calculates the timeout of poll(2) */
+	(void)loop;
+	return true;
+}
+
+struct ev_loop *
+ev_init(void)
+{
+	struct ev_loop *loop;
+
+	if ((loop = calloc(1, sizeof *loop)) == NULL)
+		return NULL;
+	TAILQ_INIT(&loop->timers);
+
+	return loop;
+}
+
+static bool
+grow(struct ev_loop *loop)
+{
+	size_t size = loop->size == 0 ? EV_BATCH : loop->size * 2;
+	void *p;
+
+	if ((p = realloc(loop->ios, size * sizeof *loop->ios)) == NULL)
+		return false;
+	loop->ios = p;
+	if ((p = realloc(loop->pfds, size * sizeof *loop->pfds)) == NULL)
+		return false;
+	loop->pfds = p;
+	p = realloc(loop->pending, size * sizeof *loop->pending);
+	if (p == NULL)
+		return false;
+	loop->pending = p;
+	p = realloc(loop->revents, size * sizeof *loop->revents);
+	if (p == NULL)
+		return false;
+	loop->revents = p;
+
+	loop->size = size;
+	return true;
+}
+
+bool
+ev_io_add(struct ev_loop *loop, struct ev_io *io)
+{
+	if (loop->nios == loop->size && grow(loop) == false)
+		return false;
+
+	io->slot = loop->nios++;
+	loop->ios[io->slot] = io;
+
+	return true;
+}
+
+bool
+ev_io_mod(struct ev_loop *loop, struct ev_io *io, int events)
+{
+	(void)loop;
+	io->events = events;
+	return true;
+}
+
+static bool
+backend_del(struct ev_loop *loop, struct ev_io *io)
+{
+	if (io->slot >= loop->nios || loop->ios[io->slot] != io) {
+		errno = ENOENT;
+		return false;
+	}
+
+	/* move the last watcher into the free slot */
+	loop->ios[io->slot] = loop->ios[--loop->nios];
+	loop->ios[io->slot]->slot = io->slot;
+
+	return true;
+}
+
+static int
+backend_wait(struct ev_loop *loop)
+{
+	struct ev_timer *t = TAILQ_FIRST(&loop->timers);
+	int timeout = -1;
+	size_t i, n = 0;
+
+	if (t != NULL) {
+		struct timespec ts;
+
+		now(&ts);
+		if (before(&ts, &t->when))
+			timeout = (t->when.tv_sec - ts.tv_sec) * 1000 +
+			    (t->when.tv_nsec - ts.tv_nsec) / 1000000 + 1;
+		else
+			timeout = 0;
+	}
+
+	for (i = 0; i < loop->nios; i++) {
+		/*
+		 * poll(2) skips negative fds, else a watcher without events
+		 * would still wake us up for POLLHUP in every round.
+		 */
+		loop->pfds[i].fd = loop->ios[i]->events & (EV_READ|EV_WRITE) ?
+		    loop->ios[i]->fd : -1;
+		loop->pfds[i].events = 0;
+		loop->pfds[i].revents = 0;
+		if (loop->ios[i]->events & EV_READ)
+			loop->pfds[i].events |= POLLIN;
+		if (loop->ios[i]->events & EV_WRITE)
+			loop->pfds[i].events |= POLLOUT;
+	}
+
+	if (poll(loop->pfds, loop->nios, timeout) == -1)
+		return -1;
+
+	for (i = 0; i < loop->nios; i++) {
+		short ev = loop->pfds[i].revents;
+		int revents = 0;
+
+		if (ev == 0)
+			continue;
+		if (ev & POLLIN) revents |= EV_READ;
+		if (ev & POLLOUT) revents |= EV_WRITE;
+		if (ev & (POLLERR|POLLHUP|POLLNVAL)) revents |= EV_ERROR;
+
+		loop->pending[n] = loop->ios[i];
+		loop->revents[n] = revents;
+		n++;
+	}
+	loop->npending = n;
+
+	run_timers(loop);
+
+	return n;
+}
+#endif
+
+bool
+ev_io_del(struct ev_loop *loop, struct ev_io *io)
+{
+	/* forget events of this round, the watcher may be freed soon */
+	for (size_t i = 0; i < loop->npending; i++)
+		if (loop->pending[i] == io)
+			loop->pending[i] = NULL;
+
+	return backend_del(loop, io);
+}
+
+void
+ev_timer_add(struct ev_loop *loop, struct ev_timer *t, long msec)
+{
+	struct ev_timer *p;
+
+	if (t->active)
+		TAILQ_REMOVE(&loop->timers, t, next);
+
+	now(&t->when);
+	t->when.tv_sec += msec / 1000;
+	t->when.tv_nsec += (msec % 1000) * 1000000;
+	if (t->when.tv_nsec >= 1000000000) {
+		t->when.tv_sec++;
+		t->when.tv_nsec -= 1000000000;
+	}
+
+	/* keep the list sorted by deadline */
+	TAILQ_FOREACH(p, &loop->timers, next)
+		if (before(&t->when, &p->when))
+			break;
+	if (p != NULL)
+		TAILQ_INSERT_BEFORE(p, t, next);
+	else
+		TAILQ_INSERT_TAIL(&loop->timers, t, next);
+	t->active = true;
+
+	if (TAILQ_FIRST(&loop->timers) == t)
+		arm_timer(loop);
+}
+
+void
+ev_timer_del(struct ev_loop *loop, struct ev_timer *t)
+{
+	if (t->active == false)
+		return;
+
+	TAILQ_REMOVE(&loop->timers, t, next);
+	t->active = false;
+}
+
+/*
+ * Waits for the next events and calls the callbacks of all watchers and
+ * expired timers.  Returns the number of events or -1 on error.
+ */
+int
+ev_dispatch(struct ev_loop *loop)
+{
+	int n;
+
+	if ((n = backend_wait(loop)) == -1) {
+		if (errno == EINTR) {
+			errno = 0;
+			return 0;
+		}
+		return -1;
+	}
+
+	for (size_t i = 0; i < loop->npending; i++) {
+		struct ev_io *io = loop->pending[i];
+
+		if (io != NULL)
+			io->cb(io, loop->revents[i]);
+	}
+	loop->npending = 0;
+
+	return n;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef EV_H
+#define EV_H
+
+#include <sys/queue.h>
+
+#include <stdbool.h>
+#include <time.h>
+
+#define EV_READ		0x01
+#define EV_WRITE	0x02
+#define EV_ERROR	0x04
+
+/*
+ * Watcher for a file descriptor.  Events are edge triggered, so callbacks
+ * have to read or write until EAGAIN.  Regular files are always ready and
+ * get their events in every round.  The caller owns the memory.
+ */
+struct ev_io {
+	int fd;
+	int events;
+	void (*cb)(struct ev_io *io, int revents);
+	void *data;
+	size_t slot;		/* used by the backends */
+};
+
+struct ev_timer {
+	void (*cb)(struct ev_timer *t);
+	void *data;
+	bool active;
+	struct timespec when;
+	TAILQ_ENTRY(ev_timer) next;
+};
+
+struct ev_loop;
+
+struct ev_loop *ev_init(void);
+bool ev_io_add(struct ev_loop *loop, struct ev_io *io);
+bool ev_io_mod(struct ev_loop *loop, struct ev_io *io, int events);
+bool ev_io_del(struct ev_loop *loop, struct ev_io *io);
+void ev_timer_add(struct ev_loop *loop, struct ev_timer *t, long msec);
+void ev_timer_del(struct ev_loop *loop, struct ev_timer *t);
+int ev_dispatch(struct ev_loop *loop);
+
+#endif
@@ -0,0 +1,655 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+
+#define ISDIGIT(c) ((c) >= '0' && (c) <= '9')
+
+static int
+num(const char *p, size_t n)
+{
+	int v = 0;
+
+	while (n-- > 0)
+		v = v * 10 + *p++ - '0';
+
+	return v;
+}
+
+/* returns the time of the prompt "YYYY-MM-DD HH:MM" or -1 */
+time_t
+hist_time(const char *line, size_t len)
+{
+	static const char fmt[] = "dddd-dd-dd dd:dd";
+	struct tm tm;
+
+	if (len < sizeof fmt - 1)
+		return -1;
+	for (size_t i = 0; i < sizeof fmt - 1; i++)
+		if (fmt[i] == 'd' ? !ISDIGIT(line[i]) : line[i] != fmt[i])
+			return -1;
+
+	memset(&tm, 0, sizeof tm);
+	tm.tm_year = num(line, 4) - 1900;
+	tm.tm_mon = num(line + 5, 2) - 1;
+	tm.tm_mday = num(line + 8, 2);
+	tm.tm_hour = num(line + 11, 2);
+	tm.tm_min = num(line + 14, 2);
+	tm.tm_isdst = -1;
+
+	return mktime(&tm);
+}
+
+static bool
+write_all(int fd, const void *buf, size_t size)
+{
+	const char *p = buf;
+
+	while (size > 0) {
+		ssize_t n;
+
+		if ((n = write(fd, p, size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+/* opens the index at path and drops everything that does not fit */
+static int
+index_open(const char *path, int flags, size_t *n)
+{
+	struct hist_head head;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, flags|O_CLOEXEC, S_IRUSR|S_IWUSR)) == -1)
+		return -1;
+	if (fstat(fd, &st) == -1)
+		goto err;
+
+	*n = 0;
+	if (st.st_size >= (off_t)sizeof head &&
+	    pread(fd, &head, sizeof head, 0) == sizeof head &&
+	    memcmp(head.magic, HIST_MAGIC, sizeof head.magic) == 0 &&
+	    head.every == HIST_EVERY)
+		*n = (st.st_size - sizeof head) / sizeof(struct hist_entry);
+
+	return fd;
+ err:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Brings the index at path up to date with the log and returns the number
+ * of lines and the size of the log.  Only the part of the log behind the
+ * last entry is read, so this is cheap for an index, that is maintained.
+ */
+bool
+hist_sync(int log, const char *path, uint64_t *lines, uint64_t *size)
+{
+	struct hist_head head = {HIST_MAGIC, HIST_EVERY, 0};
+	struct hist_entry last = {0, 0, 0};
+	struct hist_entry *new = NULL;
+	size_t n, nnew = 0, snew = 0;
+	struct stat st;
+	char *map = NULL;
+	int fd = -1;
+
+	if (fstat(log, &st) == -1)
+		return false;
+	if ((fd = index_open(path, O_RDWR|O_CREAT, &n)) == -1)
+		return false;
+
+	if (n > 0 && pread(fd, &last, sizeof last, sizeof head +
+	    (n - 1) * sizeof last) != sizeof last)
+		goto err;
+	if (last.off > (uint64_t)st.st_size || last.line % HIST_EVERY != 0)
+		n = 0;
+
+	/* rewrite a broken index from the start */
+	if (n == 0) {
+		memset(&last, 0, sizeof last);
+		if (ftruncate(fd, 0) == -1) goto err;
+		if (pwrite(fd, &head, sizeof head, 0) != sizeof head)
+			goto err;
+	} else if (ftruncate(fd, sizeof head + n * sizeof last) == -1)
+		goto err;
+
+	*lines = last.line;
+	*size = st.st_size;
+
+	if (st.st_size > 0 && (map = mmap(NULL, st.st_size, PROT_READ,
+	    MAP_SHARED, log, 0)) == MAP_FAILED) {
+		map = NULL;
+		goto err;
+	}
+
+	for (size_t off = last.off; off < (size_t)st.st_size; (*lines)++) {
+		const char *p = map + off;
+		const char *nl;
+		size_t len = st.st_size - off;
+
+		bool known = n > 0 && *lines <= last.line;
+
+		if (*lines % HIST_EVERY == 0 && !known) {
+			if (nnew == snew) {
+				struct hist_entry *e;
+
+				snew = snew == 0 ? 64 : snew * 2;
+				e = realloc(new, snew * sizeof *e);
+				if (e == NULL)
+					goto err;
+				new = e;
+			}
+			new[nnew].line = *lines;
+			new[nnew].off = off;
+			new[nnew].time = hist_time(p, len);
+			nnew++;
+		}
+
+		/* an incomplete last line is not counted */
+		if ((nl = memchr(p, '\n', len)) == NULL)
+			break;
+		off = nl - map + 1;
+	}
+
+	if (lseek(fd, 0, SEEK_END) == -1) goto err;
+	if (write_all(fd, new, nnew * sizeof *new) == false) goto err;
+
+	if (map != NULL)
+		munmap(map, st.st_size);
+	free(new);
+	close(fd);
+	return true;
+ err:
+	if (map != NULL)
+		munmap(map, st.st_size);
+	free(new);
+	close(fd);
+	return false;
+}
+
+/* appends n entries to the index at path */
+bool
+hist_append(const char *path, const struct hist_entry *e, size_t n)
+{
+	bool ret;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY|O_APPEND|O_CLOEXEC)) == -1)
+		return false;
+	ret = write_all(fd, e, n * sizeof *e);
+	close(fd);
+
+	return ret;
+}
+
+/* returns the times of the first and the last line of the log */
+bool
+hist_bounds(int log, uint64_t size, time_t *first, time_t *last)
+{
+	char *map;
+	size_t off;
+
+	*first = *last = -1;
+	if (size == 0)
+		return true;
+	if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, log, 0))
+	    == MAP_FAILED)
+		return false;
+
+	/* the last line ends at size - 1 */
+	for (off = size - 1; off > 0 && map[off - 1] != '\n'; off--)
+		;
+	*first = hist_time(map, size);
+	*last = hist_time(map + off, size - off);
+
+	munmap(map, size);
+	return true;
+}
+
+const struct hist_codec hist_codecs[] = {
+	{"gzip", ".gz", NULL},
+	{"zstd", ".zst", "--rm"},
+	{NULL, NULL, NULL}
+};
+
+const struct hist_codec *
+hist_codec(const char *name)
+{
+	for (const struct hist_codec *c = hist_codecs; c->name != NULL; c++)
+		if (strcmp(c->name, name) == 0)
+			return c;
+
+	return NULL;
+}
+
+/* reads the manifest of the contact directory dir, it may not exist */
+bool
+hist_manifest(const char *dir, struct hist_seg **segs, size_t *n)
+{
+	char path[PATH_MAX];
+	char line[BUFSIZ];
+	struct hist_seg s;
+	size_t size = 0;
+	FILE *fh;
+
+	*segs = NULL;
+	*n = 0;
+
+	if (snprintf(path, sizeof path, "%s/%s", dir, HIST_MANIFEST) >=
+	    (int)sizeof path) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	if ((fh = fopen(path, "r")) == NULL)
+		return errno == ENOENT;
+
+	while (fgets(line, sizeof line, fh) != NULL) {
+		if (sscanf(line, "%u\t%31s\t%" SCNu64 "\t%" SCNu64 "\t%"
+		    SCNd64 "\t%" SCNd64, &s.seq, s.file, &s.lines, &s.bytes,
+		    &s.first, &s.last) != 6)
+			continue;
+
+		if (*n == size) {
+			struct hist_seg *new;
+
+			size = size == 0 ? 16 : size * 2;
+			if ((new = realloc(*segs, size * sizeof *new)) == NULL)
+				goto err;
+			*segs = new;
+		}
+		(*segs)[(*n)++] = s;
+	}
+	if (ferror(fh))
+		goto err;
+
+	fclose(fh);
+	return true;
+ err:
+	fclose(fh);
+	free(*segs);
+	*segs = NULL;
+	*n = 0;
+	return false;
+}
+
+/* replaces the manifest at once, so readers never see half of it */
+bool
+hist_manifest_save(const char *dir, const struct hist_seg *segs, size_t n)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	FILE *fh;
+
+	if (snprintf(path, sizeof path, "%s/%s", dir, HIST_MANIFEST) >=
+	    (int)sizeof path ||
+	    snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	if ((fh = fopen(tmp, "w")) == NULL)
+		return false;
+
+	for (size_t i = 0; i < n; i++)
+		fprintf(fh, "%u\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRId64
+		    "\t%" PRId64 "\n", segs[i].seq, segs[i].file,
+		    segs[i].lines, segs[i].bytes, segs[i].first, segs[i].last);
+
+	if (fclose(fh) == EOF)
+		goto err;
+	if (rename(tmp, path) == -1)
+		goto err;
+
+	return true;
+ err:
+	unlink(tmp);
+	return false;
+}
+
+/*
+ * Finds the file of the segment seq.  The uncompressed one is preferred,
+ * because it is just removed after the compressed one is complete.
+ */
+bool
+hist_seg_path(const char *dir, unsigned int seq, char *path, size_t size,
+    const struct hist_codec **codec)
+{
+	for (size_t i = 0; i == 0 || hist_codecs[i - 1].name != NULL; i++) {
+		const struct hist_codec *c;
+
+		c = i == 0 ? NULL : &hist_codecs[i - 1];
+
+		if (snprintf(path, size, "%s/out.%06u%s", dir, seq,
+		    c ? c->suffix : "") >= (int)size) {
+			errno = ENAMETOOLONG;
+			return false;
+		}
+		if (access(path, R_OK) == 0) {
+			*codec = c;
+			return true;
+		}
+	}
+
+	errno = ENOENT;
+	return false;
+}
+
+static bool
+map_log(struct hist *h, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &st) == -1)
+		goto err;
+	h->size = st.st_size;
+	if (h->size > 0 && (h->log = mmap(NULL, h->size, PROT_READ,
+	    MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		h->log = NULL;
+		goto err;
+	}
+
+	close(fd);
+	return true;
+ err:
+	close(fd);
+	return false;
+}
+
+/* decompresses the file at path into memory */
+static bool
+inflate(struct hist *h, const char *path, const struct hist_codec *codec)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	ssize_t n;
+	pid_t pid;
+	int status;
+	int fds[2];
+
+	if (pipe(fds) == -1)
+		return false;
+
+	switch ((pid = fork())) {
+	case -1:
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	case 0:
+		if (dup2(fds[1], STDOUT_FILENO) == -1)
+			_exit(EXIT_FAILURE);
+		close(fds[0]);
+		close(fds[1]);
+		execlp(codec->name, codec->name, "-dcq", path, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+
+	for (;;) {
+		if (h->size == size) {
+			char *new;
+
+			size = size == 0 ? BUFSIZ * 16 : size * 2;
+			if ((new = realloc(buf, size)) == NULL)
+				goto err;
+			buf = new;
+		}
+		if ((n = read(fds[0], buf + h->size, size - h->size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto err;
+		}
+		if (n == 0)
+			break;
+		h->size += n;
+	}
+	close(fds[0]);
+	fds[0] = -1;
+
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			goto err;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errno = EIO;
+		goto err;
+	}
+
+	h->log = buf;
+	h->heap = true;
+	return true;
+ err:
+	if (fds[0] != -1) {
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+	}
+	free(buf);
+	h->size = 0;
+	return false;
+}
+
+/* maps the index at path, if it exists and fits to the log */
+static void
+map_index(struct hist *h, const char *path)
+{
+	size_t n;
+	int fd;
+
+	if ((fd = index_open(path, O_RDONLY, &n)) == -1)
+		return;
+	if (n == 0)
+		goto out;
+
+	h->map_size = sizeof(struct hist_head) + n * sizeof *h->idx;
+	if ((h->map = mmap(NULL, h->map_size, PROT_READ, MAP_SHARED, fd, 0))
+	    == MAP_FAILED) {
+		h->map = NULL;
+		goto out;
+	}
+	h->idx = (const struct hist_entry *)
+	    ((char *)h->map + sizeof(struct hist_head));
+	h->n = n;
+
+	/* ignore entries beyond the log, they belong to an older one */
+	while (h->n > 0 && h->idx[h->n - 1].off > h->size)
+		h->n--;
+ out:
+	close(fd);
+}
+
+/*
+ * Maps the active history in the contact directory dir.  A missing index
+ * is not an error, the lookups just have to read the log from the start.
+ */
+bool
+hist_open(struct hist *h, const char *dir)
+{
+	char path[PATH_MAX];
+
+	memset(h, 0, sizeof *h);
+
+	if (snprintf(path, sizeof path, "%s/out", dir) >= (int)sizeof path) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	if (map_log(h, path) == false)
+		return false;
+	if (snprintf(path, sizeof path, "%s/out.idx", dir) < (int)sizeof path)
+		map_index(h, path);
+
+	return true;
+}
+
+/* loads the sealed segment s of the contact directory dir */
+bool
+hist_load(struct hist *h, const char *dir, const struct hist_seg *s)
+{
+	const struct hist_codec *codec;
+	char path[PATH_MAX];
+
+	memset(h, 0, sizeof *h);
+
+	if (hist_seg_path(dir, s->seq, path, sizeof path, &codec) == false)
+		return false;
+	if (codec == NULL ? map_log(h, path) == false :
+	    inflate(h, path, codec) == false)
+		return false;
+	if (snprintf(path, sizeof path, "%s/out.%06u.idx", dir, s->seq) <
+	    (int)sizeof path)
+		map_index(h, path);
+
+	return true;
+}
+
+void
+hist_close(struct hist *h)
+{
+	if (h->heap)
+		free((void *)h->log);
+	else if (h->log != NULL)
+		munmap((void *)h->log, h->size);
+	if (h->map != NULL)
+		munmap(h->map, h->map_size);
+	memset(h, 0, sizeof *h);
+}
+
+/* returns the last entry with a line number not above line or NULL */
+static const struct hist_entry *
+find_line(const struct hist *h, uint64_t line)
+{
+	size_t lo = 0, hi = h->n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (h->idx[mid].line <= line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo == 0 ? NULL : &h->idx[lo - 1];
+}
+
+/* returns the last entry with a time before t or NULL */
+static const struct hist_entry *
+find_time(const struct hist *h, time_t t)
+{
+	size_t lo = 0, hi = h->n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (h->idx[mid].time < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo == 0 ? NULL : &h->idx[lo - 1];
+}
+
+/* returns the offset of the line after the one at off */
+static size_t
+next_line(const struct hist *h, size_t off)
+{
+	const char *nl = memchr(h->log + off, '\n', h->size - off);
+
+	return nl == NULL ? h->size : (size_t)(nl - h->log) + 1;
+}
+
+/* returns the number of complete lines */
+uint64_t
+hist_count(const struct hist *h)
+{
+	const struct hist_entry *e = h->n > 0 ? &h->idx[h->n - 1] : NULL;
+	uint64_t line = e ? e->line : 0;
+	size_t off = e ? e->off : 0;
+
+	while (off < h->size) {
+		const char *nl = memchr(h->log + off, '\n', h->size - off);
+
+		if (nl == NULL)
+			break;
+		off = nl - h->log + 1;
+		line++;
+	}
+
+	return line;
+}
+
+/* returns the offset of the line with the number line or the log size */
+size_t
+hist_line(const struct hist *h, uint64_t line)
+{
+	const struct hist_entry *e = find_line(h, line);
+	uint64_t l = e ? e->line : 0;
+	size_t off = e ? e->off : 0;
+
+	for (; l < line && off < h->size; l++)
+		off = next_line(h, off);
+
+	return off;
+}
+
+/*
+ * Returns the number of the first line with a time not before t and its
+ * offset in *off.  Lines without a prompt have the time of the line before.
+ */
+uint64_t
+hist_since(const struct hist *h, time_t t, size_t *off)
+{
+	const struct hist_entry *e = find_time(h, t);
+	uint64_t line = e ? e->line : 0;
+	size_t o = e ? e->off : 0;
+
+	for (; o < h->size; line++) {
+		time_t lt = hist_time(h->log + o, h->size - o);
+
+		if (lt != -1 && lt >= t)
+			break;
+		o = next_line(h, o);
+	}
+
+	*off = o;
+	return line;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The history of a contact is the text file "out".  Every line starts with
+ * a "YYYY-MM-DD HH:MM " prompt.  The sidecar "out.idx" holds a header and
+ * an entry for every HIST_EVERY-th line, so readers find lines by number
+ * or time without scanning the whole file.
+ *
+ * Older lines may be sealed into segments "out.NNNNNN", which are listed in
+ * the file "manifest" and compressed in the background.  Each segment
+ * keeps its own index "out.NNNNNN.idx" of the uncompressed data.
+ */
+#define HIST_MAGIC	"sjidx001"
+#define HIST_EVERY	64
+#define HIST_MANIFEST	"manifest"
+
+struct hist_head {
+	char magic[8];
+	uint32_t every;
+	uint32_t pad;
+};
+
+struct hist_entry {
+	uint64_t line;		/* number of the line, starting at 0 */
+	uint64_t off;		/* byte offset of the line in out */
+	int64_t time;		/* time of its prompt */
+};
+
+/* a line of the manifest */
+struct hist_seg {
+	unsigned int seq;
+	char file[32];		/* name at the time of the last update */
+	uint64_t lines;
+	uint64_t bytes;		/* uncompressed */
+	int64_t first;		/* time of the first and the last line */
+	int64_t last;
+};
+
+/* external program to compress sealed segments */
+struct hist_codec {
+	const char *name;
+	const char *suffix;
+	const char *rm;		/* option to remove the input or NULL */
+};
+
+extern const struct hist_codec hist_codecs[];
+
+/* read only view of "out" or a segment */
+struct hist {
+	const char *log;
+	size_t size;
+	bool heap;		/* log is decompressed into memory */
+	const struct hist_entry *idx;
+	size_t n;
+	void *map;		/* mapping of the index file */
+	size_t map_size;
+};
+
+time_t hist_time(const char *line, size_t len);
+bool hist_sync(int log, const char *path, uint64_t *lines, uint64_t *size);
+bool hist_append(const char *path, const struct hist_entry *e, size_t n);
+
+bool hist_bounds(int log, uint64_t size, time_t *first, time_t *last);
+
+const struct hist_codec *hist_codec(const char *name);
+bool hist_manifest(const char *dir, struct hist_seg **segs, size_t *n);
+bool hist_manifest_save(const char *dir, const struct hist_seg *segs,
+    size_t n);
+bool hist_seg_path(const char *dir, unsigned int seq, char *path,
+    size_t size, const struct hist_codec **codec);
+
+bool hist_open(struct hist *h, const char *dir);
+bool hist_load(struct hist *h, const char *dir, const struct hist_seg *s);
+void hist_close(struct hist *h);
+uint64_t hist_count(const struct hist *h);
+size_t hist_line(const struct hist *h, uint64_t line);
+uint64_t hist_since(const struct hist *h, time_t t, size_t *off);
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+
+void
+usage(void)
+{
+	fprintf(stderr,
+	    "history [-c] [-d <dir>] [-n <lines>] [-s <since>] [-u <until>] "
+	    "<jid>\n"
+	    "  since, until: YYYY-MM-DD [HH:MM]\n");
+
+	exit(EXIT_FAILURE);
+}
+
+/* parses "YYYY-MM-DD" or "YYYY-MM-DD HH:MM" */
+static time_t
+parse_time(const char *str)
+{
+	char buf[BUFSIZ];
+	time_t t;
+
+	if (strlen(str) == sizeof "YYYY-MM-DD" - 1) {
+		snprintf(buf, sizeof buf, "%s 00:00", str);
+		str = buf;
+	}
+	if (strlen(str) != sizeof "YYYY-MM-DD HH:MM" - 1 ||
+	    (t = hist_time(str, strlen(str))) == -1)
+		usage();
+
+	return t;
+}
+
+/* time range of a query */
+struct range {
+	bool since;
+	bool until;
+	time_t since_t;
+	time_t until_t;
+};
+
+/* finds the lines [*first, *last) of h in the range r */
+static void
+find_range(const struct hist *h, const struct range *r, uint64_t *first,
+    size_t *first_off, uint64_t *last, size_t *last_off)
+{
+	*first = 0;
+	*first_off = 0;
+	if (r->since)
+		*first = hist_since(h, r->since_t, first_off);
+	if (r->until) {
+		*last = hist_since(h, r->until_t, last_off);
+	} else {
+		*last = hist_count(h);
+		*last_off = hist_line(h, *last);
+	}
+	if (*last < *first) {
+		*last = *first;
+		*last_off = *first_off;
+	}
+}
+
+/* opens the part i of the history, the last one is the active out */
+static bool
+open_part(struct hist *h, const char *dir, const struct hist_seg *segs,
+    size_t nsegs, size_t i)
+{
+	if (i == nsegs)
+		return hist_open(h, dir);
+
+	return hist_load(h, dir, &segs[i]);
+}
+
+/* counts the lines of the part i in the range r */
+static bool
+count_part(const char *dir, const struct hist_seg *segs, size_t nsegs,
+    size_t i, const struct range *r, uint64_t *count)
+{
+	const struct hist_seg *s = i < nsegs ? &segs[i] : NULL;
+	struct hist h;
+	uint64_t first, last;
+	size_t first_off, last_off;
+
+	*count = 0;
+	if (s != NULL && s->first != -1 && s->last != -1) {
+		if ((r->since && s->last < r->since_t) ||
+		    (r->until && s->first >= r->until_t))
+			return true;
+		/* the manifest knows about segments inside the range */
+		if ((!r->since || s->first >= r->since_t) &&
+		    (!r->until || s->last < r->until_t)) {
+			*count = s->lines;
+			return true;
+		}
+	}
+
+	if (open_part(&h, dir, segs, nsegs, i) == false)
+		return false;
+	find_range(&h, r, &first, &first_off, &last, &last_off);
+	hist_close(&h);
+	*count = last - first;
+
+	return true;
+}
+
+/* prints the lines of the part i in the range r, skipping the first ones */
+static bool
+print_part(const char *dir, const struct hist_seg *segs, size_t nsegs,
+    size_t i, const struct range *r, uint64_t skip)
+{
+	struct hist h;
+	uint64_t first, last;
+	size_t first_off, last_off;
+	bool ret = true;
+
+	if (open_part(&h, dir, segs, nsegs, i) == false)
+		return false;
+	find_range(&h, r, &first, &first_off, &last, &last_off);
+	if (skip > 0)
+		first_off = hist_line(&h, first + skip);
+	if (last_off > first_off &&
+	    fwrite(h.log + first_off, last_off - first_off, 1, stdout) != 1)
+		ret = false;
+	hist_close(&h);
+
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct range r = {false, false, 0, 0};
+	struct hist_seg *segs = NULL;
+	uint64_t *counts = NULL;
+	char path[PATH_MAX];
+	char *dir = getenv("SJ_DIR");
+	bool count = false;
+	uint64_t lines = 10;
+	bool lflag = false;
+	uint64_t total = 0, skip = 0;
+	size_t nsegs;
+	char *end;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "cd:n:s:u:h")) != -1) {
+		switch (ch) {
+		case 'c':
+			count = true;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'n':
+			errno = 0;
+			lines = strtoull(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || *optarg == '\0')
+				usage();
+			lflag = true;
+			break;
+		case 's':
+			r.since_t = parse_time(optarg);
+			r.since = true;
+			break;
+		case 'u':
+			r.until_t = parse_time(optarg);
+			r.until = true;
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || dir == NULL)
+		usage();
+
+	if (snprintf(path, sizeof path, "%s/%s", dir, argv[0]) >=
+	    (int)sizeof path) {
+		errno = ENAMETOOLONG;
+		goto err;
+	}
+
+	/* the sealed segments and out form one stream of lines */
+	if (hist_manifest(path, &segs, &nsegs) == false) goto err;
+	if ((counts = calloc(nsegs + 1, sizeof *counts)) == NULL) goto err;
+	for (size_t i = 0; i <= nsegs; i++) {
+		if (count_part(path, segs, nsegs, i, &r, &counts[i]) == false)
+			goto err;
+		total += counts[i];
+	}
+
+	if (count) {
+		printf("%" PRIu64 "\n", total);
+		goto out;
+	}
+
+	/* without a time range, just the tail is shown */
+	if ((lflag || (!r.since && !r.until)) && total > lines)
+		skip = total - lines;
+
+	for (size_t i = 0; i <= nsegs; i++) {
+		if (counts[i] <= skip) {
+			skip -= counts[i];
+			continue;
+		}
+		if (print_part(path, segs, nsegs, i, &r, skip) == false)
+			goto err;
+		skip = 0;
+	}
+ out:
+	free(counts);
+	free(segs);
+	if (fflush(stdout) == EOF) goto err;
+
+	return EXIT_SUCCESS;
+ err:
+	perror("history");
+	return EXIT_FAILURE;
+}
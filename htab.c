@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htab.h"
+
+#define HTAB_MIN 16
+
+/* 32 bit FNV-1a */
+static uint32_t
+hash(const char *key)
+{
+	uint32_t h = 2166136261U;
+
+	for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+		h ^= *p;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/* returns the slot of key or the empty slot where it belongs */
+static struct htab_slot *
+lookup(const struct htab *h, const char *key, uint32_t hv)
+{
+	size_t mask = h->size - 1;
+	size_t i = hv & mask;
+
+	for (;; i = (i + 1) & mask) {
+		struct htab_slot *s = &h->slots[i];
+
+		if (s->key == NULL)
+			return s;
+		if (s->hash == hv && strcmp(s->key, key) == 0)
+			return s;
+	}
+}
+
+static bool
+resize(struct htab *h, size_t size)
+{
+	struct htab_slot *old = h->slots;
+	size_t old_size = h->size;
+
+	if ((h->slots = calloc(size, sizeof *h->slots)) == NULL) {
+		h->slots = old;
+		return false;
+	}
+	h->size = size;
+
+	for (size_t i = 0; i < old_size; i++)
+		if (old[i].key != NULL)
+			*lookup(h, old[i].key, old[i].hash) = old[i];
+
+	free(old);
+	return true;
+}
+
+struct htab *
+htab_init(size_t hint)
+{
+	struct htab *h;
+	size_t size = HTAB_MIN;
+
+	/* keep the load factor below 1/2 */
+	while (size < hint * 2)
+		size *= 2;
+
+	if ((h = calloc(1, sizeof *h)) == NULL)
+		return NULL;
+	if ((h->slots = calloc(size, sizeof *h->slots)) == NULL) {
+		free(h);
+		return NULL;
+	}
+	h->size = size;
+
+	return h;
+}
+
+void
+htab_free(struct htab *h)
+{
+	if (h == NULL)
+		return;
+	free(h->slots);
+	free(h);
+}
+
+void *
+htab_get(const struct htab *h, const char *key)
+{
+	return lookup(h, key, hash(key))->value;
+}
+
+/* inserts or replaces the value of key */
+bool
+htab_put(struct htab *h, const char *key, void *value)
+{
+	uint32_t hv = hash(key);
+	struct htab_slot *s = lookup(h, key, hv);
+
+	if (s->key == NULL) {
+		if ((h->count + 1) * 2 > h->size) {
+			if (resize(h, h->size * 2) == false)
+				return false;
+			s = lookup(h, key, hv);
+		}
+		h->count++;
+	}
+
+	s->hash = hv;
+	s->key = key;
+	s->value = value;
+
+	return true;
+}
+
+/* removes key and returns its value, NULL if it was not found */
+void *
+htab_del(struct htab *h, const char *key)
+{
+	size_t mask = h->size - 1;
+	struct htab_slot *s = lookup(h, key, hash(key));
+	size_t i, j;
+	void *value;
+
+	if (s->key == NULL)
+		return NULL;
+
+	value = s->value;
+	h->count--;
+
+	/*
+	 * Shift the following entries of the cluster back, so lookups never
+	 * stop at the hole too early.  This needs no tombstones.
+	 */
+	for (i = j = s - h->slots;;) {
+		size_t home;
+
+		h->slots[i].key = NULL;
+		h->slots[i].value = NULL;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (h->slots[j].key == NULL)
+				return value;
+			home = h->slots[j].hash & mask;
+			/* move it, if its home is not between i and j */
+			if (i <= j ? (home <= i || home > j)
+			    : (home <= i && home > j))
+				break;
+		}
+		h->slots[i] = h->slots[j];
+		i = j;
+	}
+}
+
+/* iterates over all values, *iter has to start at 0 */
+void *
+htab_next(const struct htab *h, size_t *iter)
+{
+	for (; *iter < h->size; (*iter)++)
+		if (h->slots[*iter].key != NULL)
+			return h->slots[(*iter)++].value;
+
+	return NULL;
+}
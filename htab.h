@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HTAB_H
+#define HTAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hash table with open addressing and linear probing for string keys.  The
+ * table does not copy the keys, they have to live as long as their entry.
+ */
+struct htab_slot {
+	uint32_t hash;
+	const char *key;	/* NULL marks an empty slot */
+	void *value;
+};
+
+struct htab {
+	struct htab_slot *slots;
+	size_t size;		/* always a power of two */
+	size_t count;
+};
+
+struct htab *htab_init(size_t hint);
+void htab_free(struct htab *h);
+void *htab_get(const struct htab *h, const char *key);
+bool htab_put(struct htab *h, const char *key, void *value);
+void *htab_del(struct htab *h, const char *key);
+void *htab_next(const struct htab *h, size_t *iter);
+
+#endif
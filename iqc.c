@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iqc.h"
+#include "netstring.h"
+
+bool
+iqc_open(struct iqc *c, const char *dir)
+{
+	struct sockaddr_un sun;
+
+	memset(c, 0, sizeof *c);
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof sun.sun_path, "%s/" IQC_SOCK, dir)
+	    >= (int)sizeof sun.sun_path) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	if ((c->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return false;
+	if (connect(c->fd, (struct sockaddr *)&sun, sizeof sun) == -1 ||
+	    fcntl(c->fd, F_SETFL, O_NONBLOCK) == -1) {
+		close(c->fd);
+		c->fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/* reads what the socket has into the buffer */
+static bool
+fill(struct iqc *c)
+{
+	ssize_t n;
+
+	if (c->size - c->len < BUFSIZ) {
+		size_t size = c->size == 0 ? BUFSIZ * 2 : c->size * 2;
+		char *buf;
+
+		if ((buf = realloc(c->buf, size)) == NULL)
+			return false;
+		c->buf = buf;
+		c->size = size;
+	}
+	if ((n = read(c->fd, c->buf + c->len, c->size - c->len)) == -1)
+		return errno == EINTR || errno == EAGAIN;
+	if (n == 0) {
+		errno = ECONNRESET;
+		return false;
+	}
+	c->len += n;
+
+	return true;
+}
+
+/*
+ * Sends one stanza, blocking.  Results, that arrive meanwhile, are read
+ * into the buffer, so iqd never waits for us while we wait for it.
+ */
+bool
+iqc_send(struct iqc *c, const char *stanza, size_t len)
+{
+	char head[NETSTRING_HEAD];
+	struct iovec iov[3];
+	int n = netstring_head(head, len);
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = n;
+	iov[1].iov_base = (void *)stanza;
+	iov[1].iov_len = len;
+	iov[2].iov_base = ",";
+	iov[2].iov_len = 1;
+
+	for (int i = 0; i < 3;) {
+		ssize_t w;
+
+		if ((w = writev(c->fd, iov + i, 3 - i)) == -1) {
+			struct pollfd pfd = {c->fd, POLLIN|POLLOUT, 0};
+
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return false;
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+				return false;
+			if (pfd.revents & (POLLIN|POLLHUP) && fill(c) == false)
+				return false;
+			continue;
+		}
+		for (; i < 3 && (size_t)w >= iov[i].iov_len; i++)
+			w -= iov[i].iov_len;
+		if (i < 3) {
+			iov[i].iov_base = (char *)iov[i].iov_base + w;
+			iov[i].iov_len -= w;
+		}
+	}
+
+	return true;
+}
+
+static long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Returns the next result as a null terminated string, which the caller
+ * frees.  It waits at most msec, or forever if msec is negative.
+ */
+char *
+iqc_recv(struct iqc *c, int msec)
+{
+	long end = now() + msec;
+
+	for (;;) {
+		struct pollfd pfd = {c->fd, POLLIN, 0};
+		const char *data;
+		size_t size;
+		ssize_t n;
+		char *str;
+		int wait = -1;
+
+		n = netstring_parse(c->buf, c->len, IQC_RESULT_MAX, &data,
+		    &size);
+		if (n == -1) {
+			errno = EPROTO;
+			return NULL;
+		}
+		if (n > 0) {
+			if ((str = malloc(size + 1)) == NULL)
+				return NULL;
+			memcpy(str, data, size);
+			str[size] = '\0';
+			memmove(c->buf, c->buf + n, c->len - n);
+			c->len -= n;
+			return str;
+		}
+
+		if (msec >= 0 && (wait = end - now()) <= 0) {
+			errno = ETIMEDOUT;
+			return NULL;
+		}
+		if ((n = poll(&pfd, 1, wait)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return NULL;
+		}
+		if (n > 0 && fill(c) == false)
+			return NULL;
+	}
+}
+
+void
+iqc_close(struct iqc *c)
+{
+	if (c->fd != -1)
+		close(c->fd);
+	free(c->buf);
+	memset(c, 0, sizeof *c);
+	c->fd = -1;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IQC_H
+#define IQC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define IQC_SOCK	"iqd.sock"	/* socket of iqd in the base dir */
+#define IQC_TIMEOUT	30		/* default sec to wait for a result */
+#define IQC_RESULT_MAX	(64 * 1024 * 1024) /* longest result, e.g. rosters */
+
+/*
+ * Client of the iqd socket.  Every iq get or set is sent as a netstring
+ * and iqd answers with its result or error, when the server sent it.
+ * Many requests may be in flight, the results are matched by their id.
+ */
+struct iqc {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+bool iqc_open(struct iqc *c, const char *dir);
+bool iqc_send(struct iqc *c, const char *stanza, size_t len);
+char *iqc_recv(struct iqc *c, int msec);
+void iqc_close(struct iqc *c);
+
+#endif
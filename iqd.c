@@ -15,11 +15,14 @@
  */
 
 #include <sys/queue.h>
-#include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
@@ -34,135 +37,1928 @@
 #include <time.h>
 #include <unistd.h>
 
-#include <mxml.h>
+#include "bxml/bxml.h"
+
+#include "builtin.h"
+#include "caps.h"
+#include "ev.h"
+#include "htab.h"
+#include "iqc.h"
+#include "netstring.h"
+#include "rcache.h"
+#include "sjin.h"
+#include "stanza.h"
+#include "watch.h"
+
+#define WORKER_RESTART	1000	/* msec before the first restart */
+#define WORKER_BACKOFF	60000	/* longest msec between restarts */
+#define WORKER_STABLE	10	/* sec of running to forget crashes */
+#define WORKER_MAX	(256 * 1024) /* bytes buffered for a worker */
+#define WORKER_GRACE	2000	/* msec for workers to exit */
+
+#define JOBS_MAX	8	/* running one-shot programs */
+#define JOBS_NS		2	/* running programs per handler */
+#define JOBS_TIMEOUT	30	/* sec until a program is killed */
+#define JOBS_QUEUE	256	/* requests waiting for a program */
+
+#define PENDING_RETRY	50	/* msec before the first redelivery */
+#define PENDING_TTL	10000	/* msec to wait for a reader */
+#define PENDING_MAX	(256 * 1024) /* bytes of all pending results */
+
+#define REQUEST_ID	"iqd_"	/* prefix of the ids of client requests */
+#define REQUEST_TIMEOUT	30000	/* msec to wait for a result */
+#define CLIENT_MAX	(1024 * 1024)	/* unread results before throttling */
+
+struct context;
+
+enum handler_kind {
+	HANDLER_BUILTIN,	/* answered by iqd itself */
+	HANDLER_FILE,		/* the stanza is appended to a file */
+	HANDLER_EXEC,		/* one-shot program from ext/ */
+	HANDLER_WORKER		/* persistent program from worker/ */
+};
+
+/*
+ * Handler of a namespace from the directories ext/ and worker/.  A '/'
+ * in a namespace is written as "%2F" in the file name.  A name with a
+ * trailing '*' is the handler for all namespaces with this prefix.
+ */
+struct handler {
+	char *name;		/* decoded file name */
+	char *path;
+	enum handler_kind kind;
+	size_t prefix;		/* length of the prefix or 0 */
+};
+
+/*
+ * Persistent extension program from "<dir>/worker/<ns>".  It is started
+ * once with "-l -d <dir>" and gets one iq stanza per line on stdin.
+ */
+struct worker {
+	char *ns;
+	char *path;
+	struct context *ctx;
+	pid_t pid;		/* -1 if it is not running */
+	time_t started;
+	struct ev_io io;	/* stdin of the worker */
+	struct ev_timer restart;
+	long backoff;		/* msec to wait for the next restart */
+
+	/* stanzas, that are not written yet */
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+/* result for a fifo, that has no reader yet */
+struct pending {
+	char *path;
+	struct context *ctx;
+	struct ev_timer retry;
+	long delay;		/* msec until the next retry */
+	long waited;		/* msec waited so far */
+
+	char *buf;
+	size_t len;
+};
+
+/* request for a one-shot program from ext/ */
+struct job {
+	char *name;		/* of the handler */
+	char *path;
+	struct context *ctx;
+	pid_t pid;		/* -1 while it is queued */
+	struct ev_io io;	/* stdin of the program */
+	struct ev_timer timeout;
+
+	char *tag;
+	size_t off;
+	size_t len;
+	TAILQ_ENTRY(job) next;
+};
+
+TAILQ_HEAD(jobs, job);
+
+/* connection on the socket of iqd */
+struct client {
+	struct ev_io io;
+	struct context *ctx;
+	LIST_ENTRY(client) next;
+	bool throttled;		/* waits for space in sjin or wbuf */
+	TAILQ_ENTRY(client) throttled_next;
+
+	char *rbuf;		/* unhandled netstrings */
+	size_t rlen;
+	size_t rsize;
+	char *wbuf;		/* unwritten results */
+	size_t wlen;
+	size_t wsize;
+};
+
+/* request of a client, that waits for its result */
+struct request {
+	char *id;		/* our id for the server */
+	char *orig;		/* id of the client, escaped */
+	struct client *client;	/* NULL after the client is gone */
+	struct ev_timer deadline;
+	struct context *ctx;
+};
+
+struct context {
+	int fd_in;
+	struct bxml_ctx *bxml;
+	char *dir;
+	struct ev_loop *ev;
+	struct ev_io io_in;	/* stanzas from the server */
+	struct ev_io io_child;	/* wakes up on SIGCHLD */
+	struct htab *workers;	/* by namespace */
+	struct jobs queued;
+	struct jobs running;
+	size_t nqueued;
+	size_t nrunning;
+	size_t max_jobs;
+	size_t max_ns;
+	long timeout;		/* msec */
+	struct sjin in;		/* answers of the builtins */
+	struct htab *pending;	/* undelivered results by path */
+	size_t pending_len;
+	struct watcher watcher;
+	struct watch watch;	/* creation of result fifos */
+
+	/* handlers by their name, the prefixes longest first */
+	struct htab *handlers;
+	struct handler **prefixes;
+	size_t nprefixes;
+	bool stale;		/* rebuild the handlers before use */
+	struct watch watch_ext;
+	struct watch watch_worker;
+	char ver[CAPS_VER_SIZE];	/* of our entity capabilities */
+
+	/* clients on the socket */
+	struct ev_io io_sock;
+	char sock_path[PATH_MAX];
+	LIST_HEAD(, client) clients;
+	TAILQ_HEAD(, client) throttled;	/* clients with unread requests */
+	struct htab *requests;	/* by our id */
+	unsigned long seq;
+
+	/* local copy of the roster */
+	struct rcache roster;
+	const char *jid;	/* our bare jid, the source of pushes */
+	bool rosterver;		/* the server supports roster versioning */
+
+	bool quit;
+};
+
+#define NULL_CONTEXT {		\
+	STDIN_FILENO,		\
+	NULL,			\
+	".",			\
+	NULL,			\
+	{0},			\
+	{0},			\
+	NULL,			\
+	{0},			\
+	{0},			\
+	0,			\
+	0,			\
+	JOBS_MAX,		\
+	JOBS_NS,		\
+	JOBS_TIMEOUT * 1000,	\
+	{0},			\
+	NULL,			\
+	0,			\
+	{0},			\
+	{0},			\
+	NULL,			\
+	NULL,			\
+	0,			\
+	true,			\
+	{0},			\
+	{0},			\
+	"",			\
+	{0},			\
+	"",			\
+	LIST_HEAD_INITIALIZER(),\
+	{0},			\
+	NULL,			\
+	0,			\
+	{0},			\
+	NULL,			\
+	false,			\
+	false			\
+}
+
+static int child_pipe[2] = {-1, -1};
+
+void
+sigalarm(int sig)
+{
+	assert(sig == SIGALRM);
+}
+
+static void
+sigchld(int sig)
+{
+	int saved = errno;
+
+	(void)sig;
+	write(child_pipe[1], "", 1);
+	errno = saved;
+}
+
+static void worker_write_cb(struct ev_io *, int);
+
+/* writes as much of the buffer as the pipe takes */
+static void
+worker_flush(struct worker *w)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	if (w->io.fd == -1)
+		return;
+
+	while (off < w->len) {
+		if ((n = write(w->io.fd, w->buf + off, w->len - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				ev_io_mod(w->ctx->ev, &w->io, EV_WRITE);
+				break;
+			}
+			/* it is dying, SIGCHLD restarts it */
+			warn("%s", w->path);
+			ev_io_del(w->ctx->ev, &w->io);
+			close(w->io.fd);
+			w->io.fd = -1;
+			break;
+		}
+		off += n;
+	}
+
+	if (off > 0)
+		memmove(w->buf, w->buf + off, w->len - off);
+	w->len -= off;
+	if (w->len == 0 && w->io.fd != -1)
+		ev_io_mod(w->ctx->ev, &w->io, 0);
+	errno = 0;
+}
+
+static void
+worker_write_cb(struct ev_io *io, int revents)
+{
+	(void)revents;
+	worker_flush(io->data);
+}
+
+/*
+ * Starts the extension program path with a pipe on its stdin.  The write
+ * end is stored in fd and does not block.
+ */
+static pid_t
+spawn(const char *path, const char *dir, bool lines, int *fd)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) == -1)
+		return -1;
+	if (fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1)
+		goto err;
+
+	switch ((pid = fork())) {
+	case -1:
+		goto err;
+	case 0:
+		signal(SIGPIPE, SIG_DFL);
+		if (dup2(fds[0], STDIN_FILENO) == -1)
+			_exit(EXIT_FAILURE);
+		close(fds[0]);
+		if (lines)
+			execl(path, path, "-l", "-d", dir, (char *)NULL);
+		else
+			execl(path, path, "-d", dir, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[0]);
+	*fd = fds[1];
+
+	return pid;
+ err:
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+}
+
+static bool
+worker_start(struct worker *w)
+{
+	if ((w->pid = spawn(w->path, w->ctx->dir, true, &w->io.fd)) == -1)
+		return false;
+
+	w->started = time(NULL);
+	w->io.events = 0;
+	if (ev_io_add(w->ctx->ev, &w->io) == false) {
+		close(w->io.fd);
+		w->io.fd = -1;
+		return false;
+	}
+	worker_flush(w);
+
+	return true;
+}
+
+static void
+free_worker(struct worker *w)
+{
+	if (w == NULL) return;
+	ev_timer_del(w->ctx->ev, &w->restart);
+	if (w->io.fd != -1) {
+		ev_io_del(w->ctx->ev, &w->io);
+		close(w->io.fd);
+	}
+	free(w->buf);
+	free(w->path);
+	free(w->ns);
+	free(w);
+}
+
+static bool
+is_executable(const char *path)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) == -1)
+		return false;
+
+	return S_ISREG(sb.st_mode) && sb.st_mode & S_IXUSR;
+}
+
+static void
+worker_restart_cb(struct ev_timer *t)
+{
+	struct worker *w = t->data;
+
+	/* the program was removed, so its namespace is free again */
+	if (is_executable(w->path) == false) {
+		warnx("%s: removed, dropping %zu bytes", w->path, w->len);
+		htab_del(w->ctx->workers, w->ns);
+		free_worker(w);
+		errno = 0;
+		return;
+	}
+
+	if (worker_start(w) == false) {
+		warn("%s", w->path);
+		ev_timer_add(w->ctx->ev, &w->restart, w->backoff);
+	}
+}
+
+/* restarts a worker after it exited, later if it crashes repeatedly */
+static void
+worker_exited(struct worker *w, int status)
+{
+	if (time(NULL) - w->started >= WORKER_STABLE)
+		w->backoff = WORKER_RESTART;
+	else if ((w->backoff *= 2) > WORKER_BACKOFF)
+		w->backoff = WORKER_BACKOFF;
+
+	w->pid = -1;
+	if (w->io.fd != -1) {
+		ev_io_del(w->ctx->ev, &w->io);
+		close(w->io.fd);
+		w->io.fd = -1;
+	}
+
+	if (WIFEXITED(status))
+		warnx("%s: exited with %d", w->path, WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		warnx("%s: killed by signal %d", w->path, WTERMSIG(status));
+	ev_timer_add(w->ctx->ev, &w->restart, w->backoff);
+}
+
+static void
+free_job(struct job *j)
+{
+	if (j == NULL) return;
+	ev_timer_del(j->ctx->ev, &j->timeout);
+	if (j->io.fd != -1) {
+		ev_io_del(j->ctx->ev, &j->io);
+		close(j->io.fd);
+	}
+	free(j->tag);
+	free(j->path);
+	free(j->name);
+	free(j);
+}
+
+/* writes the stanza and closes the pipe, so the program sees the end */
+static void
+job_write_cb(struct ev_io *io, int revents)
+{
+	struct job *j = io->data;
+	ssize_t n;
+
+	(void)revents;
+	while (j->off < j->len) {
+		if ((n = write(io->fd, j->tag + j->off, j->len - j->off))
+		    == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				ev_io_mod(j->ctx->ev, io, EV_WRITE);
+				errno = 0;
+				return;
+			}
+			warn("%s", j->path);
+			break;
+		}
+		j->off += n;
+	}
+
+	ev_io_del(j->ctx->ev, io);
+	close(io->fd);
+	io->fd = -1;
+	errno = 0;
+}
+
+static void
+job_timeout_cb(struct ev_timer *t)
+{
+	struct job *j = t->data;
+
+	warnx("%s: timeout, killing %d", j->path, (int)j->pid);
+	kill(j->pid, SIGKILL);
+}
+
+static bool
+job_start(struct job *j)
+{
+	struct context *ctx = j->ctx;
+
+	if ((j->pid = spawn(j->path, ctx->dir, false, &j->io.fd)) == -1)
+		return false;
+
+	j->io.events = 0;
+	if (ev_io_add(ctx->ev, &j->io) == false) {
+		close(j->io.fd);
+		j->io.fd = -1;
+		kill(j->pid, SIGKILL);
+	} else
+		job_write_cb(&j->io, EV_WRITE);
+	ev_timer_add(ctx->ev, &j->timeout, ctx->timeout);
+
+	TAILQ_INSERT_TAIL(&ctx->running, j, next);
+	ctx->nrunning++;
+
+	return true;
+}
+
+/* starts the queued jobs, as far as the limits allow */
+static void
+run_jobs(struct context *ctx)
+{
+	struct job *j, *tmp;
+
+	for (j = TAILQ_FIRST(&ctx->queued); j != NULL; j = tmp) {
+		struct job *r;
+		size_t n = 0;
+
+		tmp = TAILQ_NEXT(j, next);
+		if (ctx->nrunning >= ctx->max_jobs)
+			break;
+
+		TAILQ_FOREACH(r, &ctx->running, next)
+			if (strcmp(r->name, j->name) == 0)
+				n++;
+		if (n >= ctx->max_ns)
+			continue;
+
+		TAILQ_REMOVE(&ctx->queued, j, next);
+		ctx->nqueued--;
+		if (job_start(j) == false) {
+			warn("%s", j->path);
+			free_job(j);
+		}
+	}
+	errno = 0;
+}
+
+/* queues the stanza for a one-shot program of the handler name */
+static bool
+job_add(struct context *ctx, const char *name, const char *path,
+    const char *tag)
+{
+	struct job *j;
+
+	if (ctx->nqueued >= JOBS_QUEUE) {
+		warnx("%s: too many queued requests", path);
+		errno = ENOBUFS;
+		return false;
+	}
+
+	if ((j = calloc(1, sizeof *j)) == NULL) return false;
+	j->ctx = ctx;
+	j->pid = -1;
+	j->io.fd = -1;
+	j->io.cb = job_write_cb;
+	j->io.data = j;
+	j->timeout.cb = job_timeout_cb;
+	j->timeout.data = j;
+	j->len = strlen(tag);
+	if ((j->name = strdup(name)) == NULL ||
+	    (j->path = strdup(path)) == NULL ||
+	    (j->tag = strdup(tag)) == NULL) {
+		free_job(j);
+		return false;
+	}
+
+	TAILQ_INSERT_TAIL(&ctx->queued, j, next);
+	ctx->nqueued++;
+	run_jobs(ctx);
+
+	return true;
+}
+
+/* reaps all children, the workers are restarted */
+static void
+child_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+	struct worker *w;
+	struct job *j;
+	char buf[64];
+	pid_t pid;
+	int status;
+
+	(void)revents;
+	while (read(io->fd, buf, sizeof buf) > 0)
+		;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		size_t iter = 0;
+
+		TAILQ_FOREACH(j, &ctx->running, next)
+			if (j->pid == pid)
+				break;
+		if (j != NULL) {
+			if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+				warnx("%s: exited with %d", j->path,
+				    WEXITSTATUS(status));
+			TAILQ_REMOVE(&ctx->running, j, next);
+			ctx->nrunning--;
+			free_job(j);
+			continue;
+		}
+
+		while ((w = htab_next(ctx->workers, &iter)) != NULL)
+			if (w->pid == pid) {
+				worker_exited(w, status);
+				break;
+			}
+	}
+	run_jobs(ctx);
+	errno = 0;
+}
+
+/* returns the running worker of the handler h or NULL */
+static struct worker *
+get_worker(struct context *ctx, const struct handler *h)
+{
+	struct worker *w;
+
+	if ((w = htab_get(ctx->workers, h->name)) != NULL)
+		return w;
+
+	if ((w = calloc(1, sizeof *w)) == NULL) goto err;
+	w->ctx = ctx;
+	w->pid = -1;
+	w->io.fd = -1;
+	w->io.cb = worker_write_cb;
+	w->io.data = w;
+	w->restart.cb = worker_restart_cb;
+	w->restart.data = w;
+	w->backoff = WORKER_RESTART;
+	if ((w->ns = strdup(h->name)) == NULL) goto err;
+	if ((w->path = strdup(h->path)) == NULL) goto err;
+	if (worker_start(w) == false) goto err;
+	if (htab_put(ctx->workers, w->ns, w) == false) goto err;
+
+	return w;
+ err:
+	warn("%s", h->path);
+	free_worker(w);
+	return NULL;
+}
+
+static void
+free_handlers(struct context *ctx)
+{
+	struct handler *h;
+	size_t iter = 0;
+
+	if (ctx->handlers == NULL)
+		return;
+
+	while ((h = htab_next(ctx->handlers, &iter)) != NULL) {
+		free(h->name);
+		free(h->path);
+		free(h);
+	}
+	htab_free(ctx->handlers);
+	free(ctx->prefixes);
+	ctx->handlers = NULL;
+	ctx->prefixes = NULL;
+	ctx->nprefixes = 0;
+}
+
+static unsigned int
+hex_digit(int c)
+{
+	return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/* decodes "%XX" in file names, returns false for bad names */
+static bool
+decode_name(const char *name, char *buf, size_t size)
+{
+	size_t len = 0;
+
+	for (; *name != '\0'; name++) {
+		unsigned int c = (unsigned char)*name;
+
+		if (c == '%') {
+			if (isxdigit((unsigned char)name[1]) == 0 ||
+			    isxdigit((unsigned char)name[2]) == 0)
+				return false;
+			c = hex_digit((unsigned char)name[1]) << 4 |
+			    hex_digit((unsigned char)name[2]);
+			if (c == '\0')
+				return false;
+			name += 2;
+		}
+		if (len + 1 >= size)
+			return false;
+		buf[len++] = c;
+	}
+	buf[len] = '\0';
+
+	return len > 0;
+}
+
+static int
+prefix_cmp(const void *a, const void *b)
+{
+	const struct handler *ha = *(struct handler * const *)a;
+	const struct handler *hb = *(struct handler * const *)b;
+
+	return (ha->prefix < hb->prefix) - (ha->prefix > hb->prefix);
+}
+
+/* adds the handlers of the directory sub, the first one of a name wins */
+static bool
+load_handlers(struct context *ctx, const char *sub, bool worker)
+{
+	char dir[PATH_MAX];
+	char name[NAME_MAX + 1];
+	struct dirent *de;
+	struct handler *h = NULL;
+	DIR *dh;
+
+	if (snprintf(dir, sizeof dir, "%s/%s", ctx->dir, sub) >=
+	    (int)sizeof dir)
+		return false;
+	if ((dh = opendir(dir)) == NULL)
+		return errno == ENOENT;
+
+	while ((de = readdir(dh)) != NULL) {
+		char path[PATH_MAX];
+		struct stat sb;
+		enum handler_kind kind;
+		size_t len;
+
+		if (de->d_name[0] == '.')
+			continue;
+		if (decode_name(de->d_name, name, sizeof name) == false)
+			continue;
+		if (htab_get(ctx->handlers, name) != NULL)
+			continue;
+		if (snprintf(path, sizeof path, "%s/%s", dir, de->d_name) >=
+		    (int)sizeof path || stat(path, &sb) == -1)
+			continue;
+
+		if (S_ISREG(sb.st_mode) && sb.st_mode & S_IXUSR)
+			kind = worker ? HANDLER_WORKER : HANDLER_EXEC;
+		else if (worker == false && S_ISDIR(sb.st_mode) == false)
+			kind = HANDLER_FILE;
+		else
+			continue;
+
+		if ((h = calloc(1, sizeof *h)) == NULL) goto err;
+		h->kind = kind;
+		if ((h->name = strdup(name)) == NULL) goto err;
+		if ((h->path = strdup(path)) == NULL) goto err;
+
+		len = strlen(name);
+		if (name[len - 1] == '*') {
+			void *p;
+
+			h->prefix = len - 1;
+			if ((p = realloc(ctx->prefixes, (ctx->nprefixes + 1) *
+			    sizeof *ctx->prefixes)) == NULL) goto err;
+			ctx->prefixes = p;
+		}
+		if (htab_put(ctx->handlers, h->name, h) == false) goto err;
+		if (h->prefix > 0)
+			ctx->prefixes[ctx->nprefixes++] = h;
+		h = NULL;
+	}
+	closedir(dh);
+	errno = 0;
+
+	return true;
+ err:
+	if (h != NULL) {
+		free(h->name);
+		free(h->path);
+		free(h);
+	}
+	closedir(dh);
+	return false;
+}
+
+/* stops the workers, that lost their program */
+static void
+stop_orphans(struct context *ctx)
+{
+	struct handler *h;
+	struct worker *w;
+	size_t iter = 0;
+
+	while ((w = htab_next(ctx->workers, &iter)) != NULL) {
+		h = htab_get(ctx->handlers, w->ns);
+		if (h != NULL && h->kind == HANDLER_WORKER &&
+		    strcmp(h->path, w->path) == 0)
+			continue;
+		if (w->io.fd == -1)
+			continue;
+
+		/* it exits on end of file and is dropped at its restart */
+		ev_io_del(ctx->ev, &w->io);
+		close(w->io.fd);
+		w->io.fd = -1;
+	}
+}
+
+/*
+ * Renews the disco#info answer from the handlers of whole namespaces and
+ * writes its ver into the base directory for presenced(1).
+ */
+static void
+update_caps(struct context *ctx)
+{
+	char ver[CAPS_VER_SIZE];
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	const char **names;
+	struct handler *h;
+	size_t iter = 0;
+	size_t n = 0;
+	FILE *fh;
+
+	if ((names = calloc(ctx->handlers->count + 1, sizeof *names)) == NULL)
+		goto err;
+	while ((h = htab_next(ctx->handlers, &iter)) != NULL)
+		if (h->prefix == 0)
+			names[n++] = h->name;
+	if (builtin_disco(names, n, ver) == false) {
+		free(names);
+		goto err;
+	}
+	free(names);
+
+	if (strcmp(ver, ctx->ver) == 0)
+		return;
+
+	if (snprintf(path, sizeof path, "%s/" CAPS_FILE, ctx->dir) >=
+	    (int)sizeof path ||
+	    snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp)
+		return;
+	if ((fh = fopen(tmp, "w")) == NULL) goto err;
+	fprintf(fh, "%s\n", ver);
+	if (fclose(fh) == EOF) goto err;
+	if (rename(tmp, path) == -1) goto err;
+	memcpy(ctx->ver, ver, sizeof ver);
+
+	return;
+ err:
+	warn("caps");
+	errno = 0;
+}
+
+/* builds the map of namespaces to their handlers */
+static bool
+load_all(struct context *ctx)
+{
+	char path[PATH_MAX];
+
+	free_handlers(ctx);
+	if ((ctx->handlers = htab_init(0)) == NULL)
+		return false;
+
+	/* the directories may be created later */
+	snprintf(path, sizeof path, "%s/worker", ctx->dir);
+	if (watch_add(&ctx->watcher, &ctx->watch_worker, path) == false &&
+	    errno != ENOENT)
+		warn("%s", path);
+	snprintf(path, sizeof path, "%s/ext", ctx->dir);
+	if (watch_add(&ctx->watcher, &ctx->watch_ext, path) == false &&
+	    errno != ENOENT)
+		warn("%s", path);
+	errno = 0;
+
+	/* persistent workers are preferred over one-shot programs */
+	if (load_handlers(ctx, "worker", true) == false ||
+	    load_handlers(ctx, "ext", false) == false)
+		return false;
+
+	if (ctx->nprefixes > 0)
+		qsort(ctx->prefixes, ctx->nprefixes, sizeof *ctx->prefixes,
+		    prefix_cmp);
+	stop_orphans(ctx);
+	update_caps(ctx);
+	ctx->stale = false;
+
+	return true;
+}
+
+/* returns the handler of the namespace ns or NULL */
+static const struct handler *
+lookup(struct context *ctx, const char *ns)
+{
+	static const struct handler builtin_handler = {
+		NULL, NULL, HANDLER_BUILTIN, 0
+	};
+	const struct handler *h;
+
+	if (ctx->stale && load_all(ctx) == false) {
+		warn("handlers");
+		ctx->stale = true;
+		return NULL;
+	}
+
+	/* extension programs override the builtins */
+	if ((h = htab_get(ctx->handlers, ns)) != NULL)
+		return h;
+	if (builtin_has(ns))
+		return &builtin_handler;
+
+	for (size_t i = 0; i < ctx->nprefixes; i++) {
+		h = ctx->prefixes[i];
+		if (strncmp(ns, h->name, h->prefix) == 0)
+			return h;
+	}
+
+	return NULL;
+}
+
+/* an entry of ext/ or worker/ changed, writes to file sinks are ignored */
+static void
+handlers_cb(struct watch *w, const char *name)
+{
+	struct context *ctx = w->data;
+
+	(void)name;
+	ctx->stale = true;
+}
+
+/* queues the stanza as one line for the worker */
+static bool
+worker_send(struct worker *w, const char *tag)
+{
+	size_t len = strlen(tag);
+	size_t need = w->len + STANZA_FLATTEN_SIZE(len);
+
+	if (need > WORKER_MAX) {
+		errno = ENOBUFS;
+		return false;
+	}
+	if (need > w->size) {
+		size_t size = w->size == 0 ? BUFSIZ : w->size;
+		char *buf;
+
+		while (size < need)
+			size *= 2;
+		if ((buf = realloc(w->buf, size)) == NULL)
+			return false;
+		w->buf = buf;
+		w->size = size;
+	}
+
+	w->len += stanza_flatten(tag, len, w->buf + w->len);
+	w->buf[w->len++] = '\n';
+	worker_flush(w);
+
+	return true;
+}
+
+/* closes the stdin of all workers and waits a while for their exit */
+static void
+stop_workers(struct context *ctx)
+{
+	struct timespec tick = {0, 10 * 1000 * 1000};
+	struct worker *w;
+	size_t iter;
+	int status;
+	bool running = true;
+
+	iter = 0;
+	while ((w = htab_next(ctx->workers, &iter)) != NULL) {
+		if (w->io.fd == -1)
+			continue;
+		/* let it take the rest */
+		fcntl(w->io.fd, F_SETFL, 0);
+		worker_flush(w);
+		close(w->io.fd);
+		w->io.fd = -1;
+	}
+
+	for (int i = 0; running && i < WORKER_GRACE / 10; i++) {
+		running = false;
+		iter = 0;
+		while ((w = htab_next(ctx->workers, &iter)) != NULL) {
+			if (w->pid == -1)
+				continue;
+			if (waitpid(w->pid, &status, WNOHANG) == 0)
+				running = true;
+			else
+				w->pid = -1;
+		}
+		if (running)
+			nanosleep(&tick, NULL);
+	}
+
+	iter = 0;
+	while ((w = htab_next(ctx->workers, &iter)) != NULL) {
+		if (w->pid == -1)
+			continue;
+		kill(w->pid, SIGTERM);
+		waitpid(w->pid, &status, 0);
+	}
+}
+
+static void
+free_pending(struct pending *p)
+{
+	if (p == NULL) return;
+	p->ctx->pending_len -= p->len;
+	htab_del(p->ctx->pending, p->path);
+	ev_timer_del(p->ctx->ev, &p->retry);
+	free(p->buf);
+	free(p->path);
+	free(p);
+}
+
+/*
+ * Writes buf into the file path.  Returns false with ENXIO, if it is a
+ * fifo without a reader.  A reader is there once the open succeeded, so
+ * the write blocks to deliver the whole result before the end of file.
+ */
+static bool
+deliver(const char *path, const char *buf, size_t len)
+{
+	int fd;
+
+	if ((fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_NONBLOCK|O_CLOEXEC,
+	    S_IRUSR|S_IWUSR)) == -1)
+		return false;
+	if (fcntl(fd, F_SETFL, O_APPEND) == -1) goto err;
+
+	while (len > 0) {
+		ssize_t n;
+
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto err;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return close(fd) == 0;
+ err:
+	close(fd);
+	return false;
+}
+
+static void
+pending_retry(struct pending *p)
+{
+	if (deliver(p->path, p->buf, p->len)) {
+		free_pending(p);
+		return;
+	}
+	if (errno != ENXIO) {
+		warn("%s", p->path);
+		free_pending(p);
+	} else if (p->waited >= PENDING_TTL) {
+		warnx("%s: no reader, dropping result", p->path);
+		free_pending(p);
+	}
+	errno = 0;
+}
+
+static void
+pending_cb(struct ev_timer *t)
+{
+	struct pending *p = t->data;
+
+	p->waited += p->delay;
+	if (p->delay < PENDING_TTL / 8)
+		p->delay *= 2;
+	ev_timer_add(p->ctx->ev, &p->retry, p->delay);
+	pending_retry(p);
+}
+
+/* a fifo of the base directory was created or changed */
+static void
+watch_cb(struct watch *w, const char *name)
+{
+	struct context *ctx = w->data;
+	struct pending *p;
+	char path[PATH_MAX];
+	size_t iter = 0;
+
+	if (name == NULL || strcmp(name, "ext") == 0 ||
+	    strcmp(name, "worker") == 0)
+		ctx->stale = true;
+
+	if (name != NULL) {
+		if (snprintf(path, sizeof path, "%s/%s", ctx->dir, name) >=
+		    (int)sizeof path)
+			return;
+		if ((p = htab_get(ctx->pending, path)) != NULL)
+			pending_retry(p);
+		return;
+	}
+
+	/* changes may be lost, so try all of them */
+	while ((p = htab_next(ctx->pending, &iter)) != NULL) {
+		size_t count = ctx->pending->count;
+
+		/* deletions move entries, so start again */
+		pending_retry(p);
+		if (ctx->pending->count != count)
+			iter = 0;
+	}
+}
+
+/*
+ * Writes the stanza into the file path.  If it is a fifo without reader,
+ * the stanza is kept and written later.  Results for the same path keep
+ * their order.
+ */
+static bool
+result(struct context *ctx, const char *path, const char *tag)
+{
+	struct pending *p;
+	size_t len = strlen(tag);
+	char *buf;
+
+	if ((p = htab_get(ctx->pending, path)) == NULL) {
+		if (deliver(path, tag, len))
+			return true;
+		if (errno != ENXIO)
+			return false;
+	}
+
+	if (ctx->pending_len + len > PENDING_MAX) {
+		warnx("%s: too many pending results", path);
+		errno = ENOBUFS;
+		return false;
+	}
+
+	if (p == NULL) {
+		if ((p = calloc(1, sizeof *p)) == NULL) return false;
+		p->ctx = ctx;
+		p->retry.cb = pending_cb;
+		p->retry.data = p;
+		p->delay = PENDING_RETRY;
+		if ((p->path = strdup(path)) == NULL ||
+		    htab_put(ctx->pending, p->path, p) == false) {
+			free(p->path);
+			free(p);
+			return false;
+		}
+		ev_timer_add(ctx->ev, &p->retry, p->delay);
+	}
+
+	if ((buf = realloc(p->buf, p->len + len)) == NULL)
+		return false;
+	memcpy(buf + p->len, tag, len);
+	p->buf = buf;
+	p->len += len;
+	ctx->pending_len += len;
+	errno = 0;
+
+	return true;
+}
+
+/*
+ * Stores the disco#info result of a query of presenced(1) in the cache,
+ * if its content matches the ver of the id.
+ */
+static void
+caps_result(struct context *ctx, const char *tag, const char *id)
+{
+	char ver[CAPS_VER_SIZE];
+	char check[CAPS_VER_SIZE];
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	const char *query;
+	FILE *fh;
+
+	if (caps_unname(id + strlen(CAPS_ID), ver, sizeof ver) == false)
+		return;
+	if ((query = stanza_child(tag, "query")) == NULL ||
+	    caps_ver(query, check) == false || strcmp(ver, check) != 0) {
+		warnx("%s: caps do not match", id);
+		return;
+	}
+
+	if (snprintf(path, sizeof path, "%s/" CAPS_CACHE "/%s", ctx->dir,
+	    id + strlen(CAPS_ID)) >= (int)sizeof path ||
+	    snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp)
+		return;
+	if ((fh = fopen(tmp, "w")) == NULL) goto err;
+	fputs(tag, fh);
+	if (fclose(fh) == EOF) goto err;
+	if (rename(tmp, path) == -1) goto err;
+
+	return;
+ err:
+	warn("%s", path);
+	errno = 0;
+}
+
+/*
+ * Returns a copy of the stanza tag with the id attribute set to the raw
+ * value id of len bytes.
+ */
+static char *
+set_id(const char *tag, const char *id, size_t len)
+{
+	struct slice name, old;
+	const char *pre, *post;
+	char *str;
+
+	if (stanza_attr(tag, "id", &old)) {
+		pre = old.ptr;
+		post = old.ptr + old.len;
+		if (asprintf(&str, "%.*s%.*s%s", (int)(pre - tag), tag,
+		    (int)len, id, post) == -1)
+			return NULL;
+	} else {
+		if (stanza_name(tag, &name) == false)
+			return NULL;
+		post = name.ptr + name.len;
+		if (asprintf(&str, "%.*s id='%.*s'%s", (int)(post - tag), tag,
+		    (int)len, id, post) == -1)
+			return NULL;
+	}
+
+	return str;
+}
+
+static void
+free_request(struct request *r)
+{
+	if (r == NULL) return;
+	htab_del(r->ctx->requests, r->id);
+	ev_timer_del(r->ctx->ev, &r->deadline);
+	free(r->orig);
+	free(r->id);
+	free(r);
+}
+
+static void
+free_client(struct client *c)
+{
+	struct context *ctx = c->ctx;
+	struct request *r;
+	size_t iter = 0;
 
-#include "bxml/bxml.h"
+	/* the results of its requests are dropped */
+	while ((r = htab_next(ctx->requests, &iter)) != NULL)
+		if (r->client == c)
+			r->client = NULL;
 
-struct context {
-	int fd_in;
-	struct bxml_ctx *bxml;
-	char *dir;
-};
+	LIST_REMOVE(c, next);
+	if (c->throttled)
+		TAILQ_REMOVE(&ctx->throttled, c, throttled_next);
+	ev_io_del(ctx->ev, &c->io);
+	close(c->io.fd);
+	free(c->rbuf);
+	free(c->wbuf);
+	free(c);
+}
 
-#define NULL_CONTEXT {		\
-	STDIN_FILENO,		\
-	NULL,			\
-	"."			\
+static int
+client_events(struct client *c)
+{
+	return (c->throttled ? 0 : EV_READ) | (c->wlen > 0 ? EV_WRITE : 0);
 }
 
-void
-sigalarm(int sig)
+/* writes as much as the socket takes */
+static bool
+client_flush(struct client *c)
 {
-	assert(sig == SIGALRM);
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < c->wlen) {
+		if ((n = write(c->io.fd, c->wbuf + off, c->wlen - off))
+		    == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return false;
+		}
+		off += n;
+	}
+
+	if (off > 0)
+		memmove(c->wbuf, c->wbuf + off, c->wlen - off);
+	c->wlen -= off;
+	ev_io_mod(c->ctx->ev, &c->io, client_events(c));
+	errno = 0;
+
+	return true;
+}
+
+/*
+ * Queues the stanza as netstring for the client.  The results of requests
+ * in flight are always taken, a full queue just throttles the client.
+ */
+static bool
+client_send(struct client *c, const char *stanza, size_t len)
+{
+	char head[NETSTRING_HEAD];
+	int n = netstring_head(head, len);
+	size_t need = c->wlen + n + len + 1;
+
+	if (len > IQC_RESULT_MAX) {
+		errno = ENOBUFS;
+		return false;
+	}
+	if (need > c->wsize) {
+		size_t size = c->wsize == 0 ? BUFSIZ : c->wsize;
+		char *buf;
+
+		while (size < need)
+			size *= 2;
+		if ((buf = realloc(c->wbuf, size)) == NULL)
+			return false;
+		c->wbuf = buf;
+		c->wsize = size;
+	}
+
+	memcpy(c->wbuf + c->wlen, head, n);
+	memcpy(c->wbuf + c->wlen + n, stanza, len);
+	c->wbuf[need - 1] = ',';
+	c->wlen = need;
+
+	return client_flush(c);
 }
 
+/* answers the client with the result, or with an error after timeout */
 static void
-recv_iq(char *tag, void *data)
+request_done(struct request *r, const char *tag)
 {
-	struct context *ctx = data;
-	/* HACK: we need this, cause mxml can't parse tags by itself */
-	static mxml_node_t *tree = NULL;
-	mxml_node_t *node = NULL;
-	const char *base = "<?xml ?>";
-	const char *tag_name = NULL;
-	const char *tag_type = NULL;
-	const char *tag_id = NULL;
-	const char *tag_ns = NULL;
-	char path[PATH_MAX];
-	int fd;
+	struct client *c = r->client;
+	char *str = NULL;
+	int len;
 
-	if (tree == NULL) tree = mxmlLoadString(tree, base, MXML_NO_CALLBACK);  
-	if (tree == NULL) err(EXIT_FAILURE, "unable to load xml base tag");
+	if (c == NULL)
+		goto out;
 
-	mxmlLoadString(tree, tag, MXML_NO_CALLBACK);
-	if ((node = mxmlGetFirstChild(tree)) == NULL)
+	if (tag != NULL) {
+		if (r->orig == NULL) {
+			str = strdup(tag);
+		} else
+			str = set_id(tag, r->orig, strlen(r->orig));
+		if (str == NULL) goto err;
+		len = strlen(str);
+	} else if ((len = asprintf(&str,
+		"<iq type='error' id='%s'>"
+			"<error type='wait'>"
+				"<remote-server-timeout xmlns='"
+				"urn:ietf:params:xml:ns:xmpp-stanzas'/>"
+			"</error>"
+		"</iq>", r->orig != NULL ? r->orig : r->id)) == -1) {
+		str = NULL;
 		goto err;
+	}
+
+	if (client_send(c, str, len) == false) goto err;
+ out:
+	free(str);
+	free_request(r);
+	return;
+ err:
+	warn("client");
+	if (c != NULL)
+		free_client(c);
+	free(str);
+	free_request(r);
+	errno = 0;
+}
+
+static void
+deadline_cb(struct ev_timer *t)
+{
+	request_done(t->data, NULL);
+}
+
+/* sends the iq of a client to the server with an id of our own */
+static bool
+client_request(struct client *c, char *tag)
+{
+	struct context *ctx = c->ctx;
+	struct request *r;
+	struct slice name, type, id;
+	char *str = NULL;
 
-	if ((tag_name = mxmlGetElement(node)) == NULL) goto err;
-	if (strcmp("iq", tag_name) != 0) goto err;
+	if (stanza_name(tag, &name) == false ||
+	    slice_eq(&name, "iq") == false ||
+	    stanza_attr(tag, "type", &type) == false ||
+	    (slice_eq(&type, "get") == false &&
+	     slice_eq(&type, "set") == false)) {
+		errno = EPROTO;
+		return false;
+	}
 
-	if ((tag_type = mxmlElementGetAttr(node, "type")) == NULL)
+	if ((r = calloc(1, sizeof *r)) == NULL) return false;
+	r->ctx = ctx;
+	r->client = c;
+	r->deadline.cb = deadline_cb;
+	r->deadline.data = r;
+	if (asprintf(&r->id, REQUEST_ID "%lu", ++ctx->seq) == -1) {
+		r->id = NULL;
 		goto err;
+	}
+	if (stanza_attr(tag, "id", &id) &&
+	    (r->orig = strndup(id.ptr, id.len)) == NULL) goto err;
+	if ((str = set_id(tag, r->id, strlen(r->id))) == NULL) goto err;
 
-	/* handle get/set */
-	if (strcmp(tag_type, "get") == 0 || strcmp(tag_type, "set") == 0) {
-		struct stat sb;
+	if (sjin_write(&ctx->in, str, strlen(str)) == false) goto err;
+	if (htab_put(ctx->requests, r->id, r) == false) goto err;
+	ev_timer_add(ctx->ev, &r->deadline, REQUEST_TIMEOUT);
+	free(str);
 
-		mxml_node_t *child = mxmlFindElement(node, tree, NULL,
-		    "xmlns", NULL, MXML_DESCEND);
+	return true;
+ err:
+	free(str);
+	free(r->orig);
+	free(r->id);
+	free(r);
+	return false;
+}
 
-		if ((tag_ns = mxmlElementGetAttr(child, "xmlns")) == NULL)
-			goto err;
+static bool
+client_blocked(struct client *c)
+{
+	return sjin_full(&c->ctx->in) || c->wlen >= CLIENT_MAX;
+}
 
-		/* TODO: deal with this kind of namespaces */
-		if (strncmp(tag_ns, "http://jabber.org/protocol/", 27) == 0)
-			return;
+/* sends the complete requests of the read buffer, while there is space */
+static bool
+client_requests(struct client *c)
+{
+	size_t off = 0;
+	bool ret = true;
 
-		/* filter namespaces with '..' to avoid exploitation */
-		if (strstr(tag_ns, "..") != NULL)
-			return;
+	while (client_blocked(c) == false) {
+		const char *data;
+		size_t size;
+		ssize_t n;
+		char *tag;
 
-		snprintf(path, sizeof path, "%s/ext/%s", ctx->dir, tag_ns);
-		if (stat(path, &sb) == -1) {
-			if (errno == ENOENT)
-				goto err;
-			goto err;
+		n = netstring_parse(c->rbuf + off, c->rlen - off,
+		    NETSTRING_MAX, &data, &size);
+		if (n == -1) {
+			errno = EPROTO;
+			ret = false;
+			break;
 		}
+		if (n == 0)
+			break;
+		off += n;
 
-		if (S_ISREG(sb.st_mode) && sb.st_mode & S_IXUSR) {
-			/* pipe tag to 3th party extension program */
-			char cmd[BUFSIZ];
-			FILE *fh;
+		if ((tag = strndup(data, size)) == NULL) {
+			ret = false;
+			break;
+		}
+		ret = client_request(c, tag);
+		free(tag);
+		if (ret == false)
+			break;
+	}
 
-			snprintf(cmd, sizeof cmd, "exec %s -d '%s'", path,
-			    ctx->dir);
+	if (off > 0)
+		memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+	c->rlen -= off;
 
-			if ((fh = popen(cmd, "w")) == NULL) goto err;
-			if (fwrite(tag, strlen(tag), 1, fh) == 0) goto err;
-			if (pclose(fh) == -1) goto err;
-		} else {
-			/* just write the tag into the non-executable file */
-			goto output;
+	return ret;
+}
+
+/*
+ * Reads the requests of the client and sends them to the server.  If sj
+ * does not take them or the client does not read its results fast
+ * enough, the client is throttled and the rest stays in the socket until
+ * resume_clients() is called.  Returns false with errno 0 at the end.
+ */
+static bool
+client_read(struct client *c)
+{
+	for (;;) {
+		ssize_t n;
+
+		if (client_requests(c) == false)
+			return false;
+
+		if (client_blocked(c)) {
+			if (c->throttled == false) {
+				c->throttled = true;
+				TAILQ_INSERT_TAIL(&c->ctx->throttled, c,
+				    throttled_next);
+			}
+			ev_io_mod(c->ctx->ev, &c->io, client_events(c));
+			return true;
 		}
 
-		goto out;
+		if (c->rsize - c->rlen < BUFSIZ) {
+			size_t size = c->rsize == 0 ? BUFSIZ * 2 : c->rsize * 2;
+			char *buf;
+
+			if (size > NETSTRING_MAX * 2) {
+				errno = ENOBUFS;
+				return false;
+			}
+			if ((buf = realloc(c->rbuf, size)) == NULL)
+				return false;
+			c->rbuf = buf;
+			c->rsize = size;
+		}
+		if ((n = read(c->io.fd, c->rbuf + c->rlen, c->rsize - c->rlen))
+		    == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return false;
+			errno = 0;
+			return true;
+		}
+		if (n == 0) {
+			errno = 0;
+			return false;
+		}
+		c->rlen += n;
 	}
+}
 
-	/* just handle results */
-	if (strcmp(tag_type, "result") != 0)
-		return;
+static void
+client_cb(struct ev_io *io, int revents)
+{
+	struct client *c = io->data;
 
-	if ((tag_id = mxmlElementGetAttr(node, "id")) == NULL)
+	if (revents & EV_WRITE && client_flush(c) == false)
 		goto err;
+	if ((revents & (EV_READ|EV_ERROR)) == 0 || c->throttled)
+		return;
 
-	snprintf(path, sizeof path, "%s/%s", ctx->dir, tag_id);
- output:
-	if ((fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_NONBLOCK,
-	    S_IRUSR|S_IWUSR)) == -1) {
-		if (errno == ENXIO) {
-			static int block = 0;
-			if (block++ < 10) {
-				usleep(100000);
-				goto output;
+	if (client_read(c))
+		return;
+	if (errno == 0)
+		goto close;
+ err:
+	warn("client");
+ close:
+	free_client(c);
+	errno = 0;
+}
+
+/*
+ * Flushes sjin and continues to read from throttled clients, until all
+ * are done or sj blocks.  In the latter case the write watcher or the
+ * reconnect timer of sjin wakes up the loop again.  Clients with too many
+ * unread results wait until their socket takes them.
+ */
+static void
+resume_clients(struct context *ctx)
+{
+	struct client *c, *tmp;
+	bool more = true;
+
+	while (more) {
+		more = false;
+		sjin_flush(&ctx->in);
+		for (c = TAILQ_FIRST(&ctx->throttled);
+		    c != NULL && sjin_full(&ctx->in) == false; c = tmp) {
+			tmp = TAILQ_NEXT(c, throttled_next);
+			if (c->wlen >= CLIENT_MAX)
+				continue;
+
+			TAILQ_REMOVE(&ctx->throttled, c, throttled_next);
+			c->throttled = false;
+			ev_io_mod(ctx->ev, &c->io, client_events(c));
+			if (client_read(c) == false) {
+				if (errno != 0)
+					warn("client");
+				free_client(c);
+				errno = 0;
 			}
+			more = true;
+		}
+	}
+}
+
+static void
+accept_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+	struct client *c;
+	int fd;
+
+	(void)revents;
+	while ((fd = accept(io->fd, NULL, NULL)) != -1) {
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+		    (c = calloc(1, sizeof *c)) == NULL) {
+			warn("accept");
+			close(fd);
+			continue;
+		}
+		c->ctx = ctx;
+		c->io.fd = fd;
+		c->io.events = EV_READ;
+		c->io.cb = client_cb;
+		c->io.data = c;
+		if (ev_io_add(ctx->ev, &c->io) == false) {
+			warn("accept");
+			close(fd);
+			free(c);
+			continue;
+		}
+		LIST_INSERT_HEAD(&ctx->clients, c, next);
+
+		/* data may be there already and events are edge triggered */
+		client_cb(&c->io, EV_READ);
+	}
+	if (errno != EAGAIN && errno != EINTR)
+		warn("accept");
+	errno = 0;
+}
+
+/* listens on the socket in the base directory for iqc(3) clients */
+static bool
+listen_sock(struct context *ctx)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof sun.sun_path, "%s/" IQC_SOCK,
+	    ctx->dir) >= (int)sizeof sun.sun_path) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return false;
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		goto err;
+
+	/* a socket of a former run is in the way */
+	if (unlink(sun.sun_path) == -1 && errno != ENOENT) goto err;
+	if (bind(fd, (struct sockaddr *)&sun, sizeof sun) == -1) goto err;
+	if (listen(fd, SOMAXCONN) == -1) goto err;
+
+	ctx->io_sock.fd = fd;
+	ctx->io_sock.events = EV_READ;
+	ctx->io_sock.cb = accept_cb;
+	ctx->io_sock.data = ctx;
+	if (ev_io_add(ctx->ev, &ctx->io_sock) == false) goto err;
+	memcpy(ctx->sock_path, sun.sun_path, sizeof sun.sun_path);
+
+	return true;
+ err:
+	close(fd);
+	return false;
+}
+
+/*
+ * Asks the server for the roster.  With roster versioning just the changes
+ * since the cached version come as pushes.
+ */
+static void
+roster_fetch(struct context *ctx)
+{
+	const char *ver = ctx->roster.ver;
+	char esc[STANZA_ESCAPE_SIZE(BUFSIZ)];
+	bool ret;
+
+	if (ctx->rosterver) {
+		if (ver == NULL)
+			ver = "";
+		stanza_escape(ver, strlen(ver), esc, sizeof esc);
+		ret = sjin_printf(&ctx->in,
+		    "<iq type='get' id='" RCACHE_ID "1'>"
+			"<query xmlns='" RCACHE_NS "' ver='%s'/>"
+		    "</iq>", esc);
+	} else
+		ret = sjin_printf(&ctx->in,
+		    "<iq type='get' id='" RCACHE_ID "1'>"
+			"<query xmlns='" RCACHE_NS "'/>"
+		    "</iq>");
+	if (ret == false)
+		warn("%s", RCACHE_FILE);
+	errno = 0;
+}
+
+/*
+ * True if the stanza comes from the server for our own account.  Just
+ * those may change the roster, see RFC 6121 2.1.6.  The bare jids are
+ * compared case insensitive, see jid_bare().
+ */
+static bool
+from_account(struct context *ctx, const char *tag)
+{
+	char from[BUFSIZ];
+	char key[BUFSIZ], our[BUFSIZ];
+
+	if (stanza_attr_copy(tag, "from", from, sizeof from) == false)
+		return true;
+
+	if (ctx->jid == NULL || strchr(from, '/') != NULL ||
+	    jid_bare(from, key, sizeof key) == false ||
+	    jid_bare(ctx->jid, our, sizeof our) == false ||
+	    strcmp(key, our) != 0) {
+		warnx("roster from %s ignored", from);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Replaces the cache with the roster of a result to our own fetch or to
+ * a request of a client, that still waits for it.
+ */
+static void
+roster_result(struct context *ctx, const char *tag, const char *id)
+{
+	const char *query;
+	struct slice ns;
+
+	if (strcmp(id, RCACHE_ID "1") != 0 &&
+	    (strncmp(id, REQUEST_ID, strlen(REQUEST_ID)) != 0 ||
+	     htab_get(ctx->requests, id) == NULL))
+		return;
+
+	if ((query = stanza_child(tag, "query")) == NULL ||
+	    stanza_attr(query, "xmlns", &ns) == false ||
+	    slice_eq(&ns, RCACHE_NS) == false ||
+	    from_account(ctx, tag) == false)
+		return;
+
+	if (rcache_apply(&ctx->roster, query, true) == false ||
+	    rcache_write(&ctx->roster) == false)
+		warn("%s", RCACHE_FILE);
+	errno = 0;
+}
+
+/* applies a roster push to the cache, pushes of others are ignored */
+static bool
+roster_push(struct context *ctx, const char *tag, const char *query)
+{
+	if (from_account(ctx, tag) == false)
+		return false;
+
+	if (rcache_apply(&ctx->roster, query, false) == false ||
+	    rcache_write(&ctx->roster) == false)
+		warn("%s", RCACHE_FILE);
+	errno = 0;
+
+	return true;
+}
+
+/* the server expects an empty result for its pushes */
+static void
+roster_ack(struct context *ctx, const char *tag)
+{
+	char id[BUFSIZ];
+	char esc_id[STANZA_ESCAPE_SIZE(sizeof id)];
+
+	if (stanza_attr_copy(tag, "id", id, sizeof id) == false)
+		return;
+	stanza_escape(id, strlen(id), esc_id, sizeof esc_id);
+	if (sjin_printf(&ctx->in, "<iq type='result' id='%s'/>", esc_id)
+	    == false)
+		warn("%s", RCACHE_NS);
+	errno = 0;
+}
+
+/* answers a get request of a builtin namespace in process */
+static void
+builtin(struct context *ctx, const char *tag, const char *ns)
+{
+	char from[BUFSIZ];
+	char id[BUFSIZ];
+	char esc_from[STANZA_ESCAPE_SIZE(sizeof from)];
+	char esc_id[STANZA_ESCAPE_SIZE(sizeof id)];
+	char node[BUFSIZ];
+	char esc_node[STANZA_ESCAPE_SIZE(sizeof node)];
+	char buf[BUFSIZ * 4];
+	const char *child;
+	struct slice type;
+	bool has_from, has_node;
+	int len;
+
+	if (stanza_attr(tag, "type", &type) == false ||
+	    slice_eq(&type, "get") == false)
+		return;
+	if (stanza_attr_copy(tag, "id", id, sizeof id) == false)
+		return;
+	has_from = stanza_attr_copy(tag, "from", from, sizeof from);
+	has_node = (child = stanza_child(tag, NULL)) != NULL &&
+	    stanza_attr_copy(child, "node", node, sizeof node);
+
+	/* the attributes are unescaped, so escape them again for our answer */
+	stanza_escape(id, strlen(id), esc_id, sizeof esc_id);
+	if (has_from)
+		stanza_escape(from, strlen(from), esc_from, sizeof esc_from);
+	if (has_node)
+		stanza_escape(node, strlen(node), esc_node, sizeof esc_node);
+
+	len = builtin_answer(ns, has_from ? esc_from : NULL, esc_id,
+	    has_node ? esc_node : NULL, buf, sizeof buf);
+	if (len < 0 || (size_t)len >= sizeof buf) {
+		warnx("%s: answer is too long", ns);
+		return;
+	}
+	if (sjin_write(&ctx->in, buf, len) == false)
+		warn("%s", ns);
+	errno = 0;
+}
+
+static void
+recv_iq(char *tag, void *data)
+{
+	struct context *ctx = data;
+	struct slice tag_name;
+	struct slice tag_type;
+	const struct handler *h;
+	struct worker *w;
+	const char *child = NULL;
+	char tag_id[BUFSIZ];
+	char tag_ns[BUFSIZ];
+	char path[PATH_MAX];
+	bool push = false;
+
+	if (stanza_name(tag, &tag_name) == false) goto err;
+	if (slice_eq(&tag_name, "iq") == false) goto err;
+
+	if (stanza_attr(tag, "type", &tag_type) == false)
+		goto err;
+
+	/* handle get/set */
+	if (slice_eq(&tag_type, "get") || slice_eq(&tag_type, "set")) {
+		/* the payload of the iq is qualified by its namespace */
+		if ((child = stanza_child(tag, NULL)) == NULL)
+			goto err;
+
+		if (stanza_attr_copy(child, "xmlns", tag_ns, sizeof tag_ns)
+		    == false)
+			goto err;
+
+		/* a handler of the roster still sees the pushes */
+		if (slice_eq(&tag_type, "set") &&
+		    strcmp(tag_ns, RCACHE_NS) == 0 &&
+		    (push = roster_push(ctx, tag, child)) == false)
 			goto out;
+
+		if ((h = lookup(ctx, tag_ns)) == NULL) {
+			if (push)
+				roster_ack(ctx, tag);
+			goto out;
+		}
+
+		switch (h->kind) {
+		case HANDLER_BUILTIN:
+			builtin(ctx, tag, tag_ns);
+			break;
+		case HANDLER_WORKER:
+			if ((w = get_worker(ctx, h)) != NULL &&
+			    worker_send(w, tag) == false)
+				warn("%s", w->path);
+			break;
+		case HANDLER_EXEC:
+			if (job_add(ctx, h->name, h->path, tag) == false)
+				goto err;
+			break;
+		case HANDLER_FILE:
+			/* just write the tag into the non-executable file */
+			if (snprintf(path, sizeof path, "%s", h->path) >=
+			    (int)sizeof path)
+				goto err;
+			goto output;
 		}
+
+		goto out;
+	}
+	/* just handle results */
+	if (slice_eq(&tag_type, "result") == false &&
+	    slice_eq(&tag_type, "error") == false)
+		return;
+
+	if (stanza_attr_copy(tag, "id", tag_id, sizeof tag_id) == false)
 		goto err;
+
+	/* the cache takes the rosters of our requests and of clients */
+	if (slice_eq(&tag_type, "result"))
+		roster_result(ctx, tag, tag_id);
+
+	/* answers for clients on the socket */
+	if (strncmp(tag_id, REQUEST_ID, strlen(REQUEST_ID)) == 0) {
+		struct request *r;
+
+		if ((r = htab_get(ctx->requests, tag_id)) != NULL)
+			request_done(r, tag);
+		goto out;
+	}
+
+	/* errors are just for clients */
+	if (slice_eq(&tag_type, "result") == false)
+		goto out;
+
+	/* our own roster fetch is done */
+	if (strncmp(tag_id, RCACHE_ID, strlen(RCACHE_ID)) == 0)
+		goto out;
+
+	/* answers for the cache of entity capabilities */
+	if (strncmp(tag_id, CAPS_ID, strlen(CAPS_ID)) == 0) {
+		caps_result(ctx, tag, tag_id);
+		goto out;
 	}
-	if (write(fd, tag, strlen(tag)) == -1) goto err;
-	if (close(fd) == -1) goto err;
+
+	if (snprintf(path, sizeof path, "%s/%s", ctx->dir, tag_id) >=
+	    (int)sizeof path)
+		goto err;
+ output:
+	if (result(ctx, path, tag) == false) goto err;
+	goto out;
  err:
 	if (errno != 0)
 		perror(__func__);
  out:
 	errno = 0;
-	mxmlDelete(node);
+}
+
+static void
+server_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	(void)revents;
+	while ((n = read(io->fd, buf, sizeof buf)) > 0)
+		bxml_add_buf(ctx->bxml, buf, n);
+
+	if (n == -1 && errno == EAGAIN) {
+		errno = 0;
+		return;
+	}
+	if (n == -1)
+		warn("read");
+
+	/* connection closed, finish this round and quit */
+	ev_io_del(ctx->ev, io);
+	ctx->quit = true;
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: iqd -d DIR\n");
+	fprintf(stderr, "usage: iqd [-v] [-j jobs] [-n jobs] [-t sec] "
+	    "[-u jid] -d DIR\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -170,16 +1966,39 @@ int
 main(int argc, char *argv[])
 {
 	struct context ctx = NULL_CONTEXT;
+	char path[PATH_MAX];
 	int ch;
 
-	while ((ch = getopt(argc, argv, "d:i:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:i:j:n:t:u:v")) != -1) {
+		long n;
+
 		switch (ch) {
+		case 'j':
+		case 'n':
+		case 't':
+			errno = 0;
+			n = strtol(optarg, NULL, 10);
+			if (errno != 0 || n < 1 || n > INT_MAX / 1000)
+				usage();
+			if (ch == 'j')
+				ctx.max_jobs = n;
+			else if (ch == 'n')
+				ctx.max_ns = n;
+			else
+				ctx.timeout = n * 1000;
+			break;
 		case 'i':
 			ctx.fd_in = strtol(optarg, NULL, 0);
 			break;
 		case 'd':
 			ctx.dir = optarg;
 			break;
+		case 'u':
+			ctx.jid = optarg;
+			break;
+		case 'v':
+			ctx.rosterver = true;
+			break;
 		default:
 			usage();
 			/* NOTREACHED */
@@ -191,29 +2010,75 @@ main(int argc, char *argv[])
 	if (signal(SIGALRM, sigalarm) == SIG_ERR)
 		err(EXIT_FAILURE, "signal");
 
+	TAILQ_INIT(&ctx.queued);
+	TAILQ_INIT(&ctx.running);
+
 	/* initialize block parser and set callback function */
 	ctx.bxml = bxml_ctx_init(recv_iq, &ctx);
 
-	for (;;) {
-		int max_fd = 0;
-		ssize_t n;
-		fd_set readfds;
-		FD_ZERO(&readfds);
-		FD_SET(ctx.fd_in, &readfds);
-		max_fd = ctx.fd_in;
+	if ((ctx.ev = ev_init()) == NULL) goto err;
+	if ((ctx.workers = htab_init(0)) == NULL) goto err;
+	if (snprintf(path, sizeof path, "%s/in", ctx.dir) >= (int)sizeof path)
+		goto err;
+	if (sjin_init(&ctx.in, ctx.ev, path) == false) goto err;
+	builtin_init();
+
+	/* bring the roster of the last run up to date */
+	if (rcache_init(&ctx.roster, ctx.dir) == false) goto err;
+	roster_fetch(&ctx);
+
+	/* results wait for the readers of their fifos */
+	if ((ctx.pending = htab_init(0)) == NULL) goto err;
+	if (watch_init(&ctx.watcher, ctx.ev) == false) goto err;
+	ctx.watch.cb = watch_cb;
+	ctx.watch.data = &ctx;
+	if (watch_add(&ctx.watcher, &ctx.watch, ctx.dir) == false) goto err;
+	ctx.watch_ext.cb = ctx.watch_worker.cb = handlers_cb;
+	ctx.watch_ext.data = ctx.watch_worker.data = &ctx;
+	ctx.watch_ext.no_writes = ctx.watch_worker.no_writes = true;
+	if (load_all(&ctx) == false) goto err;
+
+	/* clients, that wait for their results */
+	if ((ctx.requests = htab_init(0)) == NULL) goto err;
+	TAILQ_INIT(&ctx.throttled);
+	if (listen_sock(&ctx) == false)
+		warn("%s/%s", ctx.dir, IQC_SOCK);
+	errno = 0;
+	signal(SIGPIPE, SIG_IGN);	/* workers may die any time */
 
-		/* wait for input */
-		if (select(max_fd+1, &readfds, NULL, NULL, NULL) < 0)
+	/* SIGCHLD wakes up the loop through a pipe */
+	if (pipe(child_pipe) == -1) goto err;
+	for (int i = 0; i < 2; i++)
+		if (fcntl(child_pipe[i], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(child_pipe[i], F_SETFD, FD_CLOEXEC) == -1)
 			goto err;
+	ctx.io_child.fd = child_pipe[0];
+	ctx.io_child.events = EV_READ;
+	ctx.io_child.cb = child_cb;
+	ctx.io_child.data = &ctx;
+	if (ev_io_add(ctx.ev, &ctx.io_child) == false) goto err;
+	if (signal(SIGCHLD, sigchld) == SIG_ERR) goto err;
 
-		/* check for input from server */
-		if (FD_ISSET(ctx.fd_in, &readfds)) {
-			char buf[BUFSIZ];
-			if ((n = read(ctx.fd_in, buf, BUFSIZ)) < 0) goto err;
-			if (n == 0) break;	/* connection closed */
-			bxml_add_buf(ctx.bxml, buf, n);
-		}
+	/* the server side is watched edge triggered, so don't block on it */
+	if (fcntl(ctx.fd_in, F_SETFL, fcntl(ctx.fd_in, F_GETFL) | O_NONBLOCK)
+	    == -1) goto err;
+	ctx.io_in.fd = ctx.fd_in;
+	ctx.io_in.events = EV_READ;
+	ctx.io_in.cb = server_cb;
+	ctx.io_in.data = &ctx;
+	if (ev_io_add(ctx.ev, &ctx.io_in) == false) goto err;
+
+	/* let the running programs finish their requests */
+	while (ctx.quit == false || ctx.nrunning > 0 || ctx.nqueued > 0) {
+		if (ev_dispatch(ctx.ev) == -1) goto err;
+		resume_clients(&ctx);
 	}
+	if (ctx.sock_path[0] != '\0')
+		unlink(ctx.sock_path);
+	stop_workers(&ctx);
+	sjin_close(&ctx.in);
+	rcache_free(&ctx.roster);
+
 	return EXIT_SUCCESS;
  err:
 	if (errno != 0)
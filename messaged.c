@@ -15,10 +15,12 @@
  */
 
 #include <sys/queue.h>
-#include <sys/select.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
+#include <ctype.h>
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
@@ -39,16 +41,61 @@
 #include <time.h>
 #include <unistd.h>
 
-#include <mxml.h>
-
 #include "bxml/bxml.h"
 
+#include "ev.h"
+#include "hist.h"
+#include "htab.h"
+#include "sjin.h"
+#include "stanza.h"
+
+#define LINE_MAX_SIZE	65536	/* longer lines are sent in pieces */
+#define LINE_DELAY	250	/* msec to wait for the end of a line */
+
 struct contact {
 	char *name;
-	char in_path[PATH_MAX];
-	int fd;		/* fd to fifo for input */
+	char *key;	/* normalized bare jid, see jid_bare() */
+	struct ev_io io;	/* watcher of the input fifo */
 	int out;	/* fd to output text file */
-	LIST_ENTRY(contact) next;
+
+	/* input from the fifo, that is not sent yet */
+	char *ibuf;
+	size_t ilen;
+	size_t isize;
+	struct ev_timer partial;	/* sends a line without delimiter */
+	bool throttled;		/* waits for space in sjin */
+	LIST_ENTRY(contact) throttled_next;
+
+	/* history lines that are not written to out yet */
+	char *buf;
+	size_t len;
+	size_t size;
+	bool dirty;
+	LIST_ENTRY(contact) dirty_next;
+
+	/* position in the history and its index "out.idx", see hist.h */
+	bool indexed;		/* lines and end are valid */
+	uint64_t lines;		/* lines in out and buf */
+	uint64_t end;		/* size of out */
+	struct hist_entry *marks;	/* index entries for lines in buf */
+	size_t nmarks;
+	size_t smarks;
+	time_t born;		/* time of the first line in out or -1 */
+};
+
+/* background compression of a sealed history segment */
+struct job {
+	pid_t pid;
+	char *dir;
+	unsigned int seq;
+	LIST_ENTRY(job) next;
+};
+
+/* when messaged calls fsync(2) on history files */
+enum sync_policy {
+	SYNC_NONE,
+	SYNC_BATCH,	/* once per loop iteration */
+	SYNC_MESSAGE	/* after every write */
 };
 
 struct context {
@@ -58,7 +105,20 @@ struct context {
 	char *jid;
 	char *id;
 	char *dir;
-	LIST_HEAD(listhead, contact) roster;
+	struct htab *roster;	/* contacts by their key */
+	char delim;		/* separates messages in the input fifos */
+	struct ev_loop *ev;
+	struct ev_io io_in;	/* stanzas from the server */
+	struct sjin in;		/* stanzas to the server */
+	bool quit;
+	bool group;		/* write history once per loop iteration */
+	enum sync_policy sync;
+	LIST_HEAD(, contact) dirty;	/* contacts to write or sync */
+	LIST_HEAD(, contact) throttled;	/* contacts with unread input */
+	uint64_t roll_size;	/* seal out at this size, if not 0 */
+	bool roll_daily;	/* seal out, when the day changes */
+	const struct hist_codec *codec;	/* compresses sealed segments */
+	LIST_HEAD(, job) jobs;
 };
 
 #define NULL_CONTEXT {		\
@@ -68,17 +128,44 @@ struct context {
 	NULL,			\
 	NULL,			\
 	".",			\
-	LIST_HEAD_INITIALIZER() \
+	NULL,			\
+	'\n',			\
+	NULL,			\
+	{0},			\
+	{0},			\
+	false,			\
+	false,			\
+	SYNC_NONE,		\
+	LIST_HEAD_INITIALIZER(),\
+	LIST_HEAD_INITIALIZER(),\
+	0,			\
+	false,			\
+	NULL,			\
+	LIST_HEAD_INITIALIZER()	\
 }
 
 struct context *global_ctx;
+volatile sig_atomic_t rescan = 0;
+volatile sig_atomic_t reap = 0;
+
+static void contact_cb(struct ev_io *, int);
+static void partial_cb(struct ev_timer *);
 
 void
 free_contact(struct contact *c)
 {
 	if (c == NULL) return;
-	if (c->fd != -1) close(c->fd);
+	if (c->io.fd != -1) {
+		ev_io_del(global_ctx->ev, &c->io);
+		close(c->io.fd);
+	}
+	ev_timer_del(global_ctx->ev, &c->partial);
+	if (c->throttled) LIST_REMOVE(c, throttled_next);
 	if (c->out != -1) close(c->out);
+	free(c->buf);
+	free(c->marks);
+	free(c->ibuf);
+	free(c->key);
 	free(c->name);
 	free(c);
 }
@@ -87,12 +174,28 @@ static struct contact *
 add_contact(struct context *ctx, const char *jid)
 {
 	char path[PATH_MAX];
+	char key[BUFSIZ];
 	char *slash = NULL;
 	struct contact *c = NULL;
 
+	/* return contact if it exists already */
+	if (jid_bare(jid, key, sizeof key) == false) {
+		errno = ENAMETOOLONG;
+		goto err;
+	}
+	if ((c = htab_get(ctx->roster, key)) != NULL)
+		return c;
+
 	if ((c = calloc(1, sizeof *c)) == NULL) goto err;
-	c->out = c->fd = -1;	/* to detect a none vaild file descriptor */
+	c->out = c->io.fd = -1;	/* to detect a none vaild fd */
+	c->io.events = EV_READ;
+	c->io.cb = contact_cb;
+	c->io.data = c;
+	c->partial.cb = partial_cb;
+	c->partial.data = c;
+	c->born = -1;
 	if ((c->name = strdup(jid)) == NULL) goto err;
+	if ((c->key = strdup(key)) == NULL) goto err;
 
 	/* just handle the bare jabber id without resources */
 	if ((slash = strchr(c->name, '/')) != NULL)
@@ -103,21 +206,26 @@ add_contact(struct context *ctx, const char *jid)
 		goto err;
 	if (mkdir(path, S_IRWXU) == -1 && errno != EEXIST) goto err;
 
-	/* prepare and open the "in" file */
-	if (snprintf(c->in_path, sizeof c->in_path, "%s/%s/in",
-	    ctx->dir, c->name) == 0)
+	/*
+	 * Prepare and open the "in" file.  We are a writer of the fifo
+	 * ourself, so it never reports EOF and has not to be reopened.
+	 */
+	if (snprintf(path, sizeof path, "%s/%s/in", ctx->dir, c->name) >=
+	    (int)sizeof path)
 		goto err;
-	if (mkfifo(c->in_path, S_IRUSR|S_IWUSR) == -1 && errno != EEXIST)
+	if (mkfifo(path, S_IRUSR|S_IWUSR) == -1 && errno != EEXIST)
 		goto err;
-	if ((c->fd = open(c->in_path, O_RDONLY|O_NONBLOCK, 0)) == -1) goto err;
+	if ((c->io.fd = open(path, O_RDWR|O_NONBLOCK|O_CLOEXEC)) == -1)
+		goto err;
+	if (ev_io_add(ctx->ev, &c->io) == false) goto err;
 
-	/* prepare and open the "out" file */
+	/* prepare and open the "out" file, hist_sync() maps it for reading */
 	if (snprintf(path, sizeof path, "%s/%s/out", ctx->dir, c->name) == 0)
 		goto err;
-	if ((c->out = open(path, O_WRONLY|O_APPEND|O_CREAT, S_IRUSR|S_IWUSR))
-	    == -1) goto err;
+	if ((c->out = open(path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,
+	    S_IRUSR|S_IWUSR)) == -1) goto err;
 
-	LIST_INSERT_HEAD(&ctx->roster, c, next);
+	if (htab_put(ctx->roster, c->key, c) == false) goto err;
 
 	errno = 0;
 	return c;
@@ -147,154 +255,617 @@ prepare_prompt(char *prompt, size_t size, const char *user)
 static void
 msg_send(struct context *ctx, const char *msg, const char *to)
 {
-	FILE *fh = NULL;
-
-	if ((fh = fopen(ctx->out_file, "w")) == NULL) goto err;
-	fprintf(fh,
+	if (sjin_printf(&ctx->in,
 	    "<message from='%s' to='%s' type='chat' id='%s'>"
 		"<active xmlns='http://jabber.org/protocol/chatstates'/>"
 		"<body>%s</body>"
-	    "</message>\n", ctx->jid, to, ctx->id, msg);
-	fclose(fh);
- err:
-	if (errno != 0)
+	    "</message>\n", ctx->jid, to, ctx->id, msg) == false)
 		perror(__func__);
 }
 
-char *
-escape_tag(const char *string)
+static void
+mark_dirty(struct context *ctx, struct contact *c)
+{
+	if (c->dirty)
+		return;
+	c->dirty = true;
+	LIST_INSERT_HEAD(&ctx->dirty, c, dirty_next);
+}
+
+static bool
+index_path(struct context *ctx, struct contact *c, char *path, size_t size)
 {
-	char *new;
-	char ch[2] = {'\0', '\0'};
-	size_t length = 1;	/* One byte for the null character */
-
-	/* allocate the amount of space that we'll need */
-	for (size_t i = 0; string[i]; i++) {
-		/* For every <, we need 3 more bytes */
-		if (string[i] == '<') length += 4;
-		/* For every &, we need 4 more bytes */
-		else if (string[i] == '&') length += 5;
-		else length++;
+	if (snprintf(path, size, "%s/%s/out.idx", ctx->dir, c->name) >=
+	    (int)size) {
+		errno = ENAMETOOLONG;
+		return false;
 	}
+	return true;
+}
 
-	if ((new = calloc(length, sizeof *new)) == NULL)
-		err(EXIT_FAILURE, "malloc");
+/* appends the index entries of all lines, that are written to out */
+static bool
+index_commit(struct context *ctx, struct contact *c)
+{
+	char path[PATH_MAX];
+	size_t n = 0;
 
-	for (; string[0]; string++) {
-		/* TODO: We should do official XML escaping here. */
-		switch (string[0]) {
-		case '<':
-			strlcat(new, "&lt;", length);
-			break;
-		case '&':
-			strlcat(new, "&amp;", length);
-			break;
-		default:
-			ch[0] = string[0];
-			strlcat(new, ch, length);
+	while (n < c->nmarks && c->marks[n].off < c->end)
+		n++;
+	if (n == 0)
+		return true;
+
+	if (index_path(ctx, c, path, sizeof path) == false ||
+	    hist_append(path, c->marks, n) == false) {
+		/* hist_sync() fills the gap later */
+		c->indexed = false;
+		c->nmarks = 0;
+		return false;
+	}
+	memmove(c->marks, c->marks + n, (c->nmarks - n) * sizeof *c->marks);
+	c->nmarks -= n;
+
+	return true;
+}
+
+/* remembers an index entry, if the next line in buf needs one */
+static void
+index_mark(struct context *ctx, struct contact *c, const char *prompt)
+{
+	char path[PATH_MAX];
+
+	/* the size of out just matches end, if nothing is buffered */
+	if (c->indexed == false) {
+		if (c->len > 0)
+			return;
+		if (index_path(ctx, c, path, sizeof path) == false ||
+		    hist_sync(c->out, path, &c->lines, &c->end) == false) {
+			warn("%s", path);
+			return;
+		}
+		c->indexed = true;
+	}
+
+	if (c->lines++ % HIST_EVERY != 0)
+		return;
+
+	if (c->nmarks == c->smarks) {
+		size_t size = c->smarks == 0 ? 4 : c->smarks * 2;
+		struct hist_entry *m;
+
+		if ((m = realloc(c->marks, size * sizeof *m)) == NULL) {
+			c->indexed = false;
+			c->nmarks = 0;
+			return;
 		}
+		c->marks = m;
+		c->smarks = size;
+	}
+	c->marks[c->nmarks].line = c->lines - 1;
+	c->marks[c->nmarks].off = c->end + c->len;
+	c->marks[c->nmarks].time = hist_time(prompt, strlen(prompt));
+	c->nmarks++;
+}
+
+/* starts the compression of the segment seq in the background */
+static void
+compress_segment(struct context *ctx, const char *dir, unsigned int seq)
+{
+	char path[PATH_MAX];
+	struct job *job = NULL;
+	int fd;
+
+	if (snprintf(path, sizeof path, "%s/out.%06u", dir, seq) >=
+	    (int)sizeof path) {
+		errno = ENAMETOOLONG;
+		goto err;
+	}
+	if ((job = calloc(1, sizeof *job)) == NULL) goto err;
+	if ((job->dir = strdup(dir)) == NULL) goto err;
+	job->seq = seq;
+
+	switch ((job->pid = fork())) {
+	case -1:
+		goto err;
+	case 0:
+		/* don't hold the pipe of sj open */
+		if ((fd = open("/dev/null", O_RDWR)) != -1)
+			dup2(fd, STDIN_FILENO);
+		/* rm is NULL for codecs, that remove their input anyway */
+		execlp(ctx->codec->name, ctx->codec->name, "-q", path,
+		    ctx->codec->rm, (char *)NULL);
+		_exit(127);
 	}
 
-	return new;
+	LIST_INSERT_HEAD(&ctx->jobs, job, next);
+	return;
+ err:
+	warn("%s", path);
+	if (job != NULL)
+		free(job->dir);
+	free(job);
 }
 
+/* records the compressed segments of finished jobs in their manifest */
+static void
+reap_jobs(struct context *ctx)
+{
+	struct hist_seg *segs;
+	struct job *job;
+	size_t n;
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		LIST_FOREACH(job, &ctx->jobs, next)
+			if (job->pid == pid)
+				break;
+		if (job == NULL)
+			continue;
+		LIST_REMOVE(job, next);
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("%s: %s failed on segment %u", job->dir,
+			    ctx->codec->name, job->seq);
+		} else if (hist_manifest(job->dir, &segs, &n)) {
+			for (size_t i = 0; i < n; i++)
+				if (segs[i].seq == job->seq)
+					snprintf(segs[i].file,
+					    sizeof segs[i].file, "out.%06u%s",
+					    job->seq, ctx->codec->suffix);
+			if (hist_manifest_save(job->dir, segs, n) == false)
+				warn("%s", job->dir);
+			free(segs);
+		} else
+			warn("%s", job->dir);
+
+		free(job->dir);
+		free(job);
+	}
+	errno = 0;
+}
+
+/* checks, if the buffered lines should go into a new segment */
 static bool
-send_message(struct context *ctx, struct contact *con)
+roll_due(struct context *ctx, struct contact *c)
 {
-	char prompt[BUFSIZ];
-	char buf[BUFSIZ];
-	char *escaped = NULL;
-	ssize_t size = 0;
+	struct tm then, now;
+	char buf[32];
+	ssize_t n;
+	time_t t;
 
-	if ((size = read(con->fd, buf, sizeof(buf) - 1)) < 0)
+	/* end is just valid for an indexed contact */
+	if (c->indexed == false || c->end == 0 || c->len == 0)
+		return false;
+	if (ctx->roll_size > 0 && c->end + c->len > ctx->roll_size)
+		return true;
+	if (ctx->roll_daily == false)
 		return false;
 
-	if (close(con->fd) == -1) return false;
-	if ((con->fd = open(con->in_path, O_RDONLY|O_NONBLOCK, 0)) == -1)
+	if (c->born == -1) {
+		if ((n = pread(c->out, buf, sizeof buf, 0)) <= 0)
+			return false;
+		c->born = hist_time(buf, n);
+	}
+	if (c->born == -1 || (t = hist_time(c->buf, c->len)) == -1)
 		return false;
+	localtime_r(&c->born, &then);
+	localtime_r(&t, &now);
 
-	if (size == 0)
+	return then.tm_yday != now.tm_yday || then.tm_year != now.tm_year;
+}
+
+/*
+ * Seals out as the next segment of the history and starts a new one for
+ * the buffered lines.  Just a few renames are done here, the compression
+ * runs in the background.
+ */
+static bool
+history_roll(struct context *ctx, struct contact *c)
+{
+	const struct hist_codec *codec;
+	char dir[PATH_MAX], from[PATH_MAX], to[PATH_MAX];
+	struct hist_seg *segs = NULL, *s;
+	uint64_t buffered = 0;
+	time_t first, last;
+	size_t n;
+	int fd;
+
+	if (snprintf(dir, sizeof dir, "%s/%s", ctx->dir, c->name) >=
+	    (int)sizeof dir) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	if (hist_manifest(dir, &segs, &n) == false)
+		return false;
+	if ((s = realloc(segs, (n + 1) * sizeof *s)) == NULL) goto err;
+	segs = s;
+	s = &segs[n];
+
+	/* take the next free number, even if the manifest got lost */
+	s->seq = 1;
+	for (size_t i = 0; i < n; i++)
+		if (segs[i].seq >= s->seq)
+			s->seq = segs[i].seq + 1;
+	while (hist_seg_path(dir, s->seq, to, sizeof to, &codec))
+		s->seq++;
+
+	for (const char *p = c->buf;
+	    (p = memchr(p, '\n', c->buf + c->len - p)) != NULL; p++)
+		buffered++;
+	if (hist_bounds(c->out, c->end, &first, &last) == false) goto err;
+	snprintf(s->file, sizeof s->file, "out.%06u", s->seq);
+	s->lines = c->lines - buffered;
+	s->bytes = c->end;
+	s->first = first;
+	s->last = last;
+
+	if (snprintf(from, sizeof from, "%s/out", dir) >= (int)sizeof from ||
+	    snprintf(to, sizeof to, "%s/%s", dir, s->file) >= (int)sizeof to) {
+		errno = ENAMETOOLONG;
+		goto err;
+	}
+	if (rename(from, to) == -1) goto err;
+	if ((fd = open(from, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,
+	    S_IRUSR|S_IWUSR)) == -1) {
+		rename(to, from);
+		goto err;
+	}
+	close(c->out);
+	c->out = fd;
+
+	/* the index moves with its segment, out gets a new one */
+	if (snprintf(from, sizeof from, "%s/out.idx", dir) < (int)sizeof from &&
+	    (snprintf(to, sizeof to, "%s/%s.idx", dir, s->file) >=
+	    (int)sizeof to || rename(from, to) == -1))
+		unlink(from);
+	c->indexed = false;
+	c->nmarks = 0;
+	c->end = 0;
+	c->born = -1;
+
+	if (hist_manifest_save(dir, segs, n + 1) == false)
+		warn("%s", dir);
+	if (ctx->codec != NULL)
+		compress_segment(ctx, dir, s->seq);
+
+	free(segs);
+	return true;
+ err:
+	free(segs);
+	return false;
+}
+
+/* writes all buffered lines of the contact with one write(2) */
+static bool
+history_commit(struct context *ctx, struct contact *c)
+{
+	size_t off = 0;
+
+	if (roll_due(ctx, c) && history_roll(ctx, c) == false)
+		warn("%s: roll", c->name);
+
+	while (off < c->len) {
+		ssize_t n;
+
+		if ((n = write(c->out, c->buf + off, c->len - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			/* keep the rest for the next try */
+			memmove(c->buf, c->buf + off, c->len - off);
+			c->len -= off;
+			index_commit(ctx, c);
+			return false;
+		}
+		off += n;
+		c->end += n;
+	}
+	c->len = 0;
+
+	if (index_commit(ctx, c) == false)
+		warn("%s: index", c->name);
+	if (ctx->sync == SYNC_MESSAGE && fsync(c->out) == -1)
+		return false;
+	if (ctx->sync == SYNC_BATCH)
+		mark_dirty(ctx, c);
+
+	return true;
+}
+
+/*
+ * Appends the line "<prompt><text>\n" to the history of the contact.  It
+ * is written at once, so readers of the out file never see half a line.
+ */
+static bool
+history_add(struct context *ctx, struct contact *c, const char *prompt,
+    const char *text, size_t len)
+{
+	size_t plen = strlen(prompt);
+	size_t need = c->len + plen + len + 1;
+
+	if (need > c->size) {
+		size_t size = c->size == 0 ? BUFSIZ : c->size;
+		char *buf;
+
+		while (size < need)
+			size *= 2;
+		if ((buf = realloc(c->buf, size)) == NULL)
+			return false;
+		c->buf = buf;
+		c->size = size;
+	}
+
+	index_mark(ctx, c, prompt);
+	memcpy(c->buf + c->len, prompt, plen);
+	memcpy(c->buf + c->len + plen, text, len);
+	c->buf[need - 1] = '\n';
+	c->len = need;
+
+	if (ctx->group) {
+		mark_dirty(ctx, c);
 		return true;
+	}
+
+	return history_commit(ctx, c);
+}
+
+/* writes and syncs the history of all dirty contacts */
+static void
+history_flush(struct context *ctx)
+{
+	struct contact *c;
+
+	while ((c = LIST_FIRST(&ctx->dirty)) != NULL) {
+		LIST_REMOVE(c, dirty_next);
+		c->dirty = false;
+
+		if (c->len > 0 && history_commit(ctx, c) == false)
+			warn("%s", c->name);
+		/* history_commit() may have added it again */
+		if (c->dirty) {
+			LIST_REMOVE(c, dirty_next);
+			c->dirty = false;
+		}
+		if (ctx->sync == SYNC_BATCH && fsync(c->out) == -1)
+			warn("%s", c->name);
+	}
+	errno = 0;
+}
+
+/* sends one line of input as chat message, buf has to be writable */
+static bool
+send_line(struct context *ctx, struct contact *con, char *buf, size_t size)
+{
+	char prompt[BUFSIZ];
+	char *escaped = NULL;
 
-	buf[size] = '\0';
 	/* Trim trailing control characters. */
-	while (iscntrl(buf[size - 1])) {
-		buf[size - 1] = '\0';
+	while (size > 0 && iscntrl((unsigned char)buf[size - 1]))
 		size--;
-	}
+	if (size == 0)
+		return true;
+	buf[size] = '\0';
+
 	/* These characters must be escaped. */
-	if ((ssize_t)strcspn(buf, "<&") != size) {
-		/* Get a new string. */
-		escaped = escape_tag(buf);
+	if (strcspn(buf, "<>&'\"") != size) {
+		if ((escaped = malloc(STANZA_ESCAPE_SIZE(size))) == NULL)
+			return false;
+		stanza_escape(buf, size, escaped, STANZA_ESCAPE_SIZE(size));
 	}
 	msg_send(ctx, escaped ? escaped : buf, con->name);
 	free(escaped);
 
 	/* Write message to the out file, letting the user see its own messages. */
 	prepare_prompt(prompt, sizeof prompt, ctx->jid);
-	if (write(con->out, prompt, strlen(prompt)) == -1) return false;
-	if (write(con->out, buf, size) == -1) return false;
-	if (write(con->out, "\n", 1) == -1) return false;
+
+	return history_add(ctx, con, prompt, buf, size);
+}
+
+/* sends the complete lines of the input buffer, while sjin has space */
+static bool
+send_lines(struct context *ctx, struct contact *con)
+{
+	char *start = con->ibuf;
+	char *end = con->ibuf + con->ilen;
+	char *p;
+	bool ret = true;
+
+	while (start < end && (p = memchr(start, ctx->delim, end - start))) {
+		if (sjin_full(&ctx->in))
+			sjin_flush(&ctx->in);
+		if (sjin_full(&ctx->in))
+			break;
+		if ((ret = send_line(ctx, con, start, p - start)) == false)
+			break;
+		start = p + 1;
+	}
+
+	if ((con->ilen = end - start) > 0)
+		memmove(con->ibuf, start, con->ilen);
+
+	return ret;
+}
+
+/*
+ * Reads everything from the fifo of the contact and sends every line as a
+ * message of its own.  The rest of an unfinished line is kept until its
+ * delimiter arrives or the partial timer expires.  If sj does not take
+ * the messages fast enough, the contact is throttled and the rest stays
+ * in the fifo until resume_contacts() is called.
+ */
+static bool
+send_message(struct context *ctx, struct contact *con)
+{
+	for (;;) {
+		ssize_t n;
+
+		if (send_lines(ctx, con) == false)
+			return false;
+
+		if (sjin_full(&ctx->in)) {
+			ev_timer_del(ctx->ev, &con->partial);
+			if (con->throttled == false) {
+				con->throttled = true;
+				LIST_INSERT_HEAD(&ctx->throttled, con,
+				    throttled_next);
+			}
+			return true;
+		}
+
+		/* the line does not fit, send the part we have */
+		if (con->isize >= LINE_MAX_SIZE &&
+		    con->ilen == con->isize - 1) {
+			if (send_line(ctx, con, con->ibuf, con->ilen) == false)
+				return false;
+			con->ilen = 0;
+		}
+
+		/* one byte is reserved for the null termination */
+		if (con->isize - con->ilen < BUFSIZ &&
+		    con->isize < LINE_MAX_SIZE) {
+			size_t size = con->isize == 0 ? BUFSIZ : con->isize * 2;
+			char *p;
+
+			if ((p = realloc(con->ibuf, size)) == NULL)
+				return false;
+			con->ibuf = p;
+			con->isize = size;
+		}
+
+		n = read(con->io.fd, con->ibuf + con->ilen,
+		    con->isize - con->ilen - 1);
+		if (n == -1 && errno == EAGAIN) {
+			errno = 0;
+			break;
+		}
+		if (n == -1)
+			return false;
+		if (n == 0)
+			break;
+		con->ilen += n;
+	}
+
+	if (con->ilen > 0)
+		ev_timer_add(ctx->ev, &con->partial, LINE_DELAY);
+	else
+		ev_timer_del(ctx->ev, &con->partial);
 
 	return true;
 }
 
+/*
+ * Flushes sjin and continues to read from throttled contacts, until all
+ * are done or sj blocks.  In the latter case the write watcher or the
+ * reconnect timer of sjin wakes up the loop again.
+ */
+static void
+resume_contacts(struct context *ctx)
+{
+	struct contact *c;
+
+	for (;;) {
+		while (sjin_full(&ctx->in) == false &&
+		    (c = LIST_FIRST(&ctx->throttled)) != NULL) {
+			LIST_REMOVE(c, throttled_next);
+			c->throttled = false;
+			if (send_message(ctx, c) == false)
+				err(EXIT_FAILURE, "%s", c->name);
+		}
+
+		sjin_flush(&ctx->in);
+		if (LIST_EMPTY(&ctx->throttled) || sjin_full(&ctx->in))
+			return;
+	}
+}
+
+static void
+partial_cb(struct ev_timer *t)
+{
+	struct contact *c = t->data;
+
+	if (send_line(global_ctx, c, c->ibuf, c->ilen) == false)
+		warn("%s", c->name);
+	c->ilen = 0;
+	errno = 0;
+}
+
 static void
 recv_message(char *tag, void *data)
 {
 	struct context *ctx = data;
 	struct contact *c = NULL;
-	/* HACK: we need this, cause mxml can't parse tags by itself */
-	static mxml_node_t *tree = NULL;
-	mxml_node_t *node = NULL;
-	mxml_node_t *body = NULL;
-	const char *base = "<?xml ?>";
-	const char *tag_name = NULL;
-	const char *from = NULL;
+	struct slice name;
+	const char *body = NULL;
+	char from[BUFSIZ];
+	char key[BUFSIZ];
 	char prompt[BUFSIZ];
+	char text[BUFSIZ];
+	char *t = text;
+	size_t len;
 
-	if (tree == NULL) tree = mxmlLoadString(NULL, base, MXML_NO_CALLBACK);
-	if (tree == NULL) err(EXIT_FAILURE, "unable to load xml base");
-
-	mxmlLoadString(tree, tag, MXML_NO_CALLBACK);
-	if ((node = mxmlGetFirstChild(tree)) == NULL)
+	if (stanza_name(tag, &name) == false) goto err;
+	if (slice_eq(&name, "message") == false) goto err;
+	if (stanza_attr_copy(tag, "from", from, sizeof from) == false)
 		goto err;
 
-	if ((tag_name = mxmlGetElement(node)) == NULL) goto err;
-	if (strcmp("message", tag_name) != 0) goto err;
-	if ((from = mxmlElementGetAttr(node, "from")) == NULL) goto err;
-
 	/* try to find contact for this message in roster */
-	LIST_FOREACH(c, &ctx->roster, next)
-		if (strncmp(c->name, from, strlen(c->name)) == 0)
-			break;
+	if (jid_bare(from, key, sizeof key) == false) goto err;
+	c = htab_get(ctx->roster, key);
 
 	/* if message comes from an unknown JID, create a contact */
-	if (c == NULL)
-		c = add_contact(ctx, from);
+	if (c == NULL && (c = add_contact(ctx, from)) == NULL)
+		goto err;
 
-	body = mxmlFindElement(tree, tree, "body", NULL, NULL,
-	    MXML_DESCEND);
-	if (body == NULL)
+	if ((body = stanza_child(tag, "body")) == NULL)
 		goto err;
 
-	prepare_prompt(prompt, sizeof prompt, from);
-	write(c->out, prompt, strlen(prompt));
-
-	/* concatinate all text peaces */
-	for (mxml_node_t *txt = mxmlGetFirstChild(body); txt != NULL;
-	    txt = mxmlGetNextSibling(txt)) {
-		int space = 0;
-		const char *t = mxmlGetText(txt, &space);
-		if (space == 1)
-			write(c->out, " ", 1);
-		if (write(c->out, t, strlen(t)) == -1) goto err;
+	/* just allocate memory for very large messages */
+	if ((len = stanza_text(body, text, sizeof text)) >= sizeof text) {
+		if ((t = malloc(len + 1)) == NULL) goto err;
+		stanza_text(body, t, len + 1);
 	}
-	write(c->out, "\n", 1);
+
+	prepare_prompt(prompt, sizeof prompt, from);
+	if (history_add(ctx, c, prompt, t, len) == false) goto err;
  err:
 	if (errno != 0)
 		perror(__func__);
-	mxmlDelete(node);
+	if (t != text)
+		free(t);
+}
+
+static void
+contact_cb(struct ev_io *io, int revents)
+{
+	struct contact *c = io->data;
+
+	(void)revents;
+	if (send_message(global_ctx, c) == false)
+		err(EXIT_FAILURE, "%s", c->name);
+	errno = 0;
+}
+
+static void
+server_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	(void)revents;
+	while ((n = read(io->fd, buf, sizeof buf)) > 0)
+		bxml_add_buf(ctx->bxml, buf, n);
+
+	if (n == -1 && errno == EAGAIN) {
+		errno = 0;
+		return;
+	}
+	if (n == -1)
+		warn("read");
+
+	/* connection closed, finish this round and quit */
+	ev_io_del(ctx->ev, io);
+	ctx->quit = true;
 }
 
 static bool
@@ -326,15 +897,61 @@ build_roster(struct context *ctx)
 static void
 signal_handler(int sig)
 {
-	if (sig == SIGHUP) {
-		build_roster(global_ctx);
+	if (sig == SIGHUP)
+		rescan = 1;
+	if (sig == SIGCHLD)
+		reap = 1;
+}
+
+/* every contact needs two fds, so take as much as we get */
+static void
+raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+	if (rl.rlim_cur == rl.rlim_max)
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+/* parses a size with an optional suffix k, m or g */
+static bool
+parse_size(const char *str, uint64_t *size)
+{
+	char *end;
+
+	errno = 0;
+	*size = strtoull(str, &end, 10);
+	if (errno != 0 || end == str)
+		return false;
+
+	switch (*end) {
+	case 'k':
+		*size <<= 10;
+		end++;
+		break;
+	case 'm':
+		*size <<= 20;
+		end++;
+		break;
+	case 'g':
+		*size <<= 30;
+		end++;
+		break;
 	}
+
+	return *end == '\0' && *size > 0;
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: messaged -j jid -d dir\n");
+	fprintf(stderr, "usage: messaged [-g] [-f none|batch|message] "
+	    "[-l delim] [-r size|daily] [-z gzip|zstd|none] -j jid -d dir\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -344,11 +961,48 @@ main(int argc, char *argv[])
 	struct context ctx = NULL_CONTEXT;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "j:d:o:i:")) != -1) {
+	ctx.codec = hist_codec("gzip");
+
+	while ((ch = getopt(argc, argv, "f:gj:l:d:o:i:r:z:")) != -1) {
 		switch (ch) {
+		case 'f':
+			if (strcmp(optarg, "none") == 0)
+				ctx.sync = SYNC_NONE;
+			else if (strcmp(optarg, "batch") == 0)
+				ctx.sync = SYNC_BATCH;
+			else if (strcmp(optarg, "message") == 0)
+				ctx.sync = SYNC_MESSAGE;
+			else
+				usage();
+			break;
+		case 'g':
+			ctx.group = true;
+			break;
+		case 'l':
+			if (strcmp(optarg, "\\n") == 0)
+				ctx.delim = '\n';
+			else if (strcmp(optarg, "\\0") == 0)
+				ctx.delim = '\0';
+			else if (strlen(optarg) == 1)
+				ctx.delim = optarg[0];
+			else
+				usage();
+			break;
 		case 'i':
 			ctx.fd_in = strtol(optarg, NULL, 0);
 			break;
+		case 'r':
+			if (strcmp(optarg, "daily") == 0)
+				ctx.roll_daily = true;
+			else if (parse_size(optarg, &ctx.roll_size) == false)
+				usage();
+			break;
+		case 'z':
+			if (strcmp(optarg, "none") == 0)
+				ctx.codec = NULL;
+			else if ((ctx.codec = hist_codec(optarg)) == NULL)
+				usage();
+			break;
 		case 'o':
 			ctx.out_file = optarg;
 			break;
@@ -373,46 +1027,46 @@ main(int argc, char *argv[])
 	if (asprintf(&ctx.id, "messaged-%d", getpid()) < 0) goto err;
 	ctx.bxml = bxml_ctx_init(recv_message, &ctx);
 
+	raise_nofile();
+	if ((ctx.roster = htab_init(0)) == NULL) goto err;
+	if ((ctx.ev = ev_init()) == NULL) goto err;
+	if (sjin_init(&ctx.in, ctx.ev, ctx.out_file) == false) goto err;
+	global_ctx = &ctx;
+
+	/* the server side is watched edge triggered, so don't block on it */
+	if (fcntl(ctx.fd_in, F_SETFL, fcntl(ctx.fd_in, F_GETFL) | O_NONBLOCK)
+	    == -1) goto err;
+	ctx.io_in.fd = ctx.fd_in;
+	ctx.io_in.events = EV_READ;
+	ctx.io_in.cb = server_cb;
+	ctx.io_in.data = &ctx;
+	if (ev_io_add(ctx.ev, &ctx.io_in) == false) goto err;
+
 	/* check roster directory */
 	build_roster(&ctx);
-	global_ctx = &ctx;
 	signal(SIGHUP, signal_handler);
+	signal(SIGCHLD, signal_handler);
+	signal(SIGPIPE, SIG_IGN);	/* sjin reconnects on EPIPE */
 
-	for (;;) {
-		struct contact *c = NULL;
-		int sel, max_fd = 0;
-		ssize_t n;
-		fd_set readfds;
-		FD_ZERO(&readfds);
-		FD_SET(ctx.fd_in, &readfds);
-		max_fd = ctx.fd_in;
-
-		/* add all fd's from in-files to read list*/
-		LIST_FOREACH(c, &ctx.roster, next) {
-			FD_SET(c->fd, &readfds);
-			if (max_fd < c->fd)
-				max_fd = c->fd;
-		}
+	while (ctx.quit == false) {
+		if (ev_dispatch(ctx.ev) == -1) goto err;
 
-		/* wait for input */
-		if ((sel = select(max_fd+1, &readfds, NULL, NULL, NULL)) == -1
-		    && errno != EINTR)
-			err(EXIT_FAILURE, "select");
-
-		/* check for input from server */
-		if (FD_ISSET(ctx.fd_in, &readfds)) {
-			char buf[BUFSIZ];
-			if ((n = read(ctx.fd_in, buf, BUFSIZ)) < 0) goto err;
-			if (n == 0) break;	/* connection closed */
-			bxml_add_buf(ctx.bxml, buf, n);
-			sel--;
+		if (rescan) {
+			rescan = 0;
+			build_roster(&ctx);
+		}
+		if (reap) {
+			reap = 0;
+			reap_jobs(&ctx);
 		}
 
-		/* check for input form in-files */
-		LIST_FOREACH(c, &ctx.roster, next)
-			if (FD_ISSET(c->fd, &readfds))
-				if (send_message(&ctx, c) == false) goto err;
+		/* one write for all messages of this round */
+		resume_contacts(&ctx);
+		history_flush(&ctx);
 	}
+	history_flush(&ctx);
+	sjin_close(&ctx.in);
+
 	return EXIT_SUCCESS;
  err:
 	if (errno != 0)
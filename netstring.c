@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "netstring.h"
+
+/*
+ * Finds the first netstring in buf.  Returns the bytes it takes, 0 if it
+ * is not complete yet or -1 if it is malformed or longer than max.
+ */
+ssize_t
+netstring_parse(const char *buf, size_t len, size_t max, const char **data,
+    size_t *size)
+{
+	size_t n = 0;
+	size_t i;
+
+	for (i = 0; i < len && buf[i] >= '0' && buf[i] <= '9'; i++) {
+		/* no leading zeros */
+		if (i == 1 && buf[0] == '0')
+			return -1;
+		if (n > (max - (buf[i] - '0')) / 10)
+			return -1;
+		n = n * 10 + buf[i] - '0';
+	}
+	if (i == len)
+		return 0;
+	if (i == 0 || buf[i] != ':')
+		return -1;
+	i++;
+
+	if (len - i < n + 1)
+		return 0;
+	if (buf[i + n] != ',')
+		return -1;
+
+	*data = buf + i;
+	*size = n;
+
+	return i + n + 1;
+}
+
+/* writes the head of a netstring with a payload of len bytes */
+int
+netstring_head(char *buf, size_t len)
+{
+	return snprintf(buf, NETSTRING_HEAD, "%zu:", len);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NETSTRING_H
+#define NETSTRING_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+#define NETSTRING_MAX	(1024 * 1024)	/* default longest payload */
+#define NETSTRING_HEAD	16		/* size for netstring_head() */
+
+/*
+ * Framing of stanzas on stream sockets: "<length>:<payload>,".  See
+ * https://cr.yp.to/proto/netstrings.txt
+ */
+ssize_t netstring_parse(const char *buf, size_t len, size_t max,
+    const char **data, size_t *size);
+int netstring_head(char *buf, size_t len);
+
+#endif
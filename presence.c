@@ -26,6 +26,9 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "caps.h"
+#include "stanza.h"
+
 bool
 isshow(const char *show)
 {
@@ -81,6 +84,9 @@ main(int argc, char *argv[])
 	char to_str[BUFSIZ];
 	char show_str[BUFSIZ];
 	char status_str[BUFSIZ];
+	char caps_str[BUFSIZ];
+	char ver[CAPS_VER_SIZE];
+	char esc[BUFSIZ];
 
 	while ((ch = getopt(argc, argv, "d:t:s:S:p:h")) != -1) {
 		switch (ch) {
@@ -122,10 +128,32 @@ main(int argc, char *argv[])
 	if (dir == NULL)
 		usage();
 
-	snprintf(to_str, sizeof to_str, "to='%s'", to);
+	/* user input has to be escaped, to keep the stanza well-formed */
+	if (to != NULL) {
+		if (stanza_escape(to, strlen(to), esc, sizeof esc) >=
+		    sizeof esc)
+			usage();
+		if (snprintf(to_str, sizeof to_str, "to='%s'", esc) >=
+		    (int)sizeof to_str)
+			usage();
+	}
+	if (status != NULL) {
+		if (stanza_escape(status, strlen(status), esc, sizeof esc) >=
+		    sizeof esc)
+			usage();
+		if (snprintf(status_str, sizeof status_str,
+		    "<status>%s</status>", esc) >= (int)sizeof status_str)
+			usage();
+	}
 	snprintf(type_str, sizeof type_str, "type='%s'", type);
+
+	/* available presences advertise the features of iqd */
+	caps_str[0] = '\0';
+	if (type == NULL && caps_read(dir, ver))
+		snprintf(caps_str, sizeof caps_str, "<c xmlns='" CAPS_NS "' "
+		    "hash='sha-1' node='" CAPS_NODE "' ver='%s'/>", ver);
+	errno = 0;
 	snprintf(show_str, sizeof show_str, "<show>%s</show>", show);
-	snprintf(status_str, sizeof status_str, "<status>%s</status>", status);
 
 	/* send query to server */
 	snprintf(path_out, sizeof path_out, "%s/%s", dir, "in");
@@ -134,14 +162,15 @@ main(int argc, char *argv[])
 	if (fprintf(fh,
 	    "<presence id='presence-%d' %s %s>"
 		"<priority>%d</priority>"
-		"%s %s"
+		"%s %s%s"
 	    "</presence>",
 	    getpid(),
 	    to       == NULL ? "" : to_str,
 	    type     == NULL ? "" : type_str,
 	    priority,
 	    show     == NULL ? "" : show_str,
-	    status   == NULL ? "" : status_str) == -1) goto err;
+	    status   == NULL ? "" : status_str,
+	    caps_str) == -1) goto err;
 
 	if (fclose(fh) == EOF) goto err;
 
@@ -15,7 +15,6 @@
  */
 
 #include <sys/queue.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -24,6 +23,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -32,15 +32,53 @@
 #include <time.h>
 #include <unistd.h>
 
-#include <mxml.h>
-
 #include "bxml/bxml.h"
 
+#include "caps.h"
+#include "ev.h"
+#include "htab.h"
+#include "sjin.h"
+#include "stanza.h"
+#include "watch.h"
+
 struct contact {
 	char *jid;		/* buddies jabber ID */
 	char path[PATH_MAX];	/* path to buddy specific status file */
 	char *mystatus;		/* buddy specific status message */
-	LIST_ENTRY(contact) next;
+	struct context *ctx;
+	struct watch watch;	/* directory of the contact */
+	struct stat st;		/* of "mystatus", when it was polled */
+};
+
+#define WINDOW	100	/* msec to collect presences before writing */
+#define STATUS_FDS	256	/* status files, that are kept open */
+#define SNAPSHOT	"presence.tsv"	/* presence of all buddies */
+
+/* presence of one resource of a buddy */
+struct resource {
+	char *name;
+	char *show;		/* NULL means just online */
+	char *status;
+	int priority;
+	LIST_ENTRY(resource) next;
+};
+
+/* presence of a buddy, which is written to its status file */
+struct buddy {
+	char *key;		/* normalized bare jid, see jid_bare() */
+	char *name;		/* name of its directory */
+	LIST_HEAD(, resource) resources;
+	char *value;		/* aggregated presence or NULL */
+	char *written;		/* content of the status file or NULL */
+	time_t changed;		/* time of the last change of value */
+	bool pending;
+	LIST_ENTRY(buddy) pending_next;
+
+	/* the status file */
+	bool made;		/* its directory exists */
+	int fd;			/* cached descriptor or -1 */
+	size_t size;
+	TAILQ_ENTRY(buddy) lru;	/* buddies with an open fd */
 };
 
 struct context {
@@ -48,7 +86,22 @@ struct context {
 	struct bxml_ctx *bxml;
 	char *dir;
 	char out_file[PATH_MAX];
-	LIST_HEAD(listhead, contact) roster;
+	struct htab *roster;	/* contacts by their directory */
+	struct ev_loop *ev;
+	struct ev_io io_in;	/* stanzas from the server */
+	struct sjin in;		/* stanzas to the server */
+	bool quit;
+	struct htab *buddies;	/* presence state by bare jid */
+	LIST_HEAD(, buddy) pending;	/* buddies with unwritten changes */
+	struct ev_timer flush;	/* writes the pending buddies */
+	long window;
+	struct watcher watcher;	/* notices changes of "mystatus" files */
+	struct watch root;	/* new contact directories */
+	int dirfd;		/* of dir, to open status files */
+	TAILQ_HEAD(buddylru, buddy) lru;	/* recently written first */
+	size_t nfds;
+	unsigned long version;	/* of the snapshot */
+	char caps[CAPS_VER_SIZE];	/* our own ver or empty */
 };
 
 #define NULL_CONTEXT {		\
@@ -56,31 +109,44 @@ struct context {
 	NULL,			\
 	".",			\
 	{0},			\
-	LIST_HEAD_INITIALIZER()	\
+	NULL,			\
+	NULL,			\
+	{0},			\
+	{0},			\
+	false,			\
+	NULL,			\
+	LIST_HEAD_INITIALIZER(),\
+	{0},			\
+	WINDOW,			\
+	{0},			\
+	{0},			\
+	-1,			\
+	{0},			\
+	0,			\
+	0,			\
+	""			\
 }
 
 static void
-send_presence(const struct context *ctx, const struct contact *c)
+send_presence(struct context *ctx, const struct contact *c)
 {
-	FILE *fh = NULL;
-
 	if (ctx == NULL || c == NULL)
 		return;
 
-	if (c->mystatus == NULL)
-		return;
-
-	if ((fh = fopen(ctx->out_file, "w")) == NULL)
-		goto err;
-
-	if (fprintf(fh,
+	/* without mystatus the presence has no status message */
+	if (sjin_printf(&ctx->in,
 		"<presence to='%s'>"
-			"<status>%s</status>"
+			"%s%s%s"
 			"<priority>1</priority>"
-		"</presence>", c->jid, c->mystatus) == -1)
-		goto err;
-
-	if (fclose(fh) == EOF)
+			"%s%s%s"
+		"</presence>", c->jid,
+		c->mystatus ? "<status>" : "",
+		c->mystatus ? c->mystatus : "",
+		c->mystatus ? "</status>" : "",
+		ctx->caps[0] ? "<c xmlns='" CAPS_NS "' hash='sha-1' node='"
+		    CAPS_NODE "' ver='" : "",
+		ctx->caps,
+		ctx->caps[0] ? "'/>" : "") == false)
 		goto err;
 	return;
  err:
@@ -137,6 +203,39 @@ check_contact(struct context *ctx, struct contact *c)
 		perror(__func__);
 }
 
+/* checks the contact, if polling shows a change of "mystatus" */
+static void
+poll_contact(struct context *ctx, struct contact *c)
+{
+	struct stat st;
+
+	if (stat(c->path, &st) == -1) {
+		if (errno != ENOENT) {
+			warn("%s", c->path);
+			return;
+		}
+		memset(&st, 0, sizeof st);
+		errno = 0;
+	}
+	if (st.st_ino == c->st.st_ino && st.st_size == c->st.st_size &&
+	    st.st_mtime == c->st.st_mtime)
+		return;
+	c->st = st;
+
+	check_contact(ctx, c);
+}
+
+static void
+contact_cb(struct watch *w, const char *name)
+{
+	struct contact *c = w->data;
+
+	if (name == NULL)
+		poll_contact(c->ctx, c);
+	else if (strcmp(name, "mystatus") == 0)
+		check_contact(c->ctx, c);
+}
+
 static void
 free_contact(struct contact *c)
 {
@@ -145,31 +244,52 @@ free_contact(struct contact *c)
 	free(c);
 }
 
+/*
+ * Adds the contact of the directory jid, watches it and sends its status.
+ * Known contacts are just watched again, if their directory was removed.
+ */
 static struct contact *
-add_contact(struct context *ctx, char *jid)
+add_contact(struct context *ctx, const char *jid)
 {
-	char *slash = NULL;
+	char path[PATH_MAX];
 	struct contact *c = NULL;
 
-	/* just handle the bare jabber id without resources */
-	if ((slash = strchr(jid, '/')) != NULL)
-		*slash = '\0';
+	if (snprintf(path, sizeof path, "%s/%s", ctx->dir, jid) >=
+	    (int)sizeof path) {
+		errno = ENAMETOOLONG;
+		goto err;
+	}
 
 	/* return contact if it exists already */
-	LIST_FOREACH(c, &ctx->roster, next)
-		if (strcmp(c->jid, jid) == 0)
-			return c;
+	if ((c = htab_get(ctx->roster, jid)) != NULL) {
+		if (c->watch.active == false) {
+			if (watch_add(&ctx->watcher, &c->watch, path) == false)
+				warn("%s", path);
+			check_contact(ctx, c);
+		}
+		return c;
+	}
 
 	/* create a new contact */
 	if ((c = calloc(1, sizeof *c)) == NULL) goto err;
 	if ((c->jid = strdup(jid)) == NULL) goto err;
+	c->ctx = ctx;
+	c->watch.cb = contact_cb;
+	c->watch.data = c;
 
 	/* prepare path of "mystatus" file */
-	if (snprintf(c->path, sizeof c->path, "%s/%s/mystatus",
-	    ctx->dir, c->jid) == 0)
+	if (snprintf(c->path, sizeof c->path, "%s/mystatus", path) >=
+	    (int)sizeof c->path) {
+		errno = ENAMETOOLONG;
 		goto err;
+	}
 
-	LIST_INSERT_HEAD(&ctx->roster, c, next);
+	if (htab_put(ctx->roster, c->jid, c) == false) goto err;
+
+	/* watch first, to not miss a change after the check */
+	if (watch_add(&ctx->watcher, &c->watch, path) == false)
+		warn("%s", path);
+	check_contact(ctx, c);
 
 	return c;
  err:
@@ -184,18 +304,15 @@ check_roster(struct context *ctx)
 {
 	DIR *dirp;
 	struct dirent *dp;
-	struct contact *c;
 
 	if (ctx->dir == NULL) return;
 	if ((dirp = opendir(ctx->dir)) == NULL) goto err;
 
 	while ((dp = readdir(dirp)) != NULL) {
-		if (strcmp(dp->d_name, ".") == 0 ||
-		    strcmp(dp->d_name, "..") == 0 ||
-		    dp->d_type != DT_DIR) continue;
+		/* hidden directories are caches */
+		if (dp->d_name[0] == '.' || dp->d_type != DT_DIR) continue;
 
-		if ((c = add_contact(ctx, dp->d_name)) != NULL)
-			check_contact(ctx, c);
+		add_contact(ctx, dp->d_name);
 	}
 
 	closedir(dirp);
@@ -206,83 +323,506 @@ check_roster(struct context *ctx)
 	return;
 }
 
+/* reads our own ver and sends it with a new presence, if it changed */
 static void
-recv_presence(char *tag, void *data)
+check_caps(struct context *ctx)
 {
-	struct context *ctx = data;
-	/* HACK: we need this, cause mxml can't parse tags by itself */
-	static mxml_node_t *tree = NULL;
-	static mxml_node_t *node = NULL;
-	const char *base = "<?xml ?><stream:stream></stream:stream>";
-	const char *tag_name = NULL;
-	const char *from = NULL;
-	char *slash = NULL;
+	char ver[CAPS_VER_SIZE];
+	struct contact *c;
+	size_t iter = 0;
+
+	if (caps_read(ctx->dir, ver) == false)
+		ver[0] = '\0';
+	errno = 0;
+	if (strcmp(ver, ctx->caps) == 0)
+		return;
+	memcpy(ctx->caps, ver, sizeof ver);
+
+	/* presenced just sends presences to contacts with mystatus */
+	while ((c = htab_next(ctx->roster, &iter)) != NULL)
+		if (c->mystatus != NULL)
+			send_presence(ctx, c);
+}
+
+/* looks for new contact directories */
+static void
+root_cb(struct watch *w, const char *name)
+{
+	struct context *ctx = w->data;
 	char path[PATH_MAX];
+	struct stat st;
+
+	if (name == NULL) {
+		check_caps(ctx);
+		check_roster(ctx);
+		return;
+	}
+	if (strcmp(name, CAPS_FILE) == 0) {
+		check_caps(ctx);
+		return;
+	}
+	if (name[0] == '.')
+		return;
+
+	if (snprintf(path, sizeof path, "%s/%s", ctx->dir, name) >=
+	    (int)sizeof path)
+		return;
+	if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+		add_contact(ctx, name);
+	errno = 0;
+}
+
+/* returns the cached descriptor of the status file */
+static int
+status_fd(struct context *ctx, struct buddy *b)
+{
+	char path[PATH_MAX];
+	struct buddy *old;
+	struct stat st;
+
+	if (b->fd != -1) {
+		TAILQ_REMOVE(&ctx->lru, b, lru);
+		TAILQ_INSERT_HEAD(&ctx->lru, b, lru);
+		return b->fd;
+	}
+
+	/* the directory of a buddy is created with its first write */
+	if (b->made == false) {
+		if (mkdirat(ctx->dirfd, b->name, S_IRWXU) == -1 &&
+		    errno != EEXIST)
+			return -1;
+		b->made = true;
+	}
+	if (snprintf(path, sizeof path, "%s/status", b->name) >=
+	    (int)sizeof path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((b->fd = openat(ctx->dirfd, path, O_RDWR|O_CREAT|O_CLOEXEC,
+	    S_IRUSR|S_IWUSR)) == -1)
+		return -1;
+	if (fstat(b->fd, &st) == -1) {
+		close(b->fd);
+		return b->fd = -1;
+	}
+	b->size = st.st_size;
+
+	if (ctx->nfds == STATUS_FDS) {
+		old = TAILQ_LAST(&ctx->lru, buddylru);
+		TAILQ_REMOVE(&ctx->lru, old, lru);
+		close(old->fd);
+		old->fd = -1;
+		ctx->nfds--;
+	}
+	TAILQ_INSERT_HEAD(&ctx->lru, b, lru);
+	ctx->nfds++;
+
+	return b->fd;
+}
+
+/*
+ * Rewrites the status file in place.  A shorter value is padded with
+ * newlines up to the old size, before the file is truncated, so readers
+ * never see an empty file or a rest of the old value.
+ */
+static bool
+write_status(struct context *ctx, struct buddy *b)
+{
+	size_t len = strlen(b->value);
+	size_t size = len > b->size ? len : b->size;
+	char *buf;
 	int fd;
-	bool is_online = false;
 
-	if (tree == NULL) tree = mxmlLoadString(NULL, base, MXML_NO_CALLBACK);
-	if (tree == NULL) err(EXIT_FAILURE, "%s: no xml tree found", __func__);
-	mxmlLoadString(tree, tag, MXML_NO_CALLBACK);
+	if ((fd = status_fd(ctx, b)) == -1)
+		return false;
 
-	if ((node = mxmlGetNextSibling(mxmlGetFirstChild(tree))) == NULL) goto err;
-	if ((tag_name = mxmlGetElement(node)) == NULL) goto err;
-	if (strcmp("presence", tag_name) != 0)
-		goto err;
+	if ((buf = malloc(size)) == NULL)
+		return false;
+	memcpy(buf, b->value, len);
+	memset(buf + len, '\n', size - len);
+	if (size > 0 && pwrite(fd, buf, size, 0) != (ssize_t)size) {
+		free(buf);
+		return false;
+	}
+	free(buf);
+	if (size > len && ftruncate(fd, len) == -1)
+		return false;
+	b->size = len;
+
+	free(b->written);
+	if ((b->written = strdup(b->value)) == NULL)
+		return false;
+
+	errno = 0;
+	return true;
+}
+
+/* writes str without the characters, that separate fields and lines */
+static void
+put_field(FILE *fh, const char *str, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		putc(strchr("\t\r\n", str[i]) ? ' ' : str[i], fh);
+}
+
+/* continues with the version of the snapshot of an earlier run */
+static void
+read_version(struct context *ctx)
+{
+	FILE *fh;
+	int fd;
+
+	if ((fd = openat(ctx->dirfd, SNAPSHOT, O_RDONLY|O_CLOEXEC)) == -1) {
+		errno = 0;
+		return;
+	}
+	if ((fh = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return;
+	}
+	if (fscanf(fh, "# version %lu", &ctx->version) != 1)
+		ctx->version = 0;
+	fclose(fh);
+}
 
-	if ((from = mxmlElementGetAttr(node, "from")) == NULL)
+/*
+ * Replaces the snapshot with the presence of all buddies at once.  It has
+ * a header line "# version N", which grows with every write, and a line
+ * "jid<TAB>show<TAB>status<TAB>changed" per buddy.
+ */
+static bool
+write_snapshot(struct context *ctx)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	struct buddy *b;
+	size_t iter = 0;
+	FILE *fh;
+
+	if (snprintf(path, sizeof path, "%s/%s", ctx->dir, SNAPSHOT) >=
+	    (int)sizeof path ||
+	    snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	if ((fh = fopen(tmp, "w")) == NULL)
+		return false;
+
+	fprintf(fh, "# version %lu\n", ++ctx->version);
+	while ((b = htab_next(ctx->buddies, &iter)) != NULL) {
+		const char *nl;
+
+		if (b->value == NULL)
+			continue;
+		nl = strchr(b->value, '\n');
+
+		fprintf(fh, "%s\t", b->name);
+		if (*b->value == '\0')
+			fputs("offline", fh);
+		else
+			put_field(fh, b->value,
+			    nl ? (size_t)(nl - b->value) : strlen(b->value));
+		putc('\t', fh);
+		if (nl != NULL)
+			put_field(fh, nl + 1, strlen(nl + 1));
+		fprintf(fh, "\t%lld\n", (long long)b->changed);
+	}
+
+	if (fclose(fh) == EOF)
+		goto err;
+	if (rename(tmp, path) == -1)
 		goto err;
 
-	/* The presence of the 'type' attribute indicates offline.
-	   The lack of it indicates online. */
-	if (mxmlElementGetAttr(node, "type"))
-		is_online = false;
-	else
-		is_online = true;
+	return true;
+ err:
+	unlink(tmp);
+	return false;
+}
+
+/* writes the buddies, whose presence changed during the window */
+static void
+flush_cb(struct ev_timer *t)
+{
+	struct context *ctx = t->data;
+	struct buddy *b;
+	bool changed = false;
+
+	while ((b = LIST_FIRST(&ctx->pending)) != NULL) {
+		LIST_REMOVE(b, pending_next);
+		b->pending = false;
+
+		/* it may have changed back in the meantime */
+		if (b->written != NULL && strcmp(b->written, b->value) == 0)
+			continue;
+		if (write_status(ctx, b) == false)
+			warn("%s", b->name);
+		changed = true;
+	}
+
+	if (changed && write_snapshot(ctx) == false)
+		warn("%s", SNAPSHOT);
+}
 
-	/* cut off resourcepart from jabber ID */
-	if ((slash = strchr(from, '/')) != NULL)
+static struct buddy *
+get_buddy(struct context *ctx, const char *jid)
+{
+	char key[BUFSIZ];
+	struct buddy *b;
+	char *slash;
+
+	if (jid_bare(jid, key, sizeof key) == false) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	if ((b = htab_get(ctx->buddies, key)) != NULL)
+		return b;
+
+	if ((b = calloc(1, sizeof *b)) == NULL) goto err;
+	LIST_INIT(&b->resources);
+	b->fd = -1;
+	if ((b->key = strdup(key)) == NULL) goto err;
+	if ((b->name = strdup(jid)) == NULL) goto err;
+	if ((slash = strchr(b->name, '/')) != NULL)
 		*slash = '\0';
+	if (htab_put(ctx->buddies, b->key, b) == false) goto err;
 
-	if (mkdir(ctx->dir, S_IRUSR|S_IWUSR|S_IXUSR) == -1) {
-		if (errno != EEXIST) err(EXIT_FAILURE, "mkdir");
-		errno = 0;
+	return b;
+ err:
+	if (b != NULL) {
+		free(b->name);
+		free(b->key);
 	}
+	free(b);
+	return NULL;
+}
 
-	snprintf(path, sizeof path, "%s/%s", ctx->dir, from);
-	if (mkdir(path, S_IRUSR|S_IWUSR|S_IXUSR) == -1) {
-		if (errno != EEXIST) err(EXIT_FAILURE, "mkdir");
-		errno = 0;
+static void
+free_resource(struct resource *r)
+{
+	LIST_REMOVE(r, next);
+	free(r->name);
+	free(r->show);
+	free(r->status);
+	free(r);
+}
+
+/*
+ * The status file holds the show of the resource with the highest
+ * priority or "online" and its status message in a second line.
+ * It is empty, if the buddy is offline.
+ */
+static char *
+aggregate(const struct buddy *b)
+{
+	struct resource *r, *best = NULL;
+	char *value;
+
+	LIST_FOREACH(r, &b->resources, next)
+		if (best == NULL || r->priority > best->priority)
+			best = r;
+
+	if (best == NULL)
+		return strdup("");
+	if (asprintf(&value, "%s%s%s", best->show ? best->show : "online",
+	    best->status ? "\n" : "", best->status ? best->status : "") < 0)
+		return NULL;
+
+	return value;
+}
+
+/* updates the resource of the buddy from an available presence */
+static bool
+update_resource(struct buddy *b, const char *resource, const char *tag)
+{
+	struct resource *r;
+	const char *child;
+	char text[BUFSIZ];
+
+	LIST_FOREACH(r, &b->resources, next)
+		if (strcmp(r->name, resource) == 0)
+			break;
+	if (r == NULL) {
+		if ((r = calloc(1, sizeof *r)) == NULL)
+			return false;
+		if ((r->name = strdup(resource)) == NULL) {
+			free(r);
+			return false;
+		}
+		LIST_INSERT_HEAD(&b->resources, r, next);
 	}
 
-	snprintf(path, sizeof path, "%s/%s/status", ctx->dir, from);
+	free(r->show);
+	free(r->status);
+	r->show = r->status = NULL;
+	r->priority = 0;
+
+	if ((child = stanza_child(tag, "show")) != NULL &&
+	    stanza_text(child, text, sizeof text) > 0 &&
+	    (r->show = strdup(text)) == NULL)
+		return false;
+	if ((child = stanza_child(tag, "status")) != NULL &&
+	    stanza_text(child, text, sizeof text) > 0 &&
+	    (r->status = strdup(text)) == NULL)
+		return false;
+	if ((child = stanza_child(tag, "priority")) != NULL &&
+	    stanza_text(child, text, sizeof text) > 0) {
+		long prio = strtol(text, NULL, 10);
+
+		r->priority = prio < -128 ? -128 : prio > 127 ? 127 : prio;
+	}
+
+	return true;
+}
 
-	if ((fd = open(path, O_WRONLY|O_TRUNC|O_CREAT, S_IRUSR|S_IWUSR)) == -1)
+/*
+ * Asks for the features behind an unknown ver of entity capabilities.
+ * An empty file in the cache marks the query, so every ver is asked for
+ * just once.  iqd(1) writes the answer into this file.
+ */
+static void
+query_caps(struct context *ctx, const char *tag, const char *from)
+{
+	const char *c;
+	char ver[CAPS_VER_SIZE];
+	char name[CAPS_VER_SIZE];
+	char node[BUFSIZ];
+	char path[PATH_MAX];
+	char esc_from[STANZA_ESCAPE_SIZE(BUFSIZ)];
+	char esc_node[STANZA_ESCAPE_SIZE(sizeof node)];
+	struct slice hash;
+	int fd;
+
+	if ((c = stanza_child(tag, "c")) == NULL)
+		return;
+	if (stanza_attr(c, "hash", &hash) == false ||
+	    slice_eq(&hash, "sha-1") == false ||
+	    stanza_attr_copy(c, "ver", ver, sizeof ver) == false ||
+	    stanza_attr_copy(c, "node", node, sizeof node) == false ||
+	    caps_name(ver, name, sizeof name) == false)
+		return;
+
+	if (snprintf(path, sizeof path, CAPS_CACHE "/%s", name) >=
+	    (int)sizeof path)
+		return;
+	if ((fd = openat(ctx->dirfd, path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC,
+	    S_IRUSR|S_IWUSR)) == -1 && errno == ENOENT) {
+		if (mkdirat(ctx->dirfd, CAPS_CACHE, S_IRWXU) == -1 &&
+		    errno != EEXIST) goto err;
+		fd = openat(ctx->dirfd, path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC,
+		    S_IRUSR|S_IWUSR);
+	}
+	if (fd == -1) {
+		if (errno == EEXIST) {
+			errno = 0;
+			return;
+		}
+		goto err;
+	}
+	close(fd);
+
+	stanza_escape(from, strlen(from), esc_from, sizeof esc_from);
+	stanza_escape(node, strlen(node), esc_node, sizeof esc_node);
+	if (sjin_printf(&ctx->in,
+		"<iq type='get' to='%s' id='" CAPS_ID "%s'>"
+			"<query xmlns='http://jabber.org/protocol/disco#info'"
+			" node='%s#%s'/>"
+		"</iq>", esc_from, name, esc_node, ver) == false)
 		goto err;
+	return;
+ err:
+	if (errno != 0)
+		perror(__func__);
+	errno = 0;
+}
 
-	if (is_online) {
-		mxml_node_t *show = NULL;
-		const char *status;
-		if ((show = mxmlFindElement(node, tree, "show", NULL, NULL,
-		                           MXML_DESCEND_FIRST)) != NULL)
-			status = mxmlGetText(show, NULL);
-		else
-			status = "online";
-		if (write(fd, status, strlen(status)) == -1) goto err;
+static void
+recv_presence(char *tag, void *data)
+{
+	struct context *ctx = data;
+	struct slice name;
+	struct slice type;
+	struct buddy *b;
+	struct resource *r, *tmp;
+	char from[BUFSIZ];
+	char *resource;
+	char *value;
+
+	if (stanza_name(tag, &name) == false) goto err;
+	if (slice_eq(&name, "presence") == false)
+		goto err;
+
+	if (stanza_attr_copy(tag, "from", from, sizeof from) == false)
+		goto err;
+	if ((b = get_buddy(ctx, from)) == NULL) goto err;
+	resource = strchr(from, '/');
+	resource = resource == NULL ? "" : resource + 1;
+
+	/* The presence of the 'type' attribute indicates offline.
+	   The lack of it indicates online. */
+	if (stanza_attr(tag, "type", &type) == false) {
+		if (update_resource(b, resource, tag) == false) goto err;
+		query_caps(ctx, tag, from);
+	} else if (slice_eq(&type, "unavailable") || slice_eq(&type, "error")) {
+		for (r = LIST_FIRST(&b->resources); r != NULL; r = tmp) {
+			tmp = LIST_NEXT(r, next);
+			if (*resource == '\0' || slice_eq(&type, "error") ||
+			    strcmp(r->name, resource) == 0)
+				free_resource(r);
+		}
+	} else {
+		/* subscription requests don't change the presence */
+		return;
+	}
+
+	/* just changes of the aggregated value are written */
+	if ((value = aggregate(b)) == NULL) goto err;
+	if (b->value != NULL && strcmp(value, b->value) == 0) {
+		free(value);
+		return;
 	}
-	/* write nothing; make fd an empty file */
-	if (close(fd) == -1) goto err;
+	free(b->value);
+	b->value = value;
+	b->changed = time(NULL);
 
+	if (b->pending == false) {
+		b->pending = true;
+		LIST_INSERT_HEAD(&ctx->pending, b, pending_next);
+	}
+	if (ctx->flush.active == false)
+		ev_timer_add(ctx->ev, &ctx->flush, ctx->window);
+	return;
  err:
 	if (errno != 0)
 		perror(__func__);
-	mxmlDelete(node);
+}
+
+static void
+server_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	(void)revents;
+	while ((n = read(io->fd, buf, sizeof buf)) > 0)
+		bxml_add_buf(ctx->bxml, buf, n);
+
+	if (n == -1 && errno == EAGAIN) {
+		errno = 0;
+		return;
+	}
+	if (n == -1)
+		warn("read");
+
+	/* connection closed, finish this round and quit */
+	ev_io_del(ctx->ev, io);
+	ctx->quit = true;
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: presenced -d DIR\n");
+	fprintf(stderr, "usage: presenced [-w msec] -d DIR\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -292,7 +832,7 @@ main(int argc, char *argv[])
 	struct context ctx = NULL_CONTEXT;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "d:i:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:i:w:")) != -1) {
 		switch (ch) {
 		case 'i':
 			ctx.fd_in = strtol(optarg, NULL, 0);
@@ -300,6 +840,12 @@ main(int argc, char *argv[])
 		case 'd':
 			ctx.dir = optarg;
 			break;
+		case 'w':
+			errno = 0;
+			ctx.window = strtol(optarg, NULL, 10);
+			if (errno != 0 || ctx.window < 0)
+				usage();
+			break;
 		default:
 			usage();
 			/* NOTREACHED */
@@ -310,31 +856,50 @@ main(int argc, char *argv[])
 
 	snprintf(ctx.out_file, sizeof ctx.out_file, "%s/in", ctx.dir);
 
+	if ((ctx.ev = ev_init()) == NULL) goto err;
+	if ((ctx.buddies = htab_init(0)) == NULL) goto err;
+	ctx.flush.cb = flush_cb;
+	ctx.flush.data = &ctx;
+	if (mkdir(ctx.dir, S_IRWXU) == -1 && errno != EEXIST) goto err;
+	errno = 0;
+	if ((ctx.dirfd = open(ctx.dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+		goto err;
+	TAILQ_INIT(&ctx.lru);
+	read_version(&ctx);
+	if (sjin_init(&ctx.in, ctx.ev, ctx.out_file) == false) goto err;
+	signal(SIGPIPE, SIG_IGN);	/* sjin reconnects on EPIPE */
+
+	/* watch the roster, before it is read */
+	if ((ctx.roster = htab_init(0)) == NULL) goto err;
+	if (watch_init(&ctx.watcher, ctx.ev) == false) goto err;
+	ctx.root.cb = root_cb;
+	ctx.root.data = &ctx;
+	if (watch_add(&ctx.watcher, &ctx.root, ctx.dir) == false)
+		warn("%s", ctx.dir);
+	caps_read(ctx.dir, ctx.caps);
 	check_roster(&ctx);
+	sjin_flush(&ctx.in);
 
 	/* initialize block parser and set callback function */
 	ctx.bxml = bxml_ctx_init(recv_presence, &ctx);
 
-	for (;;) {
-		int max_fd = 0;
-		ssize_t n;
-		fd_set readfds;
-		FD_ZERO(&readfds);
-		FD_SET(ctx.fd_in, &readfds);
-		max_fd = ctx.fd_in;
-
-		/* wait for input */
-		if (select(max_fd+1, &readfds, NULL, NULL, NULL) < 0)
-			err(EXIT_FAILURE, "select");
-
-		/* check for input from server */
-		if (FD_ISSET(ctx.fd_in, &readfds)) {
-			char buf[BUFSIZ];
-			if ((n = read(ctx.fd_in, buf, BUFSIZ)) < 0) goto err;
-			if (n == 0) break;	/* connection closed */
-			bxml_add_buf(ctx.bxml, buf, n);
-		}
+	/* the server side is watched edge triggered, so don't block on it */
+	if (fcntl(ctx.fd_in, F_SETFL, fcntl(ctx.fd_in, F_GETFL) | O_NONBLOCK)
+	    == -1) goto err;
+	ctx.io_in.fd = ctx.fd_in;
+	ctx.io_in.events = EV_READ;
+	ctx.io_in.cb = server_cb;
+	ctx.io_in.data = &ctx;
+	if (ev_io_add(ctx.ev, &ctx.io_in) == false) goto err;
+
+	while (ctx.quit == false) {
+		if (ev_dispatch(ctx.ev) == -1) goto err;
+		sjin_flush(&ctx.in);
 	}
+	ev_timer_del(ctx.ev, &ctx.flush);
+	flush_cb(&ctx.flush);
+	sjin_close(&ctx.in);
+
 	return EXIT_SUCCESS;
  err:
 	if (errno != 0)
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "htab.h"
+#include "rcache.h"
+#include "stanza.h"
+
+struct item {
+	char *jid;
+	char *line;		/* the fields after the jid */
+};
+
+static void
+free_item(struct item *it)
+{
+	if (it == NULL) return;
+	free(it->jid);
+	free(it->line);
+	free(it);
+}
+
+/* replaces the characters, that separate fields and lines */
+static void
+clean(char *str)
+{
+	for (; *str != '\0'; str++)
+		if (strchr("\t\r\n", *str) != NULL)
+			*str = ' ';
+}
+
+/* adds or replaces the contact jid and takes both strings */
+static bool
+put(struct rcache *rc, char *jid, char *line)
+{
+	struct item *it;
+
+	if ((it = htab_get(rc->items, jid)) != NULL) {
+		free(jid);
+		free(it->line);
+		it->line = line;
+		return true;
+	}
+
+	if ((it = malloc(sizeof *it)) == NULL)
+		goto err;
+	it->jid = jid;
+	it->line = line;
+	if (htab_put(rc->items, it->jid, it) == false) {
+		free(it);
+		goto err;
+	}
+
+	return true;
+ err:
+	free(jid);
+	free(line);
+	return false;
+}
+
+static void
+free_items(struct htab *items)
+{
+	struct item *it;
+	size_t iter = 0;
+
+	if (items == NULL)
+		return;
+	while ((it = htab_next(items, &iter)) != NULL)
+		free_item(it);
+	htab_free(items);
+}
+
+/* loads the cache of an earlier run, if there is one */
+bool
+rcache_init(struct rcache *rc, const char *dir)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t n;
+	FILE *fh;
+
+	memset(rc, 0, sizeof *rc);
+	if (asprintf(&rc->path, "%s/" RCACHE_FILE, dir) == -1) {
+		rc->path = NULL;
+		return false;
+	}
+	if ((rc->items = htab_init(0)) == NULL)
+		return false;
+
+	if ((fh = fopen(rc->path, "r")) == NULL) {
+		if (errno != ENOENT)
+			return false;
+		errno = 0;
+		return true;
+	}
+
+	while ((n = getline(&line, &size, fh)) != -1) {
+		char *tab, *jid, *rest;
+
+		if (n > 0 && line[n - 1] == '\n')
+			line[n - 1] = '\0';
+
+		if (strncmp(line, "# ver ", 6) == 0) {
+			free(rc->ver);
+			if ((rc->ver = strdup(line + 6)) == NULL)
+				goto err;
+			continue;
+		}
+		if ((tab = strchr(line, '\t')) == NULL)
+			continue;
+
+		jid = strndup(line, tab - line);
+		rest = strdup(tab + 1);
+		if (jid == NULL || rest == NULL) {
+			free(jid);
+			free(rest);
+			goto err;
+		}
+		if (put(rc, jid, rest) == false)
+			goto err;
+	}
+	free(line);
+	fclose(fh);
+
+	return true;
+ err:
+	free(line);
+	fclose(fh);
+	return false;
+}
+
+void
+rcache_free(struct rcache *rc)
+{
+	free_items(rc->items);
+	free(rc->path);
+	free(rc->ver);
+	memset(rc, 0, sizeof *rc);
+}
+
+/* applies one item of a roster query */
+static bool
+apply_item(struct rcache *rc, const char *jid, const char *sub,
+    const char *name, const char *groups)
+{
+	char *key, *line;
+
+	if (strcmp(sub, "remove") == 0) {
+		free_item(htab_del(rc->items, jid));
+		return true;
+	}
+
+	if ((key = strdup(jid)) == NULL)
+		return false;
+	if (asprintf(&line, "%s\t%s%s", sub, name, groups) == -1) {
+		free(key);
+		return false;
+	}
+	clean(key);
+
+	return put(rc, key, line);
+}
+
+/*
+ * Applies the items of a roster query element.  With all, the query is the
+ * whole roster and replaces the cache, once it is read completely.
+ * Otherwise it is a push of changed items.  The ver of the query becomes
+ * the version of the cache.  On failure the version is cleared, so the
+ * next login fetches the whole roster again.
+ */
+bool
+rcache_apply(struct rcache *rc, const char *query, bool all)
+{
+	struct rcache new = {0};
+	struct rcache *dst = rc;
+	struct stanza_reader r;
+	struct stanza_token t;
+	char jid[BUFSIZ];
+	char sub[BUFSIZ];
+	char name[BUFSIZ];
+	char text[BUFSIZ];
+	char groups[BUFSIZ * 4];
+	char ver[BUFSIZ];
+	size_t glen = 0;
+	bool in_item = false;
+	bool in_group = false;
+	bool has_ver;
+
+	has_ver = stanza_attr_copy(query, "ver", ver, sizeof ver);
+	if (all) {
+		if ((new.items = htab_init(0)) == NULL)
+			goto err;
+		dst = &new;
+	}
+
+	stanza_reader_init(&r, query);
+	while (stanza_next(&r, &t) != STANZA_EOF && t.type != STANZA_ERROR) {
+		switch (t.type) {
+		case STANZA_START:
+			if (slice_eq(&t.name, "group")) {
+				in_group = in_item && t.empty == false;
+				break;
+			}
+			if (slice_eq(&t.name, "item") == false)
+				break;
+
+			in_item = stanza_attr_copy(t.elem, "jid", jid,
+			    sizeof jid);
+			if (stanza_attr_copy(t.elem, "subscription", sub,
+			    sizeof sub) == false)
+				snprintf(sub, sizeof sub, "none");
+			if (stanza_attr_copy(t.elem, "name", name,
+			    sizeof name) == false)
+				name[0] = '\0';
+			clean(sub);
+			clean(name);
+			groups[0] = '\0';
+			glen = 0;
+
+			if (in_item && t.empty) {
+				if (apply_item(dst, jid, sub, name, groups)
+				    == false)
+					goto err;
+				in_item = false;
+			}
+			break;
+		case STANZA_TEXT:
+			if (in_group == false || t.text.len >= sizeof text)
+				break;
+			if (t.cdata) {
+				memcpy(text, t.text.ptr, t.text.len);
+				text[t.text.len] = '\0';
+			} else
+				text[stanza_unescape(t.text.ptr, t.text.len,
+				    text)] = '\0';
+			clean(text);
+
+			/* a group, that does not fit, is dropped */
+			if (glen + strlen(text) + 1 < sizeof groups)
+				glen += snprintf(groups + glen,
+				    sizeof groups - glen, "\t%s", text);
+			break;
+		case STANZA_END:
+			if (slice_eq(&t.name, "group")) {
+				in_group = false;
+			} else if (slice_eq(&t.name, "item") && in_item) {
+				if (apply_item(dst, jid, sub, name, groups)
+				    == false)
+					goto err;
+				in_item = false;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (all) {
+		free_items(rc->items);
+		rc->items = new.items;
+	}
+
+	free(rc->ver);
+	rc->ver = NULL;
+	if (has_ver) {
+		clean(ver);
+		if ((rc->ver = strdup(ver)) == NULL)
+			return false;
+	}
+
+	return true;
+ err:
+	free_items(new.items);
+	free(rc->ver);
+	rc->ver = NULL;
+	return false;
+}
+
+static int
+item_cmp(const void *a, const void *b)
+{
+	const struct item *x = *(struct item * const *)a;
+	const struct item *y = *(struct item * const *)b;
+
+	return strcmp(x->jid, y->jid);
+}
+
+/* replaces the file with the cache at once */
+bool
+rcache_write(const struct rcache *rc)
+{
+	struct item **items;
+	struct item *it;
+	char tmp[BUFSIZ];
+	size_t iter = 0, n = 0;
+	FILE *fh;
+
+	if (snprintf(tmp, sizeof tmp, "%s.tmp", rc->path) >= (int)sizeof tmp) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	if ((items = calloc(rc->items->count + 1, sizeof *items)) == NULL)
+		return false;
+	while ((it = htab_next(rc->items, &iter)) != NULL)
+		items[n++] = it;
+	if (n > 0)
+		qsort(items, n, sizeof *items, item_cmp);
+
+	if ((fh = fopen(tmp, "w")) == NULL)
+		goto err;
+	fprintf(fh, "# ver %s\n", rc->ver != NULL ? rc->ver : "");
+	for (size_t i = 0; i < n; i++)
+		fprintf(fh, "%s\t%s\n", items[i]->jid, items[i]->line);
+	if (fclose(fh) == EOF)
+		goto err;
+	if (rename(tmp, rc->path) == -1)
+		goto err;
+	free(items);
+
+	return true;
+ err:
+	unlink(tmp);
+	free(items);
+	return false;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RCACHE_H
+#define RCACHE_H
+
+#include <stdbool.h>
+
+#define RCACHE_FILE	"roster"	/* cache in the base directory */
+#define RCACHE_NS	"jabber:iq:roster"
+#define RCACHE_ID	"roster_"	/* prefix of the roster fetch of iqd */
+
+/*
+ * Local copy of the roster, that iqd(1) keeps up to date with the results
+ * and pushes of the server.  The file has a header line "# ver V" with the
+ * roster version of the server (XEP-0237) and a line
+ * "jid<TAB>subscription<TAB>name[<TAB>group]..." per contact, sorted by
+ * jid.
+ */
+struct rcache {
+	char *path;
+	char *ver;		/* NULL without roster versioning */
+	struct htab *items;	/* by jid */
+};
+
+bool rcache_init(struct rcache *rc, const char *dir);
+void rcache_free(struct rcache *rc);
+bool rcache_apply(struct rcache *rc, const char *query, bool all);
+bool rcache_write(const struct rcache *rc);
+
+#endif
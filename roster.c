@@ -14,18 +14,21 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <sys/stat.h>
-
 #include <assert.h>
-#include <fcntl.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <mxml.h>
 
+#include "iqc.h"
+#include "rcache.h"
+#include "stanza.h"
+
 static bool
 result(mxml_node_t *iq)
 {
@@ -35,22 +38,47 @@ result(mxml_node_t *iq)
 	return true;
 }
 
+/* escapes str into buf and fails if it does not fit */
+static bool
+escape(const char *str, char *buf, size_t size)
+{
+	if (str == NULL) {
+		buf[0] = '\0';
+		return true;
+	}
+
+	if (stanza_escape(str, strlen(str), buf, size) >= size) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	return true;
+}
+
 static bool
-add(FILE *fh, const char *jid, const char *name, const char *group)
+add(char *buf, size_t size, const char *jid, const char *name,
+    const char *group)
 {
 	char group_str[BUFSIZ];
 	char name_str[BUFSIZ];
-	snprintf(group_str, sizeof group_str, "<group>%s</group>", group);
-	snprintf(name_str, sizeof group_str, "name='%s'", name);
+	char esc[BUFSIZ];
+
+	if (escape(group, esc, sizeof esc) == false) goto err;
+	if (snprintf(group_str, sizeof group_str, "<group>%s</group>", esc)
+	    >= (int)sizeof group_str) goto err;
+	if (escape(name, esc, sizeof esc) == false) goto err;
+	if (snprintf(name_str, sizeof name_str, "name='%s'", esc) >=
+	    (int)sizeof name_str) goto err;
+	if (escape(jid, esc, sizeof esc) == false) goto err;
 
-	if (fprintf(fh,
+	if (snprintf(buf, size,
 	    "<iq type='set' id='roster-%d'>"
 		"<query xmlns='jabber:iq:roster'>"
 		   "<item jid='%s' %s>%s</item>"
 		"</query>"
-	    "</iq>", getpid(), jid,
+	    "</iq>", getpid(), esc,
 	    name  == NULL ? "" : name_str,
-	    group == NULL ? "" : group_str) == -1) goto err;
+	    group == NULL ? "" : group_str) >= (int)size) goto err;
 	return true;
  err:
 	perror(__func__);
@@ -76,10 +104,53 @@ list(mxml_node_t *iq)
 	return true;
 }
 
+/* prints the roster from the cache of iqd(1) in the format of list() */
+static bool
+list_cache(const char *dir)
+{
+	char path[PATH_MAX];
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t n;
+	FILE *fh;
+
+	if (snprintf(path, sizeof path, "%s/" RCACHE_FILE, dir) >=
+	    (int)sizeof path) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	if ((fh = fopen(path, "r")) == NULL)
+		return false;
+
+	while ((n = getline(&line, &size, fh)) != -1) {
+		char *jid, *sub, *name;
+
+		if (line[0] == '#')
+			continue;
+		if (n > 0 && line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		jid = line;
+		if ((sub = strchr(jid, '\t')) == NULL)
+			continue;
+		*sub++ = '\0';
+		if ((name = strchr(sub, '\t')) == NULL)
+			name = "";
+		else
+			*name++ = '\0';
+		name[strcspn(name, "\t")] = '\0';
+
+		printf("%-30s\t%s\t%s\n", jid, sub, name);
+	}
+	free(line);
+	fclose(fh);
+
+	return true;
+}
+
 static void
 usage(void)
 {
-	fprintf(stderr, "roster [-d <dir>]\n");
+	fprintf(stderr, "roster [-f] [-d <dir>]\n");
 	fprintf(stderr, "roster [-d <dir>] [-n <name>] [-g group] -a <jid>\n");
 	fprintf(stderr, "roster [-d <dir>] -r <jid>\n");
 	exit(EXIT_FAILURE);
@@ -88,21 +159,24 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-	FILE *fh = NULL;
-	int fd;
+	struct iqc c;
 	int ch;
 	bool add_flag = false;
 	bool remove_flag = false;
 	bool list_flag = false;
-	char path_out[PATH_MAX];
-	char path_in[PATH_MAX];
+	bool fetch_flag = false;
+	char query[BUFSIZ * 4];
+	char *answer;
 	char *dir = getenv("SJ_DIR");
 	char *jid = NULL;
 	char *name = NULL;
 	char *group = NULL;
 
-	while ((ch = getopt(argc, argv, "d:g:n:la:r:h")) != -1) {
+	while ((ch = getopt(argc, argv, "d:fg:n:la:r:h")) != -1) {
 		switch (ch) {
+		case 'f':
+			fetch_flag = true;
+			break;
 		case 'd':
 			dir = optarg;
 			break;
@@ -132,45 +206,48 @@ main(int argc, char *argv[])
 	if (dir == NULL)
 		usage();
 
+	/* without a cache, the roster comes from the server */
+	if (add_flag == false && remove_flag == false && fetch_flag == false) {
+		if (list_cache(dir))
+			return EXIT_SUCCESS;
+		if (errno != ENOENT)
+			goto err;
+	}
+
 	/* HACK: we need this, cause mxml can't parse tags by itself */
 	mxml_node_t *tree = NULL;
 	const char *base = "<?xml ?><stream:stream></stream:stream>";
 	tree = mxmlLoadString(NULL, base, MXML_NO_CALLBACK);
 	assert(tree != NULL);
 
-	/* prepare fifo for answer from server */
-	snprintf(path_in, sizeof path_in, "%s/roster-%d", dir, getpid());
-	if (mkfifo(path_in, S_IRUSR|S_IWUSR) == -1) goto err;
-
-	/* send query to server */
-	snprintf(path_out, sizeof path_out, "%s/%s", dir, "in");
-	if ((fh = fopen(path_out, "w")) == NULL) goto err;
-
 	if (add_flag && jid != NULL) {
-		add(fh, jid, name, group);
+		if (add(query, sizeof query, jid, name, group) == false)
+			return EXIT_FAILURE;
 	} else if (remove_flag && jid != NULL) {
-		if (fprintf(fh,
+		char esc[BUFSIZ];
+
+		if (escape(jid, esc, sizeof esc) == false) goto err;
+		snprintf(query, sizeof query,
 		    "<iq type='set' id='roster-%d'>"
 			"<query xmlns='jabber:iq:roster'>"
 			    "<item jid='%s' subscription='remove'/>"
 			"</query>"
-		    "</iq>", getpid(), jid) == -1) goto err;
+		    "</iq>", getpid(), esc);
 	} else {
 		list_flag = true;
-		if (fprintf(fh,
+		snprintf(query, sizeof query,
 		    "<iq type='get' id='roster-%d'>"
 			"<query xmlns='jabber:iq:roster'/>"
-		    "</iq>", getpid()) == -1) goto err;
+		    "</iq>", getpid());
 	}
 
-	if (fclose(fh) == EOF) goto err;
-
-	/* read answer from server */
-	if ((fd = open(path_in, O_RDONLY )) == -1) goto err;
-	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) goto err;
-	mxmlLoadFd(tree, fd, MXML_NO_CALLBACK);
-	if (close(fd) == -1) goto err;
-	if (unlink(path_in) == -1) goto err;
+	/* iqd sends the query to the server and returns the answer */
+	if (iqc_open(&c, dir) == false) goto err;
+	if (iqc_send(&c, query, strlen(query)) == false) goto err;
+	if ((answer = iqc_recv(&c, IQC_TIMEOUT * 1000)) == NULL) goto err;
+	iqc_close(&c);
+	mxmlLoadString(tree, answer, MXML_NO_CALLBACK);
+	free(answer);
 
 	if (list_flag &&
 	    list(mxmlGetNextSibling(mxmlGetFirstChild(tree))) == false)
@@ -14,10 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <sys/select.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -27,6 +29,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -45,9 +48,9 @@
 #include "sasl/sasl.h"
 #include "bxml/bxml.h"
 
-#ifndef MAX
-#define MAX(a, b) ((a) < (b) ? (b) : (a))
-#endif
+#include "ev.h"
+#include "netstring.h"
+#include "stanza.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX _XOPEN_PATH_MAX
@@ -57,10 +60,79 @@
 #define WRITE_FD 7
 #define READ_FD 6
 
+/* keep alive pings */
+#define PING_INTERVAL	30000	/* msec */
+#define PING_TIMEOUT	30000	/* msec */
+
 static bool debug = false;
 char **argv0;
 int argc0;
 
+/* original file status flags of the ucspi descriptors */
+static int read_flags;
+static int write_flags;
+
+/*
+ * Outbound queue of the server connection.  Small stanzas are coalesced
+ * into chunks and the chunks are written with writev(2), when WRITE_FD is
+ * writable.
+ */
+#define CHUNK_SIZE 4096
+#define IOV_CNT 64
+
+struct chunk {
+	TAILQ_ENTRY(chunk) next;
+	size_t size;	/* capacity of data */
+	size_t len;	/* used bytes of data */
+	size_t off;	/* bytes of data already written */
+	char data[];
+};
+
+static TAILQ_HEAD(chunkq, chunk) outq = TAILQ_HEAD_INITIALIZER(outq);
+static size_t outq_len = 0;		/* bytes waiting in the queue */
+static size_t outq_max = 64 * 1024;	/* high-water mark */
+static size_t outq_pushed = 0;		/* bytes ever queued */
+static size_t outq_written = 0;		/* bytes ever written */
+
+/*
+ * Local programs submit whole stanzas as netstrings over the socket
+ * <dir>/sock.  An empty netstring asks for an acknowledgement.  sj answers
+ * it with an empty netstring, as soon as all stanzas, that the client sent
+ * before, are written to the server.
+ */
+#define SOCK_FILE	"sock"
+#define CLIENT_BUF	(64 * 1024)	/* read ahead of one client */
+
+struct client {
+	struct ev_io io;
+	struct context *ctx;
+	TAILQ_ENTRY(client) next;
+	char *buf;
+	size_t off;		/* start of the unhandled data */
+	size_t len;
+	size_t size;
+	bool eof;
+	bool sync;		/* waits for its acknowledgement */
+	size_t sync_at;		/* outq_pushed at the request */
+};
+
+TAILQ_HEAD(clients, client);
+
+/*
+ * Input of the fifo, that does not end at a stanza boundary yet.  Writers
+ * may split a stanza over several writes, and a part of a stanza in the
+ * output queue would mix with the stanzas of the socket clients.
+ */
+#define FIFO_MAX	(1024 * 1024)	/* longest stanza from the fifo */
+
+static struct {
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t scan;		/* end of the complete tokens */
+	int depth;		/* element depth at scan */
+} fifo;
+
 /* XMPP session states */
 enum xmpp_state {OPEN, AUTH, BIND_OUT, BIND, SESSION};
 
@@ -81,11 +153,30 @@ struct context {
 
 	/* state of the xmpp session */
 	enum xmpp_state state;
+	bool rosterver;		/* server supports roster versioning */
 
 	/* frontend daemon */
 	FILE *fh_msg;
 	FILE *fh_pre;
 	FILE *fh_iq;
+
+	/* event loop */
+	struct ev_loop *ev;
+	struct ev_io io_read;	/* READ_FD */
+	struct ev_io io_write;	/* WRITE_FD */
+	struct ev_io io_in;	/* input fifo */
+	struct ev_io io_sock;	/* listening input socket */
+	struct ev_io io_msg;	/* pipes to the frontend daemons */
+	struct ev_io io_pre;
+	struct ev_io io_iq;
+	struct ev_timer ping;	/* sends keep alive pings */
+	struct ev_timer pong;	/* deadline of the ping reply */
+	bool quit;
+
+	/* clients of the input socket in round-robin order */
+	char sock[PATH_MAX];
+	struct clients clients;
+	size_t nclients;
 };
 
 #define NULL_CONTEXT {				\
@@ -98,18 +189,129 @@ struct context {
 	NULL,	/* char *dir; */		\
 	-1,	/* int fd_in; */		\
 	OPEN,	/* enum xmpp_stat; */		\
+	false,	/* bool rosterver; */		\
 	NULL,	/* FILE *fh_msg; */		\
 	NULL,	/* FILE *fh_pre; */		\
-	NULL	/* FILE *fh_iq; */		\
+	NULL,	/* FILE *fh_iq; */		\
+	NULL,	/* struct ev_loop *ev; */	\
+	{0},	/* struct ev_io io_read; */	\
+	{0},	/* struct ev_io io_write; */	\
+	{0},	/* struct ev_io io_in; */	\
+	{0},	/* struct ev_io io_sock; */	\
+	{0},	/* struct ev_io io_msg; */	\
+	{0},	/* struct ev_io io_pre; */	\
+	{0},	/* struct ev_io io_iq; */	\
+	{0},	/* struct ev_timer ping; */	\
+	{0},	/* struct ev_timer pong; */	\
+	false,	/* bool quit; */		\
+	{0},	/* char sock[PATH_MAX]; */	\
+	{0},	/* struct clients clients; */	\
+	0	/* size_t nclients; */		\
+}
+
+static bool
+outq_push(const char *buf, size_t len)
+{
+	struct chunk *c = TAILQ_LAST(&outq, chunkq);
+
+	/* coalesce small stanzas into the last chunk */
+	if (c == NULL || c->size - c->len < len) {
+		size_t size = len > CHUNK_SIZE ? len : CHUNK_SIZE;
+
+		if ((c = malloc(sizeof *c + size)) == NULL)
+			return false;
+		c->size = size;
+		c->len = c->off = 0;
+		TAILQ_INSERT_TAIL(&outq, c, next);
+	}
+
+	memcpy(c->data + c->len, buf, len);
+	c->len += len;
+	outq_len += len;
+	outq_pushed += len;
+
+	return true;
+}
+
+/*
+ * Writes as much of the queue as possible without blocking.
+ */
+static bool
+outq_flush(void)
+{
+	struct iovec iov[IOV_CNT];
+	struct chunk *c;
+	ssize_t n;
+	int cnt;
+
+	while (!TAILQ_EMPTY(&outq)) {
+		cnt = 0;
+		TAILQ_FOREACH(c, &outq, next) {
+			if (cnt == IOV_CNT)
+				break;
+			iov[cnt].iov_base = c->data + c->off;
+			iov[cnt].iov_len = c->len - c->off;
+			cnt++;
+		}
+
+		if ((n = writev(WRITE_FD, iov, cnt)) == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				errno = 0;
+				return true;
+			}
+			return false;
+		}
+		outq_len -= n;
+		outq_written += n;
+
+		/* remove written chunks, the last one may be partial */
+		while ((c = TAILQ_FIRST(&outq)) != NULL && n > 0) {
+			size_t rest = c->len - c->off;
+
+			if ((size_t)n < rest) {
+				c->off += n;
+				break;
+			}
+			n -= rest;
+			TAILQ_REMOVE(&outq, c, next);
+			free(c);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Blocks until the whole queue is written.
+ */
+static bool
+outq_drain(void)
+{
+	struct pollfd pfd = {WRITE_FD, POLLOUT, 0};
+
+	for (;;) {
+		if (outq_flush() == false)
+			return false;
+		if (TAILQ_EMPTY(&outq))
+			return true;
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			return false;
+	}
 }
 
 static void
-send_tag(const char *tag)
+send_buf(const char *buf, size_t len)
 {
-	if (write(WRITE_FD, tag, strlen(tag)) < 0)
+	if (outq_push(buf, len) == false)
 		perror(__func__);
 	if (debug)
-		fprintf(stderr, "SENT: %s\n", tag);
+		fprintf(stderr, "SENT: %.*s\n", (int)len, buf);
+}
+
+static void
+send_tag(const char *tag)
+{
+	send_buf(tag, strlen(tag));
 }
 
 static void
@@ -208,7 +410,8 @@ start_sub_proccess(struct context *ctx)
 	snprintf(cmd, sizeof cmd, "exec presenced -d '%s'", ctx->dir);
 	if ((ctx->fh_pre = popen(cmd, "w")) == NULL) goto err;
 
-	snprintf(cmd, sizeof cmd, "exec iqd -d '%s'", ctx->dir);
+	snprintf(cmd, sizeof cmd, "exec iqd %s-u %s@%s -d '%s'",
+	    ctx->rosterver ? "-v " : "", ctx->user, ctx->server, ctx->dir);
 	if ((ctx->fh_iq = popen(cmd, "w")) == NULL) goto err;
 
 	return true;
@@ -217,6 +420,501 @@ start_sub_proccess(struct context *ctx)
 	return false;
 }
 
+static void
+ping_cb(struct ev_timer *t)
+{
+	struct context *ctx = t->data;
+
+	xmpp_ping(ctx);
+	if (ctx->pong.active == false)
+		ev_timer_add(ctx->ev, &ctx->pong, PING_TIMEOUT);
+	ev_timer_add(ctx->ev, &ctx->ping, PING_INTERVAL);
+}
+
+static void
+pong_cb(struct ev_timer *t)
+{
+	struct context *ctx = t->data;
+
+	warnx("no answer to keep alive ping");
+	ctx->quit = true;
+}
+
+/* The frontend daemons just report errors, if they die. */
+static void
+daemon_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+
+	if (revents & EV_ERROR) {
+		warnx("pipe to frontend daemon is widowed");
+		ctx->quit = true;
+	}
+}
+
+/*
+ * True if the tag at p, that the reader refused, stays malformed whatever
+ * follows: it has no name or a quote swallowed its closing '>'.  Other
+ * errors just mean, that the rest is not read yet.
+ */
+static bool
+tag_broken(const char *p)
+{
+	if (p[1] == '\0' || p[1] == '/' || p[1] == '!' || p[1] == '?')
+		return false;
+	if (strchr(" \t\r\n=>", p[1]) != NULL)
+		return true;
+
+	return strchr(p, '>') != NULL;
+}
+
+/*
+ * Queues the complete stanzas of the fifo buffer.  A malformed stanza is
+ * dropped up to the next tag, so it does not block the ones after it.
+ */
+static void
+fifo_split(void)
+{
+	struct stanza_reader r;
+	struct stanza_token t;
+	enum stanza_type type;
+	size_t end = 0;
+	size_t next;
+	char *p;
+
+	for (;;) {
+		stanza_reader_init(&r, fifo.buf + fifo.scan);
+		r.depth = fifo.depth;
+		while ((type = stanza_next(&r, &t)) != STANZA_EOF &&
+		    type != STANZA_ERROR) {
+			/* a stray end tag closes nothing */
+			if (r.depth < 0)
+				r.depth = 0;
+			fifo.scan = r.p - fifo.buf;
+			fifo.depth = r.depth;
+			if (r.depth == 0 && type != STANZA_TEXT)
+				end = fifo.scan;
+		}
+		if (type == STANZA_EOF || tag_broken(r.p) == false)
+			break;
+
+		warnx("fifo: malformed stanza dropped");
+		p = strchr(r.p + 1, '<');
+		next = p != NULL ? (size_t)(p - fifo.buf) : fifo.len;
+		memmove(fifo.buf + end, fifo.buf + next, fifo.len - next + 1);
+		fifo.len -= next - end;
+		fifo.scan = end;
+		fifo.depth = 0;
+	}
+
+	if (end > 0) {
+		send_buf(fifo.buf, end);
+		memmove(fifo.buf, fifo.buf + end, fifo.len - end + 1);
+		fifo.len -= end;
+		fifo.scan -= end;
+	}
+}
+
+/* drops the rest of a stanza, that will never be complete */
+static void
+fifo_reset(void)
+{
+	if (fifo.depth > 0 || fifo.scan < fifo.len)
+		warnx("fifo: incomplete stanza dropped");
+	fifo.len = fifo.scan = 0;
+	fifo.depth = 0;
+}
+
+static void
+fifo_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+	ssize_t n;
+
+	(void)revents;
+	for (;;) {
+		if (fifo.size - fifo.len < BUFSIZ) {
+			size_t size = fifo.size == 0 ? BUFSIZ * 2 :
+			    fifo.size * 2;
+			char *buf;
+
+			if ((buf = realloc(fifo.buf, size)) == NULL)
+				goto err;
+			fifo.buf = buf;
+			fifo.size = size;
+		}
+		if ((n = read(io->fd, fifo.buf + fifo.len,
+		    fifo.size - fifo.len - 1)) <= 0)
+			break;
+		fifo.len += n;
+		fifo.buf[fifo.len] = '\0';
+
+		fifo_split();
+		if (fifo.len > FIFO_MAX)
+			fifo_reset();
+
+		/* stop reading local stanzas above the high-water mark */
+		if (outq_len >= outq_max) {
+			ev_io_mod(ctx->ev, io, 0);
+			return;
+		}
+	}
+
+	if (n == 0) {	/* reopen input fifo on EOF */
+		fifo_reset();
+		ev_io_del(ctx->ev, io);
+		if (close(io->fd) == -1)
+			goto err;
+		if ((io->fd = open(ctx->file, O_RDONLY|O_NONBLOCK|O_CLOEXEC))
+		    == -1)
+			goto err;
+		if (ev_io_add(ctx->ev, io) == false)
+			goto err;
+	} else if (errno != EAGAIN) {
+		goto err;
+	}
+	return;
+ err:
+	perror(__func__);
+	ctx->quit = true;
+}
+
+static void
+free_client(struct client *c)
+{
+	struct context *ctx = c->ctx;
+
+	TAILQ_REMOVE(&ctx->clients, c, next);
+	ctx->nclients--;
+	ev_io_del(ctx->ev, &c->io);
+	close(c->io.fd);
+	free(c->buf);
+	free(c);
+}
+
+/*
+ * Reads ahead until a whole stanza and CLIENT_BUF bytes are buffered.  The
+ * stanzas are taken by serve_clients().
+ */
+static void
+client_cb(struct ev_io *io, int revents)
+{
+	struct client *c = io->data;
+	const char *data;
+	size_t size;
+	ssize_t n;
+
+	(void)revents;
+	for (;;) {
+		n = netstring_parse(c->buf + c->off, c->len - c->off,
+		    NETSTRING_MAX, &data, &size);
+		if (n == -1 || (n > 0 && c->len - c->off >= CLIENT_BUF))
+			break;
+
+		if (c->off > 0) {
+			memmove(c->buf, c->buf + c->off, c->len - c->off);
+			c->len -= c->off;
+			c->off = 0;
+		}
+		if (c->len == c->size) {
+			size_t size = c->size == 0 ? BUFSIZ : c->size * 2;
+			char *buf;
+
+			if ((buf = realloc(c->buf, size)) == NULL) goto err;
+			c->buf = buf;
+			c->size = size;
+		}
+
+		if ((n = read(io->fd, c->buf + c->len, c->size - c->len))
+		    == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				errno = 0;
+				return;
+			}
+			goto err;
+		}
+		if (n == 0) {
+			c->eof = true;
+			break;
+		}
+		c->len += n;
+	}
+
+	/* serve_clients() resumes reading */
+	if (ev_io_mod(c->ctx->ev, io, 0) == false) goto err;
+	return;
+ err:
+	warn("client");
+	errno = 0;
+	free_client(c);
+}
+
+/* true if buf is exactly one element, surrounded by white space at most */
+static bool
+whole_stanza(const char *buf)
+{
+	struct stanza_reader r;
+	struct stanza_token t;
+	enum stanza_type type;
+	bool done = false;
+
+	stanza_reader_init(&r, buf);
+	while ((type = stanza_next(&r, &t)) != STANZA_EOF) {
+		if (type == STANZA_ERROR || r.depth < 0)
+			return false;
+		if (type == STANZA_TEXT) {
+			if (r.depth == 0 && t.text.len > 0 &&
+			    strspn(t.text.ptr, " \t\r\n") < t.text.len)
+				return false;
+			continue;
+		}
+		if (done)
+			return false;
+		done = r.depth == 0;
+	}
+
+	return done;
+}
+
+/*
+ * Takes the next stanza of a client.  Returns 1 if it took one, 0 if
+ * there is none and -1 if the client is done or broken.
+ */
+static int
+client_stanza(struct client *c)
+{
+	const char *data;
+	size_t size;
+	ssize_t n;
+
+	if (c->sync)
+		return 0;
+
+	n = netstring_parse(c->buf + c->off, c->len - c->off, NETSTRING_MAX,
+	    &data, &size);
+	if (n == 0)
+		return c->eof ? -1 : 0;
+	if (n == -1) {
+		warnx("client: malformed netstring");
+		return -1;
+	}
+	c->off += n;
+
+	if (size == 0) {
+		c->sync = true;
+		c->sync_at = outq_pushed;
+		return 1;
+	}
+
+	/*
+	 * There is no way to resync on a broken stanza in the stream.  The
+	 * comma of the netstring is taken already, the reader needs a NUL.
+	 */
+	c->buf[c->off - 1] = '\0';
+	if (memchr(data, '\0', size) != NULL || whole_stanza(data) == false) {
+		warnx("client: not a stanza");
+		return -1;
+	}
+	send_buf(data, size);
+
+	return 1;
+}
+
+/*
+ * Takes one stanza of every client per round, until the output queue
+ * reaches its high-water mark.  The next call starts with the client
+ * after the last one served, so every client gets its turn.  Returns false,
+ * if no client has a stanza left.
+ */
+static bool
+serve_clients(struct context *ctx)
+{
+	struct client *c, *tmp;
+	bool more = true;
+
+	while (more && outq_len < outq_max) {
+		size_t n = ctx->nclients;
+
+		more = false;
+		for (size_t i = 0; i < n && outq_len < outq_max; i++) {
+			c = TAILQ_FIRST(&ctx->clients);
+			TAILQ_REMOVE(&ctx->clients, c, next);
+			TAILQ_INSERT_TAIL(&ctx->clients, c, next);
+
+			switch (client_stanza(c)) {
+			case -1:
+				free_client(c);
+				break;
+			case 1:
+				more = true;
+				break;
+			}
+		}
+	}
+
+	/* resume reading, when all buffered stanzas are taken */
+	for (c = TAILQ_FIRST(&ctx->clients); c != NULL; c = tmp) {
+		const char *data;
+		size_t size;
+
+		tmp = TAILQ_NEXT(c, next);
+		if (c->eof || c->io.events != 0 ||
+		    netstring_parse(c->buf + c->off, c->len - c->off,
+		    NETSTRING_MAX, &data, &size) != 0)
+			continue;
+		if (ev_io_mod(ctx->ev, &c->io, EV_READ) == false) {
+			warn("client");
+			free_client(c);
+		}
+	}
+
+	return more;
+}
+
+/* acknowledges syncs, whose stanzas are written to the server */
+static void
+ack_clients(struct context *ctx)
+{
+	struct client *c, *tmp;
+
+	for (c = TAILQ_FIRST(&ctx->clients); c != NULL; c = tmp) {
+		tmp = TAILQ_NEXT(c, next);
+		if (c->sync == false || outq_written < c->sync_at)
+			continue;
+		c->sync = false;
+
+		/*
+		 * A client with a full socket does not read its acks.  A
+		 * gone client must not kill sj by SIGPIPE, and tlsc(1) and
+		 * the daemons should not inherit an ignored SIGPIPE.
+		 */
+		if (send(c->io.fd, "0:,", 3, MSG_NOSIGNAL) != 3) {
+			if (errno != EPIPE)
+				warn("client");
+			errno = 0;
+			free_client(c);
+		}
+	}
+}
+
+static void
+accept_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+	struct client *c;
+	int fd;
+
+	(void)revents;
+	while ((fd = accept(io->fd, NULL, NULL)) != -1) {
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+		    (c = calloc(1, sizeof *c)) == NULL) {
+			warn("accept");
+			close(fd);
+			continue;
+		}
+		c->ctx = ctx;
+		c->io.fd = fd;
+		c->io.events = EV_READ;
+		c->io.cb = client_cb;
+		c->io.data = c;
+		if (ev_io_add(ctx->ev, &c->io) == false) {
+			warn("accept");
+			close(fd);
+			free(c);
+			continue;
+		}
+		TAILQ_INSERT_TAIL(&ctx->clients, c, next);
+		ctx->nclients++;
+	}
+	if (errno != EAGAIN && errno != EINTR)
+		warn("accept");
+	errno = 0;
+}
+
+/* listens on <dir>/sock for local programs */
+static bool
+listen_sock(struct context *ctx)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof sun.sun_path, "%s/" SOCK_FILE,
+	    ctx->dir) >= (int)sizeof sun.sun_path) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return false;
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		goto err;
+
+	/* a socket of a former run is in the way */
+	if (unlink(sun.sun_path) == -1 && errno != ENOENT) goto err;
+	if (bind(fd, (struct sockaddr *)&sun, sizeof sun) == -1) goto err;
+	if (listen(fd, SOMAXCONN) == -1) goto err;
+
+	ctx->io_sock.fd = fd;
+	ctx->io_sock.events = EV_READ;
+	ctx->io_sock.cb = accept_cb;
+	ctx->io_sock.data = ctx;
+	if (ev_io_add(ctx->ev, &ctx->io_sock) == false) goto err;
+	snprintf(ctx->sock, sizeof ctx->sock, "%s", sun.sun_path);
+
+	return true;
+ err:
+	close(fd);
+	return false;
+}
+
+static bool
+start_session(struct context *ctx)
+{
+	struct ev_io *io[] = {&ctx->io_msg, &ctx->io_pre, &ctx->io_iq};
+
+	/* before the daemons connect, the fifo works without it */
+	if (listen_sock(ctx) == false) {
+		warn("%s/%s", ctx->dir, SOCK_FILE);
+		errno = 0;
+	}
+
+	if (start_sub_proccess(ctx) == false)
+		return false;
+
+	FILE *fh[] = {ctx->fh_msg, ctx->fh_pre, ctx->fh_iq};
+
+	for (size_t i = 0; i < sizeof io / sizeof io[0]; i++) {
+		io[i]->fd = fileno(fh[i]);
+		io[i]->events = 0;
+		io[i]->cb = daemon_cb;
+		io[i]->data = ctx;
+		if (ev_io_add(ctx->ev, io[i]) == false) goto err;
+	}
+
+	ctx->io_in.fd = ctx->fd_in;
+	ctx->io_in.events = EV_READ;
+	ctx->io_in.cb = fifo_cb;
+	ctx->io_in.data = ctx;
+	if (ev_io_add(ctx->ev, &ctx->io_in) == false) goto err;
+
+	ctx->ping.cb = ping_cb;
+	ctx->ping.data = ctx;
+	ctx->pong.cb = pong_cb;
+	ctx->pong.data = ctx;
+	ev_timer_add(ctx->ev, &ctx->ping, PING_INTERVAL);
+
+	return true;
+ err:
+	perror(__func__);
+	return false;
+}
+
 static bool
 has_attr(mxml_node_t *node, const char *attr, const char *value)
 {
@@ -244,13 +942,12 @@ has_tag(mxml_node_t *node, const char *tag)
 }
 
 /*
- * This callback function is called from bxml-lib if a whole xml-tag from
- * the xmpp-server is recieved.
+ * Handles all tags before the XMPP session is established.  These are just
+ * a few, so we can afford mxml here.
  */
 static void
-server_tag(char *tag, void *data)
+handshake_tag(struct context *ctx, char *tag)
 {
-	struct context *ctx = data;
 	static mxml_node_t *node = NULL;
 	/* HACK: we need this, cause mxml can't parse tags by itself */
 	static mxml_node_t *tree = NULL;
@@ -269,6 +966,10 @@ server_tag(char *tag, void *data)
 
 	/* authentication and binding */
 	if (strcmp("stream:features", tag_name) == 0) {
+		/* XEP-0237 */
+		if (has_tag(node, "ver"))
+			ctx->rosterver = true;
+
 		if (has_tag(node, "starttls"))
 			send_tag("<starttls "
 			    "xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>");
@@ -286,6 +987,13 @@ server_tag(char *tag, void *data)
 		char *argv[argc0 + 1];
 		argv[0] = "tlsc";
 		memcpy(argv + 1, argv0, sizeof(argv) - 1);
+
+		/* tlsc expects the descriptors as we got them */
+		if (outq_drain() == false)
+			err(EXIT_FAILURE, "outq_drain");
+		fcntl(READ_FD, F_SETFL, read_flags);
+		fcntl(WRITE_FD, F_SETFL, write_flags);
+
 		execvp("tlsc", argv);
 		err(EXIT_FAILURE, "execvp tlsc");
 	}
@@ -311,45 +1019,71 @@ server_tag(char *tag, void *data)
 	if (ctx->state == BIND && strcmp("iq", tag_name) == 0 &&
 	    has_attr(node, "id", "sess_1") && has_attr(node, "type", "result")){
 		ctx->state = SESSION;
-		start_sub_proccess(ctx);
+		if (start_session(ctx) == false)
+			ctx->quit = true;
 		goto out;
 	}
 
 	/* handling error messages */
 	if (strcmp("failure", tag_name) == 0)
 		errx(EXIT_FAILURE, "%s", tag);
+ err:
+	if (errno != 0)
+		perror(__func__);
+ out:
+	mxmlDelete(node);
+}
 
-	/* send message tags to messaged process */
-	if (ctx->fh_msg != NULL && strcmp("message", tag_name) == 0) {
-		if (fputs(tag, ctx->fh_msg) == EOF) goto err;
-		if (fflush(ctx->fh_msg) == EOF) goto err;
-		goto out;
-	}
+/*
+ * This callback function is called from bxml-lib if a whole xml-tag from
+ * the xmpp-server is recieved.  After the session is established, we just
+ * look at the start tag to route the stanza to its daemon.
+ */
+static void
+server_tag(char *tag, void *data)
+{
+	struct context *ctx = data;
+	struct slice name;
+	struct slice id;
+	FILE *fh = NULL;
 
-	/* send presence tags to presenced process */
-	if (ctx->fh_pre != NULL && strcmp("presence", tag_name) == 0) {
-		if (fputs(tag, ctx->fh_pre) == EOF) goto err;
-		if (fflush(ctx->fh_pre) == EOF) goto err;
-		goto out;
+	if (ctx->state != SESSION) {
+		handshake_tag(ctx, tag);
+		return;
 	}
 
-	/* send iq tags to iq process */
-	if (strcmp("iq", tag_name) == 0) {
-		if (has_attr(node, "id", ctx->id) || ctx->fh_iq == NULL)
-			goto out;
+	if (stanza_name(tag, &name) == false)
+		return;
+
+	/* handling error messages */
+	if (slice_eq(&name, "failure"))
+		errx(EXIT_FAILURE, "%s", tag);
 
-		if (fputs(tag, ctx->fh_iq) == EOF) goto err;
-		if (fflush(ctx->fh_iq) == EOF) goto err;
+	if (slice_eq(&name, "message")) {
+		fh = ctx->fh_msg;	/* send message tags to messaged */
+	} else if (slice_eq(&name, "presence")) {
+		fh = ctx->fh_pre;	/* send presence tags to presenced */
+	} else if (slice_eq(&name, "iq")) {
+		/* drop answers of our own keep alive pings */
+		if (stanza_attr(tag, "id", &id) && slice_eq(&id, ctx->id)) {
+			ev_timer_del(ctx->ev, &ctx->pong);
+			return;
+		}
+		fh = ctx->fh_iq;	/* send iq tags to iqd */
 	}
+
+	if (fh == NULL)
+		return;
+
+	if (fputs(tag, fh) == EOF) goto err;
+	if (fflush(fh) == EOF) goto err;
+	return;
  err:
-	if (errno != 0)
-		perror(__func__);
- out:
-	mxmlDelete(node);
+	perror(__func__);
 }
 
 /*
- * Create front end fifo
+ * Create and open front end fifo
  */
 static void
 init_dir(struct context *ctx)
@@ -359,6 +1093,46 @@ init_dir(struct context *ctx)
 		err(EXIT_FAILURE, "mkdir");
 	if (mkfifo(ctx->file, S_IRUSR|S_IWUSR) == -1 && errno != EEXIST)
 		err(EXIT_FAILURE, "mkfifo");
+	if ((ctx->fd_in = open(ctx->file, O_RDONLY|O_NONBLOCK|O_CLOEXEC))
+	    == -1)
+		err(EXIT_FAILURE, "open");
+}
+
+static void
+read_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	(void)revents;
+	while ((n = read(io->fd, buf, sizeof buf)) > 0) {
+		if (debug) {
+			fprintf(stderr, "%s", "RECV: ");
+			fwrite(buf, sizeof(char), n, stderr);
+			fprintf(stderr, "%s", "\n");
+		}
+		bxml_add_buf(ctx->bxml, buf, n);
+	}
+
+	if (n == 0) {		/* connection closed */
+		ctx->quit = true;
+	} else if (errno != EAGAIN) {
+		perror(__func__);
+		ctx->quit = true;
+	}
+}
+
+static void
+write_cb(struct ev_io *io, int revents)
+{
+	struct context *ctx = io->data;
+
+	(void)revents;
+	if (outq_flush() == false) {
+		perror(__func__);
+		ctx->quit = true;
+	}
 }
 
 static void
@@ -370,6 +1144,7 @@ usage(void)
 		"\t-s <server>\n"
 		"\t-r <resource>\n"
 		"\t-d <directory>\n"
+		"\t-w <high-water mark of the output queue>\n"
 		"\t-D \n");
 	exit(EXIT_FAILURE);
 }
@@ -384,9 +1159,11 @@ int
 main(int argc, char *argv[])
 {
 	int ch;
+	bool more;
 
 	/* struct with all context informations */
 	struct context ctx = NULL_CONTEXT;
+	TAILQ_INIT(&ctx.clients);
 	asprintf(&ctx.id, "sj-%d", getpid());
 	ctx.state = OPEN;	/* set inital state of the connection */
 
@@ -398,7 +1175,7 @@ main(int argc, char *argv[])
 	argv0 = argv;
 	argc0 = argc;
 
-	while ((ch = getopt(argc, argv, "d:s:u:r:D")) != -1) {
+	while ((ch = getopt(argc, argv, "d:s:u:r:w:D")) != -1) {
 		switch (ch) {
 		case 'D':
 			debug = true;
@@ -415,6 +1192,12 @@ main(int argc, char *argv[])
 		case 'r':
 			ctx.resource = optarg;
 			break;
+		case 'w':
+			errno = 0;
+			outq_max = strtoul(optarg, NULL, 0);
+			if (errno != 0 || outq_max == 0)
+				usage();
+			break;
 		default:
 			usage();
 			/* NOTREACHED */
@@ -436,62 +1219,66 @@ main(int argc, char *argv[])
 	ctx.bxml = bxml_ctx_init(server_tag, &ctx);
 	ctx.bxml->block_depth = 1;
 
+	/* never block in reads from or writes to the server */
+	if ((read_flags = fcntl(READ_FD, F_GETFL)) == -1 ||
+	    (write_flags = fcntl(WRITE_FD, F_GETFL)) == -1 ||
+	    fcntl(READ_FD, F_SETFL, read_flags | O_NONBLOCK) == -1 ||
+	    fcntl(WRITE_FD, F_SETFL, write_flags | O_NONBLOCK) == -1)
+		err(EXIT_FAILURE, "fcntl");
+
+	if ((ctx.ev = ev_init()) == NULL)
+		err(EXIT_FAILURE, "ev_init");
+
+	ctx.io_read.fd = READ_FD;
+	ctx.io_read.events = EV_READ;
+	ctx.io_read.cb = read_cb;
+	ctx.io_read.data = &ctx;
+	ctx.io_write.fd = WRITE_FD;
+	ctx.io_write.events = 0;
+	ctx.io_write.cb = write_cb;
+	ctx.io_write.data = &ctx;
+	if (ev_io_add(ctx.ev, &ctx.io_read) == false ||
+	    ev_io_add(ctx.ev, &ctx.io_write) == false)
+		err(EXIT_FAILURE, "ev_io_add");
+
 	init_dir(&ctx);
 	xmpp_init(&ctx);
 
 	signal(SIGHUP, sig_handler);
 
-	for (;;) {
-		char buf[BUFSIZ];
-		ssize_t n = 0;
-		struct timeval tv = {30, 0}; /* interval for keep alive pings */
-		fd_set readfds;
-
-		FD_ZERO(&readfds);
-		FD_SET(READ_FD, &readfds);
-		int max_fd = READ_FD;
-
-		/* re/open input fifo */
-		if (ctx.fd_in == -1 && (ctx.fd_in =
-		    open(ctx.file, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) == -1)
+	while (ctx.quit == false) {
+		/*
+		 * Write out everything that queued up in the last round.
+		 * Buffered stanzas of clients trigger no event, so serve
+		 * them until the connection blocks.
+		 */
+		do {
+			more = serve_clients(&ctx);
+			if (outq_flush() == false) goto err;
+		} while (more && TAILQ_EMPTY(&outq));
+		ack_clients(&ctx);
+		if (ev_io_mod(ctx.ev, &ctx.io_write,
+		    TAILQ_EMPTY(&outq) ? 0 : EV_WRITE) == false)
 			goto err;
 
-		if (ctx.state == SESSION) {
-			FD_SET(ctx.fd_in, &readfds);
-			max_fd = MAX(max_fd, ctx.fd_in);
-		}
+		/* resume reading the input fifo below the high-water mark */
+		if (ctx.state == SESSION && ctx.io_in.events == 0 &&
+		    outq_len < outq_max &&
+		    ev_io_mod(ctx.ev, &ctx.io_in, EV_READ) == false)
+			goto err;
 
 		errno = 0;
-		int sel = select(max_fd+1, &readfds, NULL, NULL, &tv);
-		if (sel == -1) goto err;
-
-		if (FD_ISSET(READ_FD, &readfds)) { /* data from xmpp server */
-			if ((n = read(READ_FD, buf, sizeof buf)) < 0) goto err;
-			if (n == 0) break;	/* connection closed */
-			if (debug) {
-				fprintf(stderr, "%s", "RECV: ");
-				fwrite(buf, sizeof(char), n, stderr);
-				fprintf(stderr, "%s", "\n");
-			}
-			bxml_add_buf(ctx.bxml, buf, n);
-		} else if (FD_ISSET(ctx.fd_in, &readfds)) {
-			while ((n = read(ctx.fd_in, buf, sizeof(buf) - 1)) > 0){
-				buf[n] = '\0';
-				send_tag(buf);
-			}
-
-			if (n == 0) {	/* close input fifo on EOF */
-				if (close(ctx.fd_in) == -1)
-					goto err;
-				ctx.fd_in = -1;
-			} else if (n == -1 && errno != EAGAIN) {
-					goto err;
-			}
-		} else if (sel == 0 && ctx.state == SESSION) {
-			xmpp_ping(&ctx);
-		}
+		if (ev_dispatch(ctx.ev) == -1) goto err;
 	}
+	outq_flush();
+	errno = 0;
  err:
+	while (!TAILQ_EMPTY(&ctx.clients))
+		free_client(TAILQ_FIRST(&ctx.clients));
+	free(fifo.buf);
+	if (ctx.sock[0] != '\0')
+		unlink(ctx.sock);
+
 	/* close messaged, pressenced and iqd */
 	if (ctx.fh_msg != NULL) pclose(ctx.fh_msg);
 	if (ctx.fh_pre != NULL) pclose(ctx.fh_pre);
@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ev.h"
+#include "netstring.h"
+#include "sjin.h"
+
+#define SJIN_RETRY	1000		/* msec between reopens */
+#define SJIN_MAX	(256 * 1024)	/* buffer limit while sj is gone */
+#define SJIN_SOCK	"sock"		/* socket of sj next to the fifo */
+#define SJIN_IOV	64		/* stanzas per writev(2) */
+
+static void sjin_open(struct sjin *in);
+
+static void
+retry_cb(struct ev_timer *t)
+{
+	sjin_open(t->data);
+}
+
+static void
+write_cb(struct ev_io *io, int revents)
+{
+	(void)revents;
+	sjin_flush(io->data);
+}
+
+static void
+disconnect(struct sjin *in)
+{
+	/* the rest of a partly written stanza breaks the next stream */
+	if (in->partial) {
+		size_t k;
+
+		for (k = 0; k < in->nends && in->ends[k] < in->off; k++)
+			;
+		if (k < in->nends)
+			in->off = in->ends[k];
+		in->partial = false;
+	}
+	in->frame = 0;
+
+	if (in->fd != -1) {
+		ev_io_del(in->ev, &in->io);
+		close(in->fd);
+		in->fd = in->io.fd = -1;
+	}
+	ev_timer_add(in->ev, &in->retry, SJIN_RETRY);
+}
+
+static int
+sock_open(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof sun.sun_path, "%s", path) >=
+	    (int)sizeof sun.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+	    connect(fd, (struct sockaddr *)&sun, sizeof sun) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Prefers the socket of sj and falls back to the fifo.  ENXIO just means
+ * that sj has not opened its end of the fifo yet.
+ */
+static void
+sjin_open(struct sjin *in)
+{
+	int fd;
+
+	if ((fd = sock_open(in->sock)) != -1) {
+		in->stream = true;
+	} else if ((fd = open(in->path,
+	    O_WRONLY|O_APPEND|O_NONBLOCK|O_CLOEXEC)) != -1) {
+		in->stream = false;
+	} else {
+		if (errno != ENXIO && errno != ENOENT)
+			perror(in->path);
+		errno = 0;
+		disconnect(in);
+		return;
+	}
+
+	in->fd = in->io.fd = fd;
+	in->io.events = 0;
+	if (ev_io_add(in->ev, &in->io) == false) {
+		perror(__func__);
+		close(fd);
+		in->fd = in->io.fd = -1;
+		disconnect(in);
+		return;
+	}
+
+	sjin_flush(in);
+}
+
+bool
+sjin_init(struct sjin *in, struct ev_loop *ev, const char *path)
+{
+	const char *slash;
+	int len;
+
+	memset(in, 0, sizeof *in);
+	in->fd = in->io.fd = -1;
+	in->ev = ev;
+	in->io.cb = write_cb;
+	in->io.data = in;
+	in->retry.cb = retry_cb;
+	in->retry.data = in;
+
+	if ((in->path = strdup(path)) == NULL)
+		return false;
+	if ((slash = strrchr(path, '/')) == NULL)
+		len = asprintf(&in->sock, "%s", SJIN_SOCK);
+	else
+		len = asprintf(&in->sock, "%.*s/%s", (int)(slash - path),
+		    path, SJIN_SOCK);
+	if (len == -1) {
+		free(in->path);
+		in->path = NULL;
+		return false;
+	}
+
+	sjin_open(in);
+	return true;
+}
+
+static bool
+grow(struct sjin *in, size_t len)
+{
+	void *p;
+
+	/* make room at the front first, ends of written stanzas are gone */
+	if (in->off > 0 && (in->len + len > in->size ||
+	    in->nends == in->sends)) {
+		size_t i, k;
+
+		for (k = 0; k < in->nends && in->ends[k] <= in->off; k++)
+			;
+		for (i = k; i < in->nends; i++)
+			in->ends[i - k] = in->ends[i] - in->off;
+		in->nends -= k;
+		memmove(in->buf, in->buf + in->off, in->len - in->off);
+		in->len -= in->off;
+		in->off = 0;
+	}
+
+	if (in->len + len > in->size) {
+		size_t size = in->size == 0 ? BUFSIZ : in->size;
+
+		while (size < in->len + len)
+			size *= 2;
+		if ((p = realloc(in->buf, size)) == NULL)
+			return false;
+		in->buf = p;
+		in->size = size;
+	}
+
+	if (in->nends == in->sends) {
+		size_t sends = in->sends == 0 ? 64 : in->sends * 2;
+
+		if ((p = realloc(in->ends, sends * sizeof *in->ends)) == NULL)
+			return false;
+		in->ends = p;
+		in->sends = sends;
+	}
+
+	return true;
+}
+
+/* true if callers should stop producing until the next flush */
+bool
+sjin_full(const struct sjin *in)
+{
+	return in->len - in->off >= SJIN_MAX / 2;
+}
+
+/* queues one whole stanza, the last one may go beyond SJIN_MAX */
+bool
+sjin_write(struct sjin *in, const char *stanza, size_t len)
+{
+	if (in->len - in->off >= SJIN_MAX) {
+		errno = ENOBUFS;
+		return false;
+	}
+
+	if (grow(in, len) == false)
+		return false;
+
+	memcpy(in->buf + in->len, stanza, len);
+	in->len += len;
+	in->ends[in->nends++] = in->len;
+
+	return true;
+}
+
+bool
+sjin_printf(struct sjin *in, const char *fmt, ...)
+{
+	va_list ap;
+	char *stanza;
+	int len;
+	bool ret;
+
+	va_start(ap, fmt);
+	len = vasprintf(&stanza, fmt, ap);
+	va_end(ap);
+	if (len == -1)
+		return false;
+
+	ret = sjin_write(in, stanza, len);
+	free(stanza);
+
+	return ret;
+}
+
+/* false if the connection takes no more data or is gone */
+static bool
+flush_error(struct sjin *in)
+{
+	if (errno == EAGAIN) {
+		errno = 0;
+		ev_io_mod(in->ev, &in->io, EV_WRITE);
+		return false;
+	}
+	if (errno != EPIPE && errno != ECONNRESET)
+		perror(__func__);
+	errno = 0;
+	disconnect(in);
+	return false;
+}
+
+/*
+ * Writes as many whole stanzas as fit into PIPE_BUF at once.  A stanza
+ * that is larger than PIPE_BUF is written alone.
+ */
+static bool
+flush_fifo(struct sjin *in)
+{
+	size_t e = 0;
+
+	while (in->off < in->len) {
+		size_t end;
+		ssize_t n;
+
+		while (e < in->nends && in->ends[e] <= in->off)
+			e++;
+		end = in->ends[e];
+		while (e + 1 < in->nends && in->ends[e + 1] - in->off <=
+		    PIPE_BUF)
+			end = in->ends[++e];
+
+		if ((n = write(in->fd, in->buf + in->off, end - in->off))
+		    == -1)
+			return flush_error(in);
+		in->off += n;
+
+		/* a short write may end inside of a stanza */
+		if (in->off < end) {
+			size_t k;
+
+			for (k = 0; k < in->nends && in->ends[k] < in->off;
+			    k++)
+				;
+			in->partial = in->ends[k] != in->off;
+		} else {
+			in->partial = false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Writes the stanzas as netstrings to the socket, SJIN_IOV at once.
+ * in->off is always at the start of a stanza and in->frame bytes of its
+ * netstring are already written.
+ */
+static bool
+flush_stream(struct sjin *in)
+{
+	char heads[SJIN_IOV][NETSTRING_HEAD];
+	size_t sizes[SJIN_IOV];
+	struct iovec iov[SJIN_IOV * 3];
+	size_t e = 0;
+
+	while (in->off < in->len) {
+		size_t start = in->off;
+		size_t skip = in->frame;
+		size_t k, cnt = 0;
+		ssize_t n;
+
+		while (in->ends[e] <= in->off)
+			e++;
+		for (k = 0; e + k < in->nends && k < SJIN_IOV; k++) {
+			size_t len = in->ends[e + k] - start;
+			int hlen = netstring_head(heads[k], len);
+
+			iov[cnt].iov_base = heads[k];
+			iov[cnt++].iov_len = hlen;
+			iov[cnt].iov_base = in->buf + start;
+			iov[cnt++].iov_len = len;
+			iov[cnt].iov_base = (void *)",";
+			iov[cnt++].iov_len = 1;
+			sizes[k] = hlen + len + 1;
+			start = in->ends[e + k];
+		}
+
+		/* skip the part of the first netstring, that is written */
+		for (size_t i = 0; skip > 0; i++) {
+			size_t l = iov[i].iov_len;
+
+			if (l > skip)
+				l = skip;
+			iov[i].iov_base = (char *)iov[i].iov_base + l;
+			iov[i].iov_len -= l;
+			skip -= l;
+		}
+
+		if ((n = writev(in->fd, iov, cnt)) == -1)
+			return flush_error(in);
+
+		/* move over the complete netstrings */
+		in->frame += n;
+		for (size_t i = 0; i < k && in->frame >= sizes[i]; i++) {
+			in->frame -= sizes[i];
+			in->off = in->ends[e + i];
+		}
+	}
+
+	return true;
+}
+
+void
+sjin_flush(struct sjin *in)
+{
+	if (in->fd == -1)
+		return;
+
+	if ((in->stream ? flush_stream(in) : flush_fifo(in)) == false)
+		return;
+
+	in->off = in->len = in->nends = 0;
+	ev_io_mod(in->ev, &in->io, 0);
+}
+
+/* writes the rest blocking and closes the connection */
+void
+sjin_close(struct sjin *in)
+{
+	if (in->fd != -1 && in->off < in->len) {
+		int flags = fcntl(in->fd, F_GETFL);
+
+		if (flags != -1)
+			fcntl(in->fd, F_SETFL, flags & ~O_NONBLOCK);
+		sjin_flush(in);
+	}
+
+	if (in->fd != -1) {
+		ev_io_del(in->ev, &in->io);
+		close(in->fd);
+	}
+	ev_timer_del(in->ev, &in->retry);
+	free(in->path);
+	free(in->sock);
+	free(in->buf);
+	free(in->ends);
+	memset(in, 0, sizeof *in);
+	in->fd = -1;
+}
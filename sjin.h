@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SJIN_H
+#define SJIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ev.h"
+
+/*
+ * Long-lived writer for the input of sj.  Stanzas are collected in a
+ * buffer and written once per loop iteration.  If the socket sock next to
+ * the fifo accepts connections, every stanza is sent as a netstring.
+ * Otherwise every write to the fifo is at most PIPE_BUF bytes and ends at
+ * a stanza boundary, so stanzas of different writers never interleave.  If
+ * sj is not there, the stanzas are kept and the connection is reopened by
+ * a timer.
+ */
+struct sjin {
+	char *path;
+	char *sock;
+	int fd;
+	bool stream;		/* connected to the socket */
+	bool partial;		/* a stanza is partly written to the fifo */
+	size_t frame;		/* written bytes of the current netstring */
+	struct ev_loop *ev;
+	struct ev_io io;	/* waits for space in the fifo */
+	struct ev_timer retry;	/* reopens the fifo */
+
+	char *buf;
+	size_t off;		/* start of unwritten data */
+	size_t len;
+	size_t size;
+
+	size_t *ends;		/* end offsets of the buffered stanzas */
+	size_t nends;
+	size_t sends;
+};
+
+bool sjin_init(struct sjin *in, struct ev_loop *ev, const char *path);
+bool sjin_full(const struct sjin *in);
+bool sjin_write(struct sjin *in, const char *stanza, size_t len);
+bool sjin_printf(struct sjin *in, const char *fmt, ...);
+void sjin_flush(struct sjin *in);
+void sjin_close(struct sjin *in);
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iqc.h"
+#include "stanza.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: sjq [-d dir] [-t sec] [stanza ...]\n");
+	exit(EXIT_FAILURE);
+}
+
+static bool
+send_line(struct iqc *c, char *line)
+{
+	line[strcspn(line, "\n")] = '\0';
+	if (line[0] == '\0')
+		return false;
+	if (iqc_send(c, line, strlen(line)) == false)
+		err(EXIT_FAILURE, "send");
+
+	return true;
+}
+
+/* prints the next result, false if none arrives within msec */
+static bool
+recv_result(struct iqc *c, int msec, int *ret)
+{
+	struct slice type;
+	char *result;
+
+	if ((result = iqc_recv(c, msec)) == NULL)
+		return false;
+	if (stanza_attr(result, "type", &type) == false ||
+	    slice_eq(&type, "result") == false)
+		*ret = EXIT_FAILURE;
+	puts(result);
+	free(result);
+
+	return true;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct iqc c;
+	char *dir = getenv("SJ_DIR");
+	char *line = NULL;
+	size_t size = 0;
+	size_t n = 0;
+	long timeout = IQC_TIMEOUT;
+	time_t end;
+	int ret = EXIT_SUCCESS;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "d:t:h")) != -1) {
+		switch (ch) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			errno = 0;
+			timeout = strtol(optarg, NULL, 10);
+			if (errno != 0 || timeout < 1 || timeout > 86400)
+				usage();
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (dir == NULL)
+		dir = ".";
+
+	if (iqc_open(&c, dir) == false)
+		err(EXIT_FAILURE, "%s/%s", dir, IQC_SOCK);
+
+	/*
+	 * Send all requests at once, they are answered in any order.  The
+	 * results, that are there already, are printed in between.
+	 */
+	for (int i = 0; argc == 0 || i < argc; i++) {
+		if (argc == 0 && getline(&line, &size, stdin) == -1)
+			break;
+		if (send_line(&c, argc > 0 ? argv[i] : line) == false)
+			continue;
+		for (n++; n > 0 && recv_result(&c, 0, &ret); n--)
+			;
+	}
+	free(line);
+
+	end = time(NULL) + timeout;
+	for (; n > 0; n--) {
+		long left = end - time(NULL);
+
+		if (recv_result(&c, left > 0 ? left * 1000 : 0, &ret) ==
+		    false) {
+			warn("receive");
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	iqc_close(&c);
+
+	return ret;
+}
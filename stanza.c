@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * DOM free parser for single stanzas.  All functions work in place on the
+ * buffer of the caller and return borrowed slices of it.  stanza_name() and
+ * stanza_attr() just look at the bytes up to the first '>' of an element, so
+ * their costs depend on the size of the header and not on the size of the
+ * whole stanza.  Nothing in here allocates memory.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#	include <immintrin.h>
+#elif defined(__SSE2__)
+#	include <emmintrin.h>
+#endif
+
+#include "stanza.h"
+
+#define ISSPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+static const char *
+skip_space(const char *p)
+{
+	while (ISSPACE(*p))
+		p++;
+	return p;
+}
+
+/* returns the end of a name token */
+static const char *
+skip_name(const char *p)
+{
+	while (*p != '\0' && !ISSPACE(*p) && *p != '=' && *p != '/' &&
+	    *p != '>')
+		p++;
+	return p;
+}
+
+/*
+ * Decodes one character or entity at *p and writes its UTF-8 representation
+ * into out.  Unknown entities are passed through.
+ */
+static size_t
+decode(const char **p, const char *end, char out[4])
+{
+	const char *s = *p;
+	const char *semi;
+	unsigned long cp;
+	char *ep;
+
+	if (*s != '&') {
+		out[0] = *s;
+		*p = s + 1;
+		return 1;
+	}
+
+	for (semi = s + 1; semi < end && semi - s < 12 && *semi != ';'; semi++)
+		;
+	if (semi >= end || *semi != ';')
+		goto literal;
+
+	*p = semi + 1;
+	switch (semi - s) {
+	case 3:
+		if (strncmp(s, "&lt;", 4) == 0) { out[0] = '<'; return 1; }
+		if (strncmp(s, "&gt;", 4) == 0) { out[0] = '>'; return 1; }
+		break;
+	case 4:
+		if (strncmp(s, "&amp;", 5) == 0) { out[0] = '&'; return 1; }
+		break;
+	case 5:
+		if (strncmp(s, "&apos;", 6) == 0) { out[0] = '\''; return 1; }
+		if (strncmp(s, "&quot;", 6) == 0) { out[0] = '"'; return 1; }
+		break;
+	}
+
+	if (s[1] != '#')
+		goto literal;
+	if (s[2] == 'x')
+		cp = strtoul(s + 3, &ep, 16);
+	else
+		cp = strtoul(s + 2, &ep, 10);
+	if (ep != semi || cp == 0 || cp > 0x10FFFF)
+		goto literal;
+
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = 0xC0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3F);
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = 0xE0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3F);
+		out[2] = 0x80 | (cp & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3F);
+	out[2] = 0x80 | ((cp >> 6) & 0x3F);
+	out[3] = 0x80 | (cp & 0x3F);
+	return 4;
+ literal:
+	out[0] = '&';
+	*p = s + 1;
+	return 1;
+}
+
+/*
+ * Decodes len bytes of src into dst.  The result is never longer than the
+ * input, so dst may be equal to src.
+ */
+size_t
+stanza_unescape(const char *src, size_t len, char *dst)
+{
+	const char *end = src + len;
+	size_t n = 0;
+
+	while (src < end) {
+		char ch[4];
+		size_t i, size = decode(&src, end, ch);
+
+		for (i = 0; i < size; i++)
+			dst[n++] = ch[i];
+	}
+
+	return n;
+}
+
+/* returns the number of bytes at p that need no escaping */
+static size_t
+safe_run(const char *p, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	const __m256i lt = _mm256_set1_epi8('<');
+	const __m256i gt = _mm256_set1_epi8('>');
+	const __m256i amp = _mm256_set1_epi8('&');
+	const __m256i apos = _mm256_set1_epi8('\'');
+	const __m256i quot = _mm256_set1_epi8('"');
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i m = _mm256_or_si256(
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, lt),
+			_mm256_cmpeq_epi8(v, gt)),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, amp),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, apos),
+			    _mm256_cmpeq_epi8(v, quot))));
+		unsigned int mask = _mm256_movemask_epi8(m);
+
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__SSE2__)
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i apos = _mm_set1_epi8('\'');
+	const __m128i quot = _mm_set1_epi8('"');
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i m = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, amp),
+			_mm_or_si128(_mm_cmpeq_epi8(v, apos),
+			    _mm_cmpeq_epi8(v, quot))));
+		unsigned int mask = _mm_movemask_epi8(m);
+
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < len; i++)
+		if (p[i] == '<' || p[i] == '>' || p[i] == '&' ||
+		    p[i] == '\'' || p[i] == '"')
+			break;
+
+	return i;
+}
+
+/*
+ * Escapes len bytes of src for use in text and quoted attributes of XML.
+ * Runs of bytes without special characters are copied at once.  dst gets
+ * null terminated and entities are never cut.  Returns the length of the
+ * whole result like strlcpy(3), STANZA_ESCAPE_SIZE(len) is always enough.
+ */
+size_t
+stanza_escape(const char *src, size_t len, char *dst, size_t size)
+{
+	size_t i = 0, n = 0, w = 0;
+	bool full = size == 0;
+
+	while (i < len) {
+		size_t run = safe_run(src + i, len - i);
+		const char *ent = NULL;
+		size_t elen = 0;
+
+		if (full == false) {
+			size_t cp = run;
+
+			if (w + cp >= size) {
+				cp = size - 1 - w;
+				full = true;
+			}
+			memcpy(dst + w, src + i, cp);
+			w += cp;
+		}
+		n += run;
+		if ((i += run) == len)
+			break;
+
+		switch (src[i++]) {
+		case '<':  ent = "&lt;";   elen = 4; break;
+		case '>':  ent = "&gt;";   elen = 4; break;
+		case '&':  ent = "&amp;";  elen = 5; break;
+		case '\'': ent = "&apos;"; elen = 6; break;
+		case '"':  ent = "&quot;"; elen = 6; break;
+		}
+
+		if (full == false && w + elen < size) {
+			memcpy(dst + w, ent, elen);
+			w += elen;
+		} else {
+			full = true;
+		}
+		n += elen;
+	}
+
+	if (size > 0)
+		dst[w] = '\0';
+
+	return n;
+}
+
+/*
+ * Copies len bytes of the stanza src to dst without line breaks, so it
+ * fits into one line.  Breaks inside of tags become spaces and breaks in
+ * text become character references, which keeps the content.  dst needs
+ * STANZA_FLATTEN_SIZE(len) bytes and gets null terminated.
+ */
+size_t
+stanza_flatten(const char *src, size_t len, char *dst)
+{
+	bool tag = false;
+	char quote = '\0';
+	size_t w = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		char c = src[i];
+
+		if (quote != '\0') {
+			if (c == quote)
+				quote = '\0';
+		} else if (tag && (c == '\'' || c == '"')) {
+			quote = c;
+		} else if (c == '<') {
+			tag = true;
+		} else if (c == '>') {
+			tag = false;
+		}
+
+		if (c != '\n' && c != '\r') {
+			dst[w++] = c;
+		} else if (tag) {
+			dst[w++] = ' ';
+		} else {
+			memcpy(dst + w, c == '\n' ? "&#10;" : "&#13;", 5);
+			w += 5;
+		}
+	}
+	dst[w] = '\0';
+
+	return w;
+}
+
+bool
+slice_eq(const struct slice *s, const char *str)
+{
+	if (s == NULL || s->ptr == NULL || str == NULL)
+		return false;
+
+	return strncmp(s->ptr, str, s->len) == 0 && str[s->len] == '\0';
+}
+
+bool
+stanza_name(const char *elem, struct slice *name)
+{
+	const char *p;
+
+	if (elem == NULL || name == NULL)
+		return false;
+
+	p = skip_space(elem);
+	if (*p++ != '<')
+		return false;
+
+	name->ptr = p;
+	p = skip_name(p);
+	name->len = p - name->ptr;
+
+	return name->len > 0;
+}
+
+bool
+stanza_attr(const char *elem, const char *attr, struct slice *value)
+{
+	struct slice name;
+	const char *p;
+	char quote;
+
+	if (attr == NULL || value == NULL)
+		return false;
+
+	if (stanza_name(elem, &name) == false)
+		return false;
+
+	for (p = name.ptr + name.len;;) {
+		struct slice key;
+
+		p = skip_space(p);
+		if (*p == '\0' || *p == '/' || *p == '>')
+			return false;
+
+		key.ptr = p;
+		p = skip_name(p);
+		key.len = p - key.ptr;
+		if (key.len == 0)
+			return false;
+
+		p = skip_space(p);
+		if (*p++ != '=')
+			return false;
+		p = skip_space(p);
+
+		if ((quote = *p++) != '\'' && quote != '"')
+			return false;
+
+		value->ptr = p;
+		while (*p != '\0' && *p != quote)
+			p++;
+		if (*p == '\0')
+			return false;
+		value->len = p++ - value->ptr;
+
+		if (slice_eq(&key, attr))
+			return true;
+	}
+}
+
+bool
+stanza_attr_copy(const char *elem, const char *attr, char *buf, size_t size)
+{
+	struct slice value;
+	size_t len;
+
+	if (buf == NULL || size == 0)
+		return false;
+
+	if (stanza_attr(elem, attr, &value) == false || value.len >= size)
+		return false;
+
+	len = stanza_unescape(value.ptr, value.len, buf);
+	buf[len] = '\0';
+
+	return true;
+}
+
+void
+stanza_reader_init(struct stanza_reader *r, const char *buf)
+{
+	r->p = buf;
+	r->depth = 0;
+}
+
+enum stanza_type
+stanza_next(struct stanza_reader *r, struct stanza_token *t)
+{
+	const char *p = r->p;
+	char quote = '\0';
+
+	memset(t, 0, sizeof *t);
+ again:
+	if (*p == '\0') {
+		t->type = STANZA_EOF;
+		goto out;
+	}
+
+	if (*p != '<') {
+		t->type = STANZA_TEXT;
+		t->text.ptr = p;
+		while (*p != '\0' && *p != '<')
+			p++;
+		t->text.len = p - t->text.ptr;
+		goto out;
+	}
+
+	/* skip comments, processing instructions and declarations */
+	if (strncmp(p, "<!--", 4) == 0) {
+		if ((p = strstr(p + 4, "-->")) == NULL) goto err;
+		p += 3;
+		goto again;
+	}
+
+	if (strncmp(p, "<![CDATA[", 9) == 0) {
+		t->type = STANZA_TEXT;
+		t->cdata = true;
+		t->text.ptr = p + 9;
+		if ((p = strstr(t->text.ptr, "]]>")) == NULL) goto err;
+		t->text.len = p - t->text.ptr;
+		p += 3;
+		goto out;
+	}
+
+	if (p[1] == '?' || p[1] == '!') {
+		if ((p = strchr(p, '>')) == NULL) goto err;
+		p++;
+		goto again;
+	}
+
+	t->elem = p;
+
+	if (p[1] == '/') {
+		t->type = STANZA_END;
+		t->name.ptr = p + 2;
+		p = skip_name(t->name.ptr);
+		t->name.len = p - t->name.ptr;
+		if ((p = strchr(p, '>')) == NULL) goto err;
+		p++;
+		r->depth--;
+		goto out;
+	}
+
+	t->type = STANZA_START;
+	t->name.ptr = p + 1;
+	p = skip_name(t->name.ptr);
+	if ((t->name.len = p - t->name.ptr) == 0) goto err;
+
+	/* skip attributes */
+	for (; *p != '\0'; p++) {
+		if (quote != '\0') {
+			if (*p == quote)
+				quote = '\0';
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+		} else if (*p == '>') {
+			break;
+		}
+	}
+	if (*p != '>') goto err;
+
+	if ((t->empty = p[-1] == '/') == false)
+		r->depth++;
+	p++;
+ out:
+	r->p = p;
+	return t->type;
+ err:
+	t->type = STANZA_ERROR;
+	return t->type;
+}
+
+/*
+ * Returns the first direct child of elem with the given name.  If name is
+ * NULL, any element matches.
+ */
+const char *
+stanza_child(const char *elem, const char *name)
+{
+	struct stanza_reader r;
+	struct stanza_token t;
+
+	stanza_reader_init(&r, elem);
+	if (stanza_next(&r, &t) != STANZA_START || t.empty)
+		return NULL;
+
+	while (r.depth > 0) {
+		int depth = r.depth;
+
+		switch (stanza_next(&r, &t)) {
+		case STANZA_START:
+			if (depth == 1 && (name == NULL ||
+			    slice_eq(&t.name, name)))
+				return t.elem;
+			break;
+		case STANZA_END:
+		case STANZA_TEXT:
+			break;
+		default:
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Copies the decoded text content of elem into buf.  Like mxml does, runs
+ * of white space are collapsed into a single space, so the text always fits
+ * into one line.  Returns the length of the whole text like strlcpy(3), so
+ * the caller is able to detect truncation.
+ */
+size_t
+stanza_text(const char *elem, char *buf, size_t size)
+{
+	struct stanza_reader r;
+	struct stanza_token t;
+	bool space = false;
+	size_t len = 0;
+
+	stanza_reader_init(&r, elem);
+	if (stanza_next(&r, &t) != STANZA_START || t.empty)
+		goto out;
+
+	while (r.depth > 0) {
+		enum stanza_type type = stanza_next(&r, &t);
+		const char *p, *end;
+
+		if (type == STANZA_EOF || type == STANZA_ERROR)
+			break;
+		if (type != STANZA_TEXT)
+			continue;
+
+		for (p = t.text.ptr, end = p + t.text.len; p < end;) {
+			char ch[4];
+			size_t i, n;
+
+			if (t.cdata) {
+				ch[0] = *p++;
+				n = 1;
+			} else {
+				n = decode(&p, end, ch);
+			}
+
+			for (i = 0; i < n; i++) {
+				if (ISSPACE(ch[i])) {
+					space = true;
+					continue;
+				}
+				if (space) {
+					if (len + 1 < size)
+						buf[len] = ' ';
+					len++;
+					space = false;
+				}
+				if (len + 1 < size)
+					buf[len] = ch[i];
+				len++;
+			}
+		}
+	}
+ out:
+	if (size > 0)
+		buf[len < size ? len : size - 1] = '\0';
+
+	return len;
+}
+
+/*
+ * Copies the bare JID of jid into buf.  The resource is stripped and the
+ * rest is folded to lower case, because local part and domain compare
+ * case insensitive.  Returns false if buf is too small.
+ */
+bool
+jid_bare(const char *jid, char *buf, size_t size)
+{
+	size_t len;
+
+	if (jid == NULL || buf == NULL)
+		return false;
+
+	if ((len = strcspn(jid, "/")) >= size)
+		return false;
+
+	for (size_t i = 0; i < len; i++)
+		buf[i] = tolower((unsigned char)jid[i]);
+	buf[len] = '\0';
+
+	return true;
+}
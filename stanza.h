@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef STANZA_H
+#define STANZA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* borrowed part of a caller owned buffer, not null terminated */
+struct slice {
+	const char *ptr;
+	size_t len;
+};
+
+enum stanza_type {
+	STANZA_EOF,
+	STANZA_START,
+	STANZA_END,
+	STANZA_TEXT,
+	STANZA_ERROR
+};
+
+struct stanza_token {
+	enum stanza_type type;
+	const char *elem;	/* start of the tag, for stanza_attr() */
+	struct slice name;	/* element name of START and END tokens */
+	struct slice text;	/* raw content of TEXT tokens, escaped */
+	bool empty;		/* START token closed by '/>', no END */
+	bool cdata;		/* TEXT token from a CDATA section */
+};
+
+/* buffer size that is always enough for stanza_escape() */
+#define STANZA_ESCAPE_SIZE(len) ((len) * 6 + 1)
+
+/* buffer size for stanza_flatten() */
+#define STANZA_FLATTEN_SIZE(len) ((len) * 5 + 1)
+
+/* pull parser over a null terminated buffer */
+struct stanza_reader {
+	const char *p;
+	int depth;
+};
+
+void stanza_reader_init(struct stanza_reader *r, const char *buf);
+enum stanza_type stanza_next(struct stanza_reader *r, struct stanza_token *t);
+
+bool stanza_name(const char *elem, struct slice *name);
+bool stanza_attr(const char *elem, const char *attr, struct slice *value);
+bool stanza_attr_copy(const char *elem, const char *attr, char *buf,
+    size_t size);
+const char *stanza_child(const char *elem, const char *name);
+size_t stanza_text(const char *elem, char *buf, size_t size);
+size_t stanza_unescape(const char *src, size_t len, char *dst);
+size_t stanza_escape(const char *src, size_t len, char *dst, size_t size);
+size_t stanza_flatten(const char *src, size_t len, char *dst);
+bool slice_eq(const struct slice *s, const char *str);
+bool jid_bare(const char *jid, char *buf, size_t size);
+
+#endif
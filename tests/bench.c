@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mxml.h>
+
+#include "../stanza.h"
+
+#define ROUNDS 100000
+
+/* keeps the compiler from dropping the measured calls */
+static volatile int sink;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, size_t size, double start, int rounds)
+{
+	double sec = now() - start;
+
+	printf("%-24s %7zu bytes %12.0f stanzas/s %9.1f MB/s\n", name, size,
+	    rounds / sec, rounds * (double)size / sec / 1e6);
+}
+
+/* the way sj's server_tag() classified stanzas before */
+static bool
+route_mxml(const char *tag)
+{
+	/* HACK: we need this, cause mxml can't parse tags by itself */
+	static mxml_node_t *tree = NULL;
+	const char *base = "<?xml ?><stream:stream></stream:stream>";
+	mxml_node_t *node;
+	const char *name;
+	bool is_iq;
+
+	if (tree == NULL) tree = mxmlLoadString(NULL, base, MXML_NO_CALLBACK);
+	mxmlLoadString(tree, tag, MXML_NO_CALLBACK);
+	if ((node = mxmlGetNextSibling(mxmlGetFirstChild(tree))) == NULL)
+		errx(EXIT_FAILURE, "no node found");
+
+	name = mxmlGetElement(node);
+	is_iq = strcmp(name, "iq") == 0 && mxmlElementGetAttr(node, "id");
+	mxmlDelete(node);
+
+	return is_iq;
+}
+
+static bool
+route_scan(const char *tag)
+{
+	struct slice name;
+	struct slice id;
+
+	if (stanza_name(tag, &name) == false)
+		errx(EXIT_FAILURE, "no node found");
+
+	return slice_eq(&name, "iq") && stanza_attr(tag, "id", &id);
+}
+
+static char *
+message(size_t body)
+{
+	const char *head = "<message from='alice@server.org/sj' "
+	    "to='bob@server.org' type='chat' id='12345'>"
+	    "<active xmlns='http://jabber.org/protocol/chatstates'/><body>";
+	const char *tail = "</body></message>";
+	char *tag;
+
+	if ((tag = malloc(strlen(head) + body + strlen(tail) + 1)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	strcpy(tag, head);
+	for (size_t i = 0; i < body; i++)
+		tag[strlen(head) + i] = i % 7 == 6 ? ' ' : 'a' + i % 26;
+	strcpy(tag + strlen(head) + body, tail);
+
+	return tag;
+}
+
+static void
+bench_route(void)
+{
+	size_t sizes[] = {16, 256, 4096};
+
+	for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+		char *tag = message(sizes[i]);
+		size_t len = strlen(tag);
+		int rounds = ROUNDS / (1 + sizes[i] / 256);
+		double start;
+
+		start = now();
+		for (int r = 0; r < rounds; r++)
+			sink += route_mxml(tag);
+		report("route mxml", len, start, rounds);
+
+		start = now();
+		for (int r = 0; r < rounds; r++)
+			sink += route_scan(tag);
+		report("route scan", len, start, rounds);
+
+		free(tag);
+	}
+}
+
+/* the way messaged's escape_tag() worked before, one strcat per byte */
+static char *
+escape_strcat(const char *string)
+{
+	char *new;
+	char ch[2] = {'\0', '\0'};
+	size_t length = 1;
+
+	for (size_t i = 0; string[i]; i++) {
+		if (string[i] == '<') length += 4;
+		else if (string[i] == '&') length += 5;
+		else length++;
+	}
+
+	if ((new = calloc(length, sizeof *new)) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	for (; string[0]; string++) {
+		switch (string[0]) {
+		case '<':
+			strcat(new, "&lt;");
+			break;
+		case '&':
+			strcat(new, "&amp;");
+			break;
+		default:
+			ch[0] = string[0];
+			strcat(new, ch);
+		}
+	}
+
+	return new;
+}
+
+/* pasted log lines, every 40th byte needs escaping */
+static char *
+text(size_t size)
+{
+	const char *line = "2015-11-21 12:00:01 <kernel> eth0: link up, "
+	    "1000Mbps & full duplex\n";
+	char *str;
+
+	if ((str = malloc(size + 1)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+	for (size_t i = 0; i < size; i++)
+		str[i] = line[i % strlen(line)];
+	str[size] = '\0';
+
+	return str;
+}
+
+static void
+bench_escape(void)
+{
+	size_t sizes[] = {64, 1024, 16384};
+
+	for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+		char *str = text(sizes[i]);
+		size_t size = STANZA_ESCAPE_SIZE(sizes[i]);
+		char *buf;
+		int rounds = ROUNDS / (1 + sizes[i] / 64);
+		/* the old code is quadratic, keep its runtime bearable */
+		int slow = rounds / (1 + sizes[i] / 1024);
+		double start;
+
+		if ((buf = malloc(size)) == NULL)
+			err(EXIT_FAILURE, "malloc");
+
+		start = now();
+		for (int r = 0; r < slow; r++) {
+			char *esc = escape_strcat(str);
+			sink += esc[0];
+			free(esc);
+		}
+		report("escape strcat", sizes[i], start, slow);
+
+		start = now();
+		for (int r = 0; r < rounds; r++)
+			sink += stanza_escape(str, sizes[i], buf, size);
+		report("escape single pass", sizes[i], start, rounds);
+
+		free(buf);
+		free(str);
+	}
+}
+
+int
+main(void)
+{
+	bench_route();
+	bench_escape();
+
+	return EXIT_SUCCESS;
+}
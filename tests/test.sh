@@ -4,13 +4,16 @@ export MALLOC_OPTIONS="S"
 
 . ./tap-functions -u
 
-plan_tests 13
+plan_tests 60
 
 # prepare
 
+history="../history"
 iqd="../iqd"
 messaged="../messaged"
 presenced="../presenced"
+sj="../sj"
+sjq="../sjq"
 
 tmpdir=$(mktemp -d sj_tests_XXXXXX)
 
@@ -33,6 +36,211 @@ ok $? "iqd tag delivery"
 test -s "$tmpdir/in"
 ok "$?" "xmpp:time response"
 
+# persistent worker gets both requests over one pipe
+mkdir -p "$tmpdir/wrk/worker"
+ln -s '../../../../xmpp_time' "$tmpdir/wrk/worker/urn:xmpp:time"
+touch "$tmpdir/wrk/in"
+
+cat iq.xml | $iqd -d "$tmpdir/wrk"
+ok $? "iqd with worker starting and ending"
+
+test "$(grep -o "<utc>" "$tmpdir/wrk/in" | wc -l)" -eq 2
+ok $? "xmpp:time worker responses"
+
+# builtins answer without an extension program
+mkdir -p "$tmpdir/bltn"
+touch "$tmpdir/bltn/in"
+{ cat iq.xml
+  echo "<iq type='get' from='server.org' id='p1'>"
+  echo "<ping xmlns='urn:xmpp:ping'/></iq>"
+} | $iqd -d "$tmpdir/bltn"
+test "$(grep -o "<utc>" "$tmpdir/bltn/in" | wc -l)" -eq 2
+ok $? "builtin xmpp:time responses"
+
+grep -q "<iq type='result' to='server.org' id='p1'></iq>" "$tmpdir/bltn/in"
+ok $? "builtin ping response"
+
+# results wait for the late reader of their fifo
+mkfifo "$tmpdir/bltn/late"
+(sleep 1; cat "$tmpdir/bltn/late" > "$tmpdir/bltn/late.out") &
+{ echo "<iq type='result' id='late'/>"
+  echo "<iq type='get' from='server.org' id='p2'>"
+  echo "<ping xmlns='urn:xmpp:ping'/></iq>"
+  sleep 2
+} | $iqd -d "$tmpdir/bltn"
+wait
+grep -q "<iq type='result' id='late'/>" "$tmpdir/bltn/late.out"
+ok $? "iqd delivers results to late readers"
+
+grep -q "id='p2'" "$tmpdir/bltn/in"
+ok $? "iqd answers while a result is pending"
+
+# handlers are found by prefix and reloaded, when ext/ changes
+disco="$tmpdir/bltn/ext/http:%2F%2Fjabber.org%2Fprotocol%2F*"
+{ echo "<iq type='get' id='d1'><query xmlns='urn:test'/></iq>"
+  sleep 1
+  mkdir "$tmpdir/bltn/ext"
+  touch "$disco" "$tmpdir/bltn/ext/urn:test"
+  sleep 1
+  echo "<iq type='get' id='d2'>"
+  echo "<query xmlns='http://jabber.org/protocol/commands'/></iq>"
+  echo "<iq type='get' id='d3'><query xmlns='urn:test'/></iq>"
+} | $iqd -d "$tmpdir/bltn"
+grep -q "id='d2'" "$disco"
+ok $? "iqd routes namespaces by prefix"
+
+grep -q "id='d3'" "$tmpdir/bltn/ext/urn:test" &&
+    ! grep -q "id='d1'" "$tmpdir/bltn/ext/urn:test"
+ok $? "iqd reloads its handlers"
+
+# slow programs run besides the other requests and are killed on timeout
+printf '#!/bin/sh\ncat > /dev/null; sleep 5; echo late >> "$2/slow"\n' \
+    > "$tmpdir/bltn/ext/urn:slow"
+chmod +x "$tmpdir/bltn/ext/urn:slow"
+start=$(date +%s)
+{ echo "<iq type='get' id='s1'><query xmlns='urn:slow'/></iq>"
+  echo "<iq type='get' from='server.org' id='p3'>"
+  echo "<ping xmlns='urn:xmpp:ping'/></iq>"
+} | $iqd -t 1 -d "$tmpdir/bltn"
+test $(($(date +%s) - start)) -lt 4 && ! test -e "$tmpdir/bltn/slow"
+ok $? "iqd kills programs after the timeout"
+
+grep -q "id='p3'" "$tmpdir/bltn/in"
+ok $? "iqd answers while a program runs"
+
+# entity capabilities
+exodus="QgayPKawpkPSDYmwT_WM94uAlu0="
+mkdir "$tmpdir/bltn/.caps"
+{ echo "<iq type='get' from='a@b/c' id='i1'><query node='n#v'"
+  echo " xmlns='http://jabber.org/protocol/disco#info'/></iq>"
+  echo "<iq type='result' id='caps_$exodus'><query"
+  echo " xmlns='http://jabber.org/protocol/disco#info'>"
+  echo "<identity category='client' name='Exodus 0.9.1' type='pc'/>"
+  for f in caps disco#info disco#items muc; do
+	echo "<feature var='http://jabber.org/protocol/$f'/>"
+  done
+  echo "</query></iq>"
+  echo "<iq type='result' id='caps_AAAA'><query"
+  echo " xmlns='http://jabber.org/protocol/disco#info'/></iq>"
+} | $iqd -d "$tmpdir/bltn"
+test "$(wc -c < "$tmpdir/bltn/caps")" -eq 29
+ok $? "iqd writes the ver of its entity capabilities"
+
+grep -q "id='i1'><query xmlns='http://jabber.org/protocol/disco#info' \
+node='n#v'><identity category='client' type='pc' name='sj'/>" \
+    "$tmpdir/bltn/in" &&
+    grep -q "<feature var='urn:test'/>" "$tmpdir/bltn/in"
+ok $? "iqd answers disco#info"
+
+test -s "$tmpdir/bltn/.caps/$exodus" && ! test -e "$tmpdir/bltn/.caps/AAAA"
+ok $? "iqd caches verified disco#info results"
+
+# roster cache
+mkdir "$tmpdir/rst"
+touch "$tmpdir/rst/in"
+printf '# ver v1\nold@host\tboth\tOld\n' > "$tmpdir/rst/roster"
+{ echo "<iq type='result' id='roster_1'>"
+  echo "<query xmlns='jabber:iq:roster' ver='v2'>"
+  echo "<item jid='bob@host' subscription='both' name='Bob'>"
+  echo "<group>Friends</group><group>Work</group></item>"
+  echo "<item jid='al@host' subscription='to'/></query></iq>"
+  echo "<iq type='set' id='p1'><query xmlns='jabber:iq:roster' ver='v3'>"
+  echo "<item jid='al@host' subscription='remove'/></query></iq>"
+  echo "<iq type='set' id='p2' from='eve@host'>"
+  echo "<query xmlns='jabber:iq:roster' ver='v4'>"
+  echo "<item jid='eve@host'/></query></iq>"
+} | $iqd -v -u me@host -d "$tmpdir/rst" 2> /dev/null
+grep -q "id='roster_1'><query xmlns='jabber:iq:roster' ver='v1'/>" \
+    "$tmpdir/rst/in"
+ok $? "iqd asks for the roster changes since its cached version"
+
+test "$(cat "$tmpdir/rst/roster")" = \
+    "$(printf '# ver v3\nbob@host\tboth\tBob\tFriends\tWork')"
+ok $? "iqd keeps the roster cache up to date"
+
+grep -q "<iq type='result' id='p1'/>" "$tmpdir/rst/in" &&
+    ! grep -q "id='p2'" "$tmpdir/rst/in"
+ok $? "iqd acknowledges just the roster pushes of the server"
+
+echo "<iq type='set' id='p3' from='me@host'><query xmlns='jabber:iq:roster'>\
+<item jid='zoe@host' subscription='none'/></query></iq>" |
+    $iqd -u me@host -d "$tmpdir/rst"
+grep -q "id='roster_1'><query xmlns='jabber:iq:roster'/>" "$tmpdir/rst/in" &&
+    grep -q "^zoe@host	none	$" "$tmpdir/rst/roster"
+ok $? "iqd fetches the roster without versioning"
+
+{ echo "<iq type='result' id='x1'><query xmlns='jabber:iq:roster'>"
+  echo "<item jid='mallory@host'/></query></iq>"
+  echo "<iq type='result' id='roster_1' from='mallory@host'>"
+  echo "<query xmlns='jabber:iq:roster'><item jid='mallory@host'/></query></iq>"
+} | $iqd -u me@host -d "$tmpdir/rst" 2> /dev/null
+grep -q "^zoe@host	" "$tmpdir/rst/roster" &&
+    ! grep -q "^mallory@host" "$tmpdir/rst/roster"
+ok $? "iqd ignores rosters, that it did not ask for"
+
+echo "<iq type='set' id='p4' from='Me@Host'><query xmlns='jabber:iq:roster'>\
+<item jid='amy@host' subscription='to'/></query></iq>" |
+    $iqd -u me@HOST -d "$tmpdir/rst"
+grep -q "^amy@host	to	" "$tmpdir/rst/roster"
+ok $? "iqd compares the jid of roster pushes case insensitive"
+
+# requests of local clients
+mkdir "$tmpdir/cli"
+touch "$tmpdir/cli/in"
+{ sleep 1; echo "<iq type='result' id='iqd_1' from='host'/>"; sleep 2; } |
+    $iqd -d "$tmpdir/cli" &
+sleep 0.5
+$sjq -d "$tmpdir/cli" \
+    "<iq type='get' id='x'><ping xmlns='urn:xmpp:ping'/></iq>" \
+    > "$tmpdir/cli/result"
+ok $? "sjq gets the result of its request"
+
+grep -q "id='iqd_1'><ping" "$tmpdir/cli/in" &&
+    test "$(cat "$tmpdir/cli/result")" = \
+    "<iq type='result' id='x' from='host'/>"
+ok $? "iqd restores the id of the request"
+
+$sjq -d "$tmpdir/cli" -t 1 \
+    "<iq type='get' id='y'><ping xmlns='urn:xmpp:ping'/></iq>" 2> /dev/null
+test $? -eq 1
+ok $? "sjq fails without an answer"
+wait
+
+# results may be longer than the queue of a client
+{ sleep 1; echo "<iq type='result' id='iqd_1'><query xmlns='urn:big'>"
+  head -c 2097152 /dev/zero | tr '\0' 'a'; echo "</query></iq>"; sleep 2; } |
+    $iqd -d "$tmpdir/cli" &
+sleep 0.5
+$sjq -d "$tmpdir/cli" "<iq type='get' id='b'><query xmlns='urn:big'/></iq>" \
+    > "$tmpdir/cli/big"
+test "$(wc -c < "$tmpdir/cli/big")" -gt 2097152 &&
+    grep -q "</query></iq>$" "$tmpdir/cli/big"
+ok $? "sjq gets results longer than 1 MiB"
+wait
+
+# many requests on one connection are throttled, while sj is not there
+mkdir "$tmpdir/batch"
+mkfifo "$tmpdir/batch/in"
+{ for i in $(seq 100); do
+    test "$(grep -so "id='iqd_" "$tmpdir/batch/out" | wc -l)" -ge 6000 &&
+        break
+    sleep 0.2
+  done
+  awk 'BEGIN { for (i = 1; i <= 6000; i++)
+    print "<iq type=\047result\047 id=\047iqd_" i "\047/>" }'
+  sleep 2; } | $iqd -d "$tmpdir/batch" &
+sleep 0.5
+{ sleep 1; cat "$tmpdir/batch/in" > "$tmpdir/batch/out"; } &
+awk 'BEGIN { for (i = 1; i <= 6000; i++)
+    print "<iq type=\047set\047 id=\047s" i "\047>" \
+    "<query xmlns=\047jabber:iq:roster\047>" \
+    "<item jid=\047contact" i "@example.org\047 name=\047Contact\047>" \
+    "<group>Friends of " i "</group></item></query></iq>" }' |
+    $sjq -d "$tmpdir/batch" > "$tmpdir/batch/results"
+test $? -eq 0 && test "$(wc -l < "$tmpdir/batch/results")" -eq 6000
+ok $? "sjq sends a large batch of requests"
+wait
+
 #
 # messaged tests
 #
@@ -55,11 +263,102 @@ ok $? "empty messages are accepted"
 grep -q '^....-..-.. ..:.. <cari@server.org/.*> consectetur$' "$tmpdir/cari@server.org/out"
 ok $? "message without active element is accepted"
 
+grep -q '^....-..-.. ..:.. <dave@server.org/pc> 1 < 2 && 3 > 2$' "$tmpdir/dave@server.org/out"
+ok $? "message bodies are unescaped into one line"
+
+! grep -q 'phishing' "$tmpdir/alice@server.org/out" &&
+    test -s "$tmpdir/alice@server.org.evil/out"
+ok $? "contacts are matched by their whole bare jid"
+
+grep -q '<Dave@Server.org/phone> again$' "$tmpdir/dave@server.org/out"
+ok $? "contacts are matched case insensitive"
+
+groupdir=$(mktemp -d sj_tests_XXXXXX)
+$messaged -g -f batch -j "me@server.org" -d $groupdir < message.xml &&
+    test "$(cut -c 18- "$tmpdir/dave@server.org/out")" = \
+    "$(cut -c 18- "$groupdir/dave@server.org/out")"
+ok $? "group commit writes the same history"
+rm -rf $groupdir
+
 echo "Left angle bracket (<) and ampersands (&) MUST be escaped!" >> "$tmpdir/cari@server.org/in" &
-echo "" | $messaged -j "me@server.org" -d $tmpdir
+sleep 1 | $messaged -j "me@server.org" -d $tmpdir
 grep -q '>Left angle bracket (&lt;) and ampersands (&amp;) MUST be escaped!<' "$tmpdir/in"
 ok $? "input xml characters are escaped"
 
+echo "it's \"quoted\" > 1" >> "$tmpdir/cari@server.org/in" &
+sleep 1 | $messaged -j "me@server.org" -d $tmpdir
+grep -q '>it&apos;s &quot;quoted&quot; &gt; 1<' "$tmpdir/in"
+ok $? "quotes and right angle brackets are escaped"
+
+printf 'one\ntwo\r\nthree\n\nfour' > "$tmpdir/eve@server.org/in" &
+sleep 1 | $messaged -j "me@server.org" -d $tmpdir
+test "$(grep -o '<body>[a-z]*</body>' "$tmpdir/in" | tail -4 | tr -d '\n')" = \
+    "<body>one</body><body>two</body><body>three</body><body>four</body>"
+ok $? "every line is sent as a message of its own"
+
+test "$(grep -c '<me@server.org> [a-z]*$' "$tmpdir/eve@server.org/out")" -eq 4
+ok $? "every line is written into the history"
+
+# writes 1000 lines with one minute between them
+old_history() {
+	mkdir "$tmpdir/$1"
+	awk -v jid="$1" 'BEGIN { for (i = 0; i < 1000; i++)
+		printf "2015-11-01 %02d:%02d <%s> line %d\n",
+		    i / 60, i % 60, jid, i }' > "$tmpdir/$1/out"
+}
+
+old_history hist@server.org
+echo "last" > "$tmpdir/hist@server.org/in" &
+sleep 1 | $messaged -j "me@server.org" -d $tmpdir
+test -s "$tmpdir/hist@server.org/out.idx" &&
+    test "$($history -d $tmpdir -c hist@server.org)" -eq 1001
+ok $? "messaged indexes the history"
+
+test "$($history -d $tmpdir -n 2 hist@server.org | cut -c 18-)" = \
+    "$(printf '<hist@server.org> line 999\n<me@server.org> last')"
+ok $? "history shows the last lines"
+
+test "$($history -d $tmpdir -c -s '2015-11-01 10:00' -u '2015-11-01 11:00' \
+    hist@server.org)" -eq 60 &&
+    $history -d $tmpdir -s '2015-11-01 10:00' -u '2015-11-01 11:00' \
+    hist@server.org | head -1 | grep -q 'line 600$'
+ok $? "history finds lines by time"
+
+old_history roll@server.org
+echo "last" > "$tmpdir/roll@server.org/in" &
+sleep 1 | $messaged -r 10k -z gzip -j "me@server.org" -d $tmpdir
+test -s "$tmpdir/roll@server.org/out.000001.gz" &&
+    test "$(wc -l < "$tmpdir/roll@server.org/out")" -eq 1 &&
+    grep -q '^1	out.000001.gz	1000	' "$tmpdir/roll@server.org/manifest"
+ok $? "messaged seals and compresses full history segments"
+
+test "$($history -d $tmpdir -c roll@server.org)" -eq 1001 &&
+    test "$($history -d $tmpdir -n 2 roll@server.org | cut -c 18-)" = \
+    "$(printf '<roll@server.org> line 999\n<me@server.org> last')" &&
+    test "$($history -d $tmpdir -c -s '2015-11-01 10:00' \
+    -u '2015-11-01 11:00' roll@server.org)" -eq 60
+ok $? "history reads the segments as one stream"
+
+# every contact needs two file descriptors
+contacts=20000
+bigdir=$(mktemp -d sj_tests_XXXXXX)
+enough_fds=0
+ulimit -n $((contacts * 2 + 64)) 2>/dev/null && enough_fds=1
+skip $enough_fds "not enough file descriptors for $contacts contacts" 2 || {
+	awk -v n=$contacts -v d="$bigdir" 'BEGIN {
+		for (i = 0; i < n; i++) printf "%s/c%d@server.org\n", d, i }' |
+	    xargs mkdir
+	touch "$bigdir/in"
+	fifo="$bigdir/c$((contacts - 1))@server.org/in"
+	(while ! test -p "$fifo"; do sleep 0.1; done; echo "hello" > "$fifo") &
+	{ cat message.xml; sleep 2; } | $messaged -j "me@server.org" -d $bigdir
+	grep -q '<body>hello</body>' "$bigdir/in"
+	ok $? "messaged reads from $contacts contacts"
+	grep -q '<dave@server.org/pc> 1 < 2' "$bigdir/dave@server.org/out"
+	ok $? "messaged writes with $contacts contacts"
+}
+rm -rf $bigdir
+
 #
 # presenced tests
 #
@@ -77,6 +376,81 @@ ok $? "presenced create status file"
 test -s "$tmpdir/in"
 ok $? "presenced write status change into \"in\" file"
 
+test "$(cat "$tmpdir/bob@host/status")" = "away" &&
+    ! test -e "$tmpdir/bob@host/status.tmp"
+ok $? "presenced writes the presence of the best resource"
+
+test -e "$tmpdir/carol@host/status" && ! test -s "$tmpdir/carol@host/status"
+ok $? "presenced writes an empty status for offline buddies"
+
+grep -q '^# version [0-9]*$' "$tmpdir/presence.tsv" &&
+    grep -q '^bob@host	away		[0-9]*$' "$tmpdir/presence.tsv" &&
+    grep -q '^user@host	online	Ich bin gerade nicht hier	[0-9]*$' \
+    "$tmpdir/presence.tsv" &&
+    grep -q '^carol@host	offline		[0-9]*$' "$tmpdir/presence.tsv"
+ok $? "presenced writes the presence of all buddies into one file"
+
+{
+	echo "<presence from='eve@host/pc'><status>in a long meeting</status></presence>"
+	sleep 0.5
+	echo "<presence from='eve@host/pc'><show>xa</show></presence>"
+	sleep 0.5
+} | $presenced -w 0 -d $tmpdir
+test "$(cat "$tmpdir/eve@host/status")" = "xa"
+ok $? "presenced rewrites a shorter status"
+
+test "$(head -1 "$tmpdir/presence.tsv")" = "# version 3"
+ok $? "presenced continues the version of the snapshot"
+
+mkdir "$tmpdir/zoe@host"
+{
+	sleep 1; echo -n "busy" > "$tmpdir/zoe@host/mystatus"
+	sleep 1; rm "$tmpdir/zoe@host/mystatus"
+	sleep 1
+} | $presenced -d $tmpdir
+grep -q "<presence to='zoe@host'><status>busy</status>" "$tmpdir/in"
+ok $? "presenced sends a changed mystatus"
+
+grep -q "<presence to='zoe@host'><priority>1</priority>" "$tmpdir/in"
+ok $? "presenced sends a presence without status for a removed mystatus"
+
+for r in pc phone; do
+	echo "<presence from='dan@host/$r'><c hash='sha-1' node='http://x'"
+	echo " xmlns='http://jabber.org/protocol/caps'"
+	echo " ver='QgayPKawpkPSDYmwT/WM94uAlu0='/></presence>"
+done | $presenced -d $tmpdir
+test -e "$tmpdir/.caps/QgayPKawpkPSDYmwT_WM94uAlu0=" &&
+    test "$(grep -o "id='caps_Qgay" "$tmpdir/in" | wc -l)" -eq 1
+ok $? "presenced asks once for unknown entity capabilities"
+
+#
+# sj tests
+#
+
+# a scripted server on the descriptors 6 and 7
+mkdir "$tmpdir/sj"
+mkfifo "$tmpdir/sj/net"
+stream="<stream:stream xmlns='jabber:client' version='1.0'\
+ xmlns:stream='http://etherx.jabber.org/streams'>"
+{ echo "$stream<stream:features><mechanisms/></stream:features>"
+  sleep 0.5; echo "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>"
+  sleep 0.5; echo "$stream<stream:features><bind/></stream:features>"
+  sleep 0.5; echo "<iq type='result' id='bind_2'/>"
+  sleep 0.5; echo "<iq type='result' id='sess_1'/>"
+  sleep 4; } > "$tmpdir/sj/net" &
+echo secret | PATH="..:$PATH" $sj -u me -s host -d "$tmpdir/sj" \
+    6< "$tmpdir/sj/net" 7> "$tmpdir/sj/server" 2> /dev/null &
+sleep 3
+
+# the writer keeps the fifo open, so sj never sees its end
+sleep 2 > "$tmpdir/sj/in" &
+printf "<>" > "$tmpdir/sj/in"
+printf "<presence to='zoe@host'/>" > "$tmpdir/sj/in"
+sleep 0.5
+grep -q "<presence to='zoe@host'/>" "$tmpdir/sj/server"
+ok $? "sj skips a malformed tag in the fifo"
+wait
+
 # clean up
 rm -rf $tmpdir
 
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#	include <sys/inotify.h>
+#endif
+
+#include "ev.h"
+#include "watch.h"
+
+/* tells every watch, that it may have lost changes */
+static void
+notify_all(struct watcher *wr)
+{
+	struct watch *w, *tmp;
+
+	/* callbacks may delete their own watch */
+	for (w = LIST_FIRST(&wr->watches); w != NULL; w = tmp) {
+		tmp = LIST_NEXT(w, next);
+		w->cb(w, NULL);
+	}
+}
+
+#ifdef __linux__
+#define WATCH_MASK (IN_ATTRIB|IN_CREATE|IN_CLOSE_WRITE|IN_DELETE| \
+    IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+
+static void
+inotify_cb(struct ev_io *io, int revents)
+{
+	struct watcher *wr = io->data;
+	union {		/* aligns the events */
+		struct inotify_event ev;
+		char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+	} u;
+	ssize_t n;
+
+	(void)revents;
+	while ((n = read(io->fd, u.buf, sizeof u.buf)) > 0) {
+		for (char *p = u.buf; p < u.buf + n;) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			struct watch *w = NULL;
+
+			p += sizeof *ev + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				notify_all(wr);
+				continue;
+			}
+			if (ev->wd >= 0 && (size_t)ev->wd < wr->nwds)
+				w = wr->wds[ev->wd];
+			if (w == NULL)
+				continue;
+
+			/* the directory is gone */
+			if (ev->mask & IN_IGNORED) {
+				wr->wds[ev->wd] = NULL;
+				LIST_REMOVE(w, next);
+				w->wd = -1;
+				w->active = false;
+				w->cb(w, NULL);
+				continue;
+			}
+			w->cb(w, ev->len > 0 ? ev->name : NULL);
+		}
+	}
+	errno = 0;
+}
+#endif
+
+/* tells the watches without inotify descriptor to look themselves */
+static void
+poll_cb(struct ev_timer *t)
+{
+	struct watcher *wr = t->data;
+	struct watch *w, *tmp;
+	bool polled = false;
+
+	for (w = LIST_FIRST(&wr->watches); w != NULL; w = tmp) {
+		tmp = LIST_NEXT(w, next);
+		if (w->wd != -1)
+			continue;
+		polled = true;
+		w->cb(w, NULL);
+	}
+
+	if (polled || wr->io.fd == -1)
+		ev_timer_add(wr->ev, &wr->poll, WATCH_POLL);
+}
+
+bool
+watch_init(struct watcher *wr, struct ev_loop *ev)
+{
+	memset(wr, 0, sizeof *wr);
+	wr->ev = ev;
+	wr->io.fd = -1;
+	wr->poll.cb = poll_cb;
+	wr->poll.data = wr;
+	LIST_INIT(&wr->watches);
+
+#ifdef __linux__
+	if ((wr->io.fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) != -1) {
+		wr->io.events = EV_READ;
+		wr->io.cb = inotify_cb;
+		wr->io.data = wr;
+		if (ev_io_add(ev, &wr->io))
+			return true;
+		close(wr->io.fd);
+		wr->io.fd = -1;
+	}
+#endif
+	/* fall back to polling */
+	ev_timer_add(ev, &wr->poll, WATCH_POLL);
+	errno = 0;
+
+	return true;
+}
+
+bool
+watch_add(struct watcher *wr, struct watch *w, const char *path)
+{
+	if (w->active)
+		return true;
+	w->wd = -1;
+
+#ifdef __linux__
+	if (wr->io.fd != -1 && (w->wd = inotify_add_watch(wr->io.fd, path,
+	    w->no_writes ? WATCH_MASK & ~IN_CLOSE_WRITE : WATCH_MASK)) == -1) {
+		/* out of inotify watches, poll this directory instead */
+		if (errno != ENOSPC && errno != ENOMEM)
+			return false;
+		if (wr->poll.active == false)
+			ev_timer_add(wr->ev, &wr->poll, WATCH_POLL);
+		errno = 0;
+	}
+	if (w->wd != -1) {
+		if ((size_t)w->wd >= wr->nwds) {
+			size_t size = wr->nwds == 0 ? 64 : wr->nwds;
+			struct watch **wds;
+
+			while (size <= (size_t)w->wd)
+				size *= 2;
+			if ((wds = realloc(wr->wds, size * sizeof *wds))
+			    == NULL) {
+				inotify_rm_watch(wr->io.fd, w->wd);
+				w->wd = -1;
+				return false;
+			}
+			memset(wds + wr->nwds, 0,
+			    (size - wr->nwds) * sizeof *wds);
+			wr->wds = wds;
+			wr->nwds = size;
+		}
+		/* the same directory gives the same descriptor */
+		if (wr->wds[w->wd] != NULL) {
+			w->wd = -1;
+			errno = EEXIST;
+			return false;
+		}
+		wr->wds[w->wd] = w;
+	}
+#else
+	(void)path;
+#endif
+	LIST_INSERT_HEAD(&wr->watches, w, next);
+	w->active = true;
+
+	return true;
+}
+
+void
+watch_del(struct watcher *wr, struct watch *w)
+{
+	if (w->active == false)
+		return;
+#ifdef __linux__
+	if (w->wd != -1) {
+		inotify_rm_watch(wr->io.fd, w->wd);
+		wr->wds[w->wd] = NULL;
+		w->wd = -1;
+	}
+#else
+	(void)wr;
+#endif
+	LIST_REMOVE(w, next);
+	w->active = false;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015 Jan Klemkow <j.klemkow@wemelug.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <sys/queue.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ev.h"
+
+#define WATCH_POLL	2000	/* msec between polls without inotify */
+
+/*
+ * Watcher of a directory.  With inotify(7) the callback gets the name of
+ * every file, that is created, written, moved, removed or changes its
+ * mode.  A name of NULL means, that changes may be lost, so the owner has
+ * to look itself.  This is always the case on other systems, where all
+ * directories are polled every WATCH_POLL msec, and for directories, that
+ * inotify refuses for lack of watches.  The caller owns the memory.
+ */
+struct watch {
+	int wd;
+	bool active;		/* false after the directory is removed */
+	bool no_writes;		/* skip files, that are just written */
+	void (*cb)(struct watch *w, const char *name);
+	void *data;
+	LIST_ENTRY(watch) next;
+};
+
+struct watcher {
+	struct ev_loop *ev;
+	struct ev_io io;	/* inotify descriptor */
+	struct ev_timer poll;
+	struct watch **wds;	/* watches by their descriptor */
+	size_t nwds;
+	LIST_HEAD(, watch) watches;
+};
+
+bool watch_init(struct watcher *wr, struct ev_loop *ev);
+bool watch_add(struct watcher *wr, struct watch *w, const char *path);
+void watch_del(struct watcher *wr, struct watch *w);
+
+#endif
@@ -1,67 +1,95 @@
 #include <err.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
 #include <unistd.h>
 
-#include <mxml.h>
+#include "builtin.h"
+#include "stanza.h"
 
 static void
-send_time(FILE *fh, const char *to, const char *id)
+usage(void)
 {
-	char tzo[BUFSIZ];
-	char utc[BUFSIZ];
-	time_t t = time(NULL);
-
-	/* +HHMM  */
-	strftime(tzo, sizeof tzo, "%z", localtime(&t));
-
-	/* convert "+HHMM" to "+HH:MM" */
-	tzo[6] = tzo[5];
-	tzo[5] = tzo[4];
-	tzo[4] = tzo[3];
-	tzo[3] = ':';
-
-	/* 2006-12-19T17:58:35Z */
-	strftime(utc, sizeof utc, "%FT%TZ", gmtime(&t));
-
-	fprintf(fh,
-	"<iq type='result' to='%s' id='%s'>"
-	  "<time xmlns='urn:xmpp:time'>"
-	    "<tzo>%s</tzo>"
-	    "<utc>%s</utc>"
-	  "</time>"
-	"</iq>", to, id, tzo, utc);
+	fprintf(stderr, "xmpp:time [-l] [-d dir]\n");
+	exit(EXIT_FAILURE);
 }
 
-static void
-usage(void)
+/* answers the iq stanza tag, returns false if it is not usable */
+static bool
+answer(FILE *fh, const char *tag)
 {
-	fprintf(stderr, "xmpp:time [-d dir]\n");
-	exit(EXIT_FAILURE);
+	char id[BUFSIZ];
+	char from[BUFSIZ];
+	char esc_id[BUFSIZ];
+	char esc_from[BUFSIZ];
+	char result[BUFSIZ * 3];
+	struct slice type;
+	int len;
+
+	/* check iq tag */
+	if (stanza_attr_copy(tag, "id", id, sizeof id) == false) {
+		warnx("iq stanze has no \"id\" attribute");
+		return false;
+	}
+
+	if (stanza_attr_copy(tag, "from", from, sizeof from) == false) {
+		warnx("iq stanze has no \"from\" attribute");
+		return false;
+	}
+
+	if (stanza_attr(tag, "type", &type) == false) {
+		warnx("iq stanze has no \"type\" attribute");
+		return false;
+	}
+
+	if (slice_eq(&type, "get") == false) {
+		warnx("unable to handle iq type: %.*s", (int)type.len,
+		    type.ptr);
+		return false;
+	}
+
+	/* the attributes are unescaped, so escape them again for our answer */
+	if (stanza_escape(id, strlen(id), esc_id, sizeof esc_id) >=
+	    sizeof esc_id ||
+	    stanza_escape(from, strlen(from), esc_from, sizeof esc_from) >=
+	    sizeof esc_from) {
+		warnx("iq stanza attributes are too long");
+		return false;
+	}
+
+	len = builtin_answer("urn:xmpp:time", esc_from, esc_id, NULL, result,
+	    sizeof result);
+	if (len < 0 || (size_t)len >= sizeof result) {
+		warnx("iq result is too long");
+		return false;
+	}
+	fwrite(result, len, 1, fh);
+
+	return true;
 }
 
 int
 main(int argc, char *argv[])
 {
-	/* HACK: we need this, cause mxml can't parse pure tags */
-	mxml_node_t *tree = NULL;
-	mxml_node_t *node = NULL;
-	const char *base = "<?xml ?>";
-	const char *id = NULL;
-	const char *from = NULL;
-	const char *type = NULL;
+	char tag[BUFSIZ];
+	size_t len = 0;
+	size_t n;
 	char *dir = ".";
 	char out_file[PATH_MAX];
+	bool lines = false;
 	FILE *fh;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "d:h")) != -1) {
+	while ((ch = getopt(argc, argv, "d:hl")) != -1) {
 		switch (ch) {
 		case 'd':
 			dir = optarg;
 			break;
+		case 'l':
+			lines = true;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -71,32 +99,40 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if ((tree = mxmlLoadString(NULL, base, MXML_NO_CALLBACK)) == NULL)
-		err(EXIT_FAILURE, "unable to read xml tree");
-	mxmlLoadFile(tree, stdin, MXML_NO_CALLBACK);
-
-	/* check iq tag */
-	if ((node = mxmlGetFirstChild(tree)) == NULL)
-		errx(EXIT_FAILURE, "unable to parse xml data");
+	if (snprintf(out_file, sizeof out_file, "%s/in", dir) >=
+	    (int)sizeof out_file)
+		errx(EXIT_FAILURE, "%s: path too long", dir);
 
-	if ((id = mxmlElementGetAttr(node, "id")) == NULL)
-		errx(EXIT_FAILURE, "iq stanze has no \"id\" attribute");
+	/* worker mode: one iq stanza per line until iqd closes the pipe */
+	if (lines) {
+		if ((fh = fopen(out_file, "w")) == NULL)
+			err(EXIT_FAILURE, "fopen");
 
-	if ((from = mxmlElementGetAttr(node, "from")) == NULL)
-		errx(EXIT_FAILURE, "iq stanze has no \"from\" attribute");
+		while (fgets(tag, sizeof tag, stdin) != NULL) {
+			if (answer(fh, tag) && fflush(fh) == EOF)
+				err(EXIT_FAILURE, "fflush");
+		}
+		if (ferror(stdin))
+			err(EXIT_FAILURE, "fgets");
+		if (fclose(fh) == EOF)
+			err(EXIT_FAILURE, "fclose");
 
-	if ((type = mxmlElementGetAttr(node, "type")) == NULL)
-		errx(EXIT_FAILURE, "iq stanze has no \"type\" attribute");
+		return EXIT_SUCCESS;
+	}
 
-	if (strcmp(type, "get") != 0)
-		errx(EXIT_FAILURE, "unable to handle iq type: %s", type);
+	/* read the whole iq stanza */
+	while ((n = fread(tag + len, 1, sizeof(tag) - 1 - len, stdin)) > 0)
+		len += n;
+	if (ferror(stdin))
+		err(EXIT_FAILURE, "fread");
+	tag[len] = '\0';
 
 	/* open file for output */
-	snprintf(out_file, sizeof out_file, "%s/in", dir);
 	if ((fh = fopen(out_file, "w")) == NULL)
 		err(EXIT_FAILURE, "fopen");
 
-	send_time(fh, from, id);
+	if (answer(fh, tag) == false)
+		return EXIT_FAILURE;
 
 	if (fclose(fh) == EOF)
 		err(EXIT_FAILURE, "fclose");